@@ -0,0 +1,402 @@
+#include "access_log.h"
+
+/* Open the access log and start the logger thread
+ * Args:
+ *  - l: Access log to initialize
+ *  - conf: Tunables of the server (where to log, format and rate)
+ *  */
+void init_access_log(struct access_log *l, const struct server_conf *conf)
+{
+    unsigned long i;
+
+    bzero(l, sizeof(*l));
+    l->json = conf->log_json;
+    l->rate = conf->log_rate;
+
+    if (strcmp(conf->access_log, "-") == 0)
+        l->out = stderr;
+    else if ((l->out = fopen(conf->access_log, "a")) == NULL)
+        error("Cannot open the access log");
+
+    l->slots = calloc(LOG_QUEUE_SIZE, sizeof(struct log_slot));
+
+    // Every slot can first be written at its own position
+    for (i = 0; i < LOG_QUEUE_SIZE; i++)
+        l->slots[i].seq = i;
+
+    if ((l->efd = eventfd(0, 0)) < 0)
+        error("eventfd");
+
+    if ((errno = pthread_create(&l->thread, NULL, log_run, l)) != 0)
+        error("pthread_create");
+}
+
+/* Tell whether a record may be logged, at most rate per second for each kind of error
+ * Approximate when several workers race on a new second, never blocks.
+ * Args:
+ *  - l: Access log
+ *  - kind: Kind of the record
+ *  - suppressed: Set to the records of this kind left out since the last one allowed
+ * Return:
+ *  1 if it may be logged, 0 if it is only counted
+ *  */
+int log_allow(struct access_log *l, enum log_kind kind, unsigned long *suppressed)
+{
+    struct log_limit *lim = &l->limits[kind];
+    long long second;
+
+    *suppressed = 0;
+
+    // Every transfer done is logged
+    if (l->rate == 0 || kind == LOG_TRANSFER)
+        return 1;
+
+    second = now_us() / USEC;
+
+    if (__atomic_load_n(&lim->second, __ATOMIC_RELAXED) != second) {
+        __atomic_store_n(&lim->second, second, __ATOMIC_RELAXED);
+        __atomic_store_n(&lim->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_fetch_add(&lim->count, 1, __ATOMIC_RELAXED) >= (unsigned long) l->rate) {
+        __atomic_fetch_add(&lim->suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    *suppressed = __atomic_exchange_n(&lim->suppressed, 0, __ATOMIC_RELAXED);
+
+    return 1;
+}
+
+/* Queue a record for the logger thread, or drop it if the queue is full (workers never wait)
+ * Args:
+ *  - l: Access log
+ *  - rec: Record (copied)
+ *  */
+void log_push(struct access_log *l, struct log_record *rec)
+{
+    struct log_slot *slot;
+    unsigned long pos, seq;
+    uint64_t one = 1;
+
+    pos = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+
+    // Take a position: its slot must have been read a whole lap ago
+    while (1) {
+        slot = &l->slots[pos & (LOG_QUEUE_SIZE - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&l->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((long) (seq - pos) < 0) {
+            __atomic_fetch_add(&l->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else {
+            pos = __atomic_load_n(&l->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->rec = *rec;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    // Only a syscall when the logger thread sleeps
+    if (__atomic_exchange_n(&l->sleeping, 0, __ATOMIC_SEQ_CST) && write(l->efd, &one, sizeof(one)) < 0)
+        error("write(eventfd)");
+}
+
+/* Payload carried by a session so far
+ * Args:
+ *  - s: Session
+ * Return:
+ *  Bytes received (WRQ), or acknowledged by the client (RRQ)
+ *  */
+long long session_bytes(struct session *s)
+{
+    struct stat st;
+    long long size, sent;
+
+    if (s->type != RRQ)
+        return s->total_size;
+
+    if (s->map != NULL)
+        size = s->map_size;
+    else if (s->fd != NULL && fstat(fileno(s->fd), &st) == 0)
+        size = st.st_size;
+    else
+        return 0;
+
+    size -= s->range_start;
+    if (s->range_len > 0 && s->range_len < size)
+        size = s->range_len;
+
+    // The last block is shorter
+    sent = s->last_ack * (s->buffer_size - 4);
+
+    return sent < size ? sent : size;
+}
+
+/* Log a session which is over: transfer done, aborted, or request refused
+ * Args:
+ *  - l: Access log
+ *  - s: Session being freed
+ *  */
+void log_session(struct access_log *l, struct session *s)
+{
+    struct log_record rec;
+
+    if (s->start == 0)
+        rec.kind = LOG_REFUSED;
+    else if (s->end == END_DONE || s->end == END_JOINED || s->end == END_RANGE_DONE)
+        rec.kind = LOG_TRANSFER;
+    else
+        rec.kind = LOG_FAILED;
+
+    if (!log_allow(l, rec.kind, &rec.suppressed))
+        return;
+
+    rec.date = log_date();
+    rec.peer = s->peer;
+    rec.type = s->type;
+    memcpy(rec.filename, s->filename, FILENAME_SIZE);
+    memcpy(rec.options, s->options, sizeof(rec.options));
+    rec.bytes = s->start > 0 ? session_bytes(s) : 0;
+    rec.duration = s->start > 0 ? now_us() - s->start : 0;
+    rec.end = s->end;
+    rec.end_code = s->end_code;
+    rec.end_msg = s->end_msg;
+
+    log_push(l, &rec);
+}
+
+/* Log a datagram refused before any session (not a request, server busy, unknown TID)
+ * Args:
+ *  - l: Access log
+ *  - peer: Who sent it
+ *  - err_code: ERROR code sent back
+ *  - err_msg: Message of the ERROR (kept as is, must be static)
+ *  */
+void log_refused(struct access_log *l, struct sockaddr_storage *peer, int err_code, const char *err_msg)
+{
+    struct log_record rec;
+    int k;
+
+    if (!log_allow(l, LOG_REFUSED, &rec.suppressed))
+        return;
+
+    rec.kind = LOG_REFUSED;
+    rec.date = log_date();
+    rec.peer = *peer;
+    rec.type = NO;
+    rec.filename[0] = '\0';
+    for (k = 0; k < NB_OPTIONS; k++)
+        rec.options[k] = -1;
+    rec.bytes = 0;
+    rec.duration = 0;
+    rec.end = END_ERROR_SENT;
+    rec.end_code = err_code;
+    rec.end_msg = err_msg;
+
+    log_push(l, &rec);
+}
+
+/* Get the wall clock date, for the lines of the log
+ * Return:
+ *  Microseconds since the epoch
+ *  */
+long long log_date(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (long long) ts.tv_sec * USEC + ts.tv_nsec / 1000;
+}
+
+/* Print a string between quotes, escaped as JSON (names come from the clients)
+ * Args:
+ *  - out: Where to print
+ *  - str: String to print
+ *  */
+void print_json_string(FILE *out, const char *str)
+{
+    const unsigned char *c;
+
+    fputc('"', out);
+
+    for (c = (const unsigned char*) str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20 || *c == 0x7f)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
+    }
+
+    fputc('"', out);
+}
+
+/* Print one line of the log
+ * Args:
+ *  - out: Where to print
+ *  - l: Access log (format)
+ *  - rec: Record to print
+ *  */
+void print_record(FILE *out, struct access_log *l, struct log_record *rec)
+{
+    char date[32], peer[INET6_ADDRSTRLEN + 8];
+    const char *result;
+    time_t sec;
+    struct tm tm;
+    int k, first;
+
+    sec = rec->date / USEC;
+    gmtime_r(&sec, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+    format_addr(&rec->peer, peer, sizeof(peer));
+
+    if (rec->kind == LOG_REFUSED)
+        result = "refused";
+    else if (rec->end == END_DONE)
+        result = "ok";
+    else if (rec->end == END_JOINED)
+        result = "joined";
+    else if (rec->end == END_RANGE_DONE)
+        result = "range";
+    else if (rec->end == END_TIMEOUT)
+        result = "timeout";
+    else if (rec->end == END_ERROR_RECEIVED)
+        result = "peer_error";
+    else if (rec->end == END_SEND_FAILED)
+        result = "unreachable";
+    else
+        result = "error";
+
+    if (l->json) {
+        fprintf(out, "{\"time\":\"%s.%03lldZ\",\"client\":\"%s\",\"op\":\"%s\",\"file\":",
+                date, rec->date % USEC / 1000, peer, rec->type == RRQ ? "RRQ" : rec->type == WRQ ? "WRQ" : "");
+        print_json_string(out, rec->filename);
+
+        fprintf(out, ",\"options\":{");
+        for (k = 0, first = 1; k < NB_OPTIONS; k++) {
+            if (rec->options[k] == -1)
+                continue;
+
+            fprintf(out, "%s\"%s\":%lld", first ? "" : ",", server_options[k], rec->options[k]);
+            first = 0;
+        }
+
+        fprintf(out, "},\"bytes\":%lld,\"duration\":%.6f,\"result\":\"%s\"", rec->bytes, (double) rec->duration / USEC, result);
+
+        if (rec->end == END_ERROR_SENT || rec->end == END_ERROR_RECEIVED)
+            fprintf(out, ",\"error_code\":%d", rec->end_code);
+
+        if (rec->end == END_ERROR_SENT && rec->end_msg != NULL) {
+            fprintf(out, ",\"error\":");
+            print_json_string(out, rec->end_msg);
+        }
+
+        if (rec->suppressed > 0)
+            fprintf(out, ",\"suppressed\":%lu", rec->suppressed);
+
+        fprintf(out, "}\n");
+        return;
+    }
+
+    fprintf(out, "%s.%03lldZ %s %s ", date, rec->date % USEC / 1000, peer,
+            rec->type == RRQ ? "RRQ" : rec->type == WRQ ? "WRQ" : "-");
+    print_json_string(out, rec->filename);
+
+    for (k = 0; k < NB_OPTIONS; k++) {
+        if (rec->options[k] != -1)
+            fprintf(out, " %s=%lld", server_options[k], rec->options[k]);
+    }
+
+    fprintf(out, " bytes=%lld duration=%.6f result=%s", rec->bytes, (double) rec->duration / USEC, result);
+
+    if (rec->end == END_ERROR_SENT || rec->end == END_ERROR_RECEIVED)
+        fprintf(out, " code=%d", rec->end_code);
+
+    if (rec->end == END_ERROR_SENT && rec->end_msg != NULL) {
+        fprintf(out, " error=");
+        print_json_string(out, rec->end_msg);
+    }
+
+    if (rec->suppressed > 0)
+        fprintf(out, " suppressed=%lu", rec->suppressed);
+
+    fprintf(out, "\n");
+}
+
+/* Write the records queued, until the process stops (run by the logger thread)
+ * Args:
+ *  - arg: Access log (struct access_log*)
+ * Return:
+ *  Never returns
+ *  */
+void *log_run(void *arg)
+{
+    struct access_log *l = arg;
+    struct log_slot *slot;
+    unsigned long tail;
+    uint64_t count;
+
+    while (1) {
+        tail = l->tail;
+        slot = &l->slots[tail & (LOG_QUEUE_SIZE - 1)];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == tail + 1) {
+            print_record(l->out, l, &slot->rec);
+
+            // The slot can be written again one lap later
+            __atomic_store_n(&slot->seq, tail + LOG_QUEUE_SIZE, __ATOMIC_RELEASE);
+            __atomic_store_n(&l->tail, tail + 1, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&l->written, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Lines go out in bursts, once the queue is empty
+        fflush(l->out);
+
+        __atomic_store_n(&l->sleeping, 1, __ATOMIC_SEQ_CST);
+
+        // A record queued before the flag was seen would not wake us up
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == tail + 1) {
+            __atomic_store_n(&l->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (read(l->efd, &count, sizeof(count)) < 0 && errno != EINTR)
+            error("read(eventfd)");
+    }
+
+    return NULL;
+}
+
+/* Wait (a while at most) until the records queued are written, before stopping the process
+ * Args:
+ *  - l: Access log
+ *  */
+void drain_access_log(struct access_log *l)
+{
+    long long limit = now_us() + LOG_DRAIN_WAIT;
+
+    while (__atomic_load_n(&l->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&l->head, __ATOMIC_ACQUIRE) && now_us() < limit)
+        usleep(1000);
+
+    fflush(l->out);
+}
+
+/* Print the counters of the access log
+ * Args:
+ *  - out: Where to print
+ *  - l: Access log
+ *  */
+void print_access_log(FILE *out, struct access_log *l)
+{
+    fprintf(out, "%-10s written=%lu dropped=%lu queued=%lu\n", "log",
+            __atomic_load_n(&l->written, __ATOMIC_RELAXED), __atomic_load_n(&l->dropped, __ATOMIC_RELAXED),
+            __atomic_load_n(&l->head, __ATOMIC_RELAXED) - __atomic_load_n(&l->tail, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,80 @@
+#ifndef ACCESS_LOG_H
+
+#define ACCESS_LOG_H
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "network.h"
+
+#define LOG_QUEUE_SIZE 4096 // Records waiting for the logger thread, the next ones are dropped (power of 2)
+#define DEFAULT_LOG_RATE 10 // Lines per second for each kind of error by default
+#define LOG_DRAIN_WAIT USEC // Longest wait for the logger thread when the server stops (us)
+
+/* What a record tells */
+enum log_kind {
+    LOG_TRANSFER, // Transfer done, or multicast group joined
+    LOG_FAILED, // Transfer aborted (ERROR or timeout)
+    LOG_REFUSED, // Request refused, or datagram from an unknown TID
+    LOG_KINDS // Number of kinds
+};
+
+/* One line of the access log, built by a worker and written by the logger thread */
+struct log_record {
+    enum log_kind kind; // What it tells
+    long long date; // When it happened (us since the epoch)
+    struct sockaddr_storage peer; // Client
+    enum request_code type; // RRQ/WRQ (NO if unknown)
+    char filename[FILENAME_SIZE]; // File asked (empty if unknown)
+    long long options[NB_OPTIONS]; // Options acknowledged, in the order of server_options (-1 if not)
+    long long bytes; // Payload transferred
+    long long duration; // From the request to the end of the session (us)
+    enum session_end end; // How it ended
+    int end_code; // ERROR code sent or received
+    const char *end_msg; // Message of the ERROR sent (NULL if none)
+    unsigned long suppressed; // Lines of the same kind left out just before this one
+};
+
+/* Slot of the queue, its sequence number tells who may use it */
+struct log_slot {
+    unsigned long seq; // Position it may be written at (== pos), or read at (== pos + 1)
+    struct log_record rec; // Record
+};
+
+/* Lines allowed for a kind of record during the current second */
+struct log_limit {
+    long long second; // Second being counted
+    unsigned long count; // Lines asked during it
+    unsigned long suppressed; // Lines left out since the last one written
+};
+
+/* Access log of the server: the workers queue records without lock, a thread writes them */
+struct access_log {
+    FILE *out; // Where the lines go
+    int json; // JSON lines instead of text
+    int rate; // Lines per second for each kind of error (0: no limit)
+    struct log_slot *slots; // Bounded multi-producer queue
+    unsigned long head; // Next position to write (workers)
+    unsigned long tail; // Next position to read (logger thread)
+    int efd; // eventfd waking the logger thread up
+    int sleeping; // Is the logger thread waiting on efd
+    struct log_limit limits[LOG_KINDS]; // Rate of each kind of record
+    unsigned long written; // Lines written
+    unsigned long dropped; // Records lost because the queue was full
+    pthread_t thread; // Logger thread
+};
+
+void init_access_log(struct access_log *l, const struct server_conf *conf);
+int log_allow(struct access_log *l, enum log_kind kind, unsigned long *suppressed);
+void log_push(struct access_log *l, struct log_record *rec);
+long long session_bytes(struct session *s);
+void log_session(struct access_log *l, struct session *s);
+void log_refused(struct access_log *l, struct sockaddr_storage *peer, int err_code, const char *err_msg);
+long long log_date(void);
+void print_json_string(FILE *out, const char *str);
+void print_record(FILE *out, struct access_log *l, struct log_record *rec);
+void *log_run(void *arg);
+void drain_access_log(struct access_log *l);
+void print_access_log(FILE *out, struct access_log *l);
+
+#endif /* end of include guard: ACCESS_LOG_H */
@@ -0,0 +1,462 @@
+#include "admission.h"
+
+/* Init the admission control shared by the workers
+ * Args:
+ *  - adm: Admission control to initialize
+ *  - conf: Tunables of the server, with the limits
+ *  */
+void init_admission(struct admission *adm, const struct server_conf *conf)
+{
+    bzero(adm, sizeof(*adm));
+    adm->conf = conf;
+    adm->queue_end = &adm->queue;
+
+    if ((errno = pthread_mutex_init(&adm->lock, NULL)) != 0)
+        error("pthread_mutex_init");
+}
+
+/* Tell whether the requests go through the admission control
+ * Args:
+ *  - conf: Tunables of the server
+ * Return:
+ *  1 if any limit (or the queue) is set, 0 if the requests are only limited by the sessions of each worker
+ *  */
+int admit_enabled(const struct server_conf *conf)
+{
+    return conf->max_total > 0 || conf->max_per_client > 0 || conf->session_rate > 0 || conf->subnet_rate > 0 || conf->max_queued > 0;
+}
+
+/* Start a token bucket full
+ * Args:
+ *  - b: Bucket to set
+ *  - rate: Bytes per second (0: not limited)
+ *  */
+void init_bucket(struct token_bucket *b, long long rate)
+{
+    b->rate = rate;
+    b->tokens = rate * BUCKET_BURST / USEC;
+    b->last = now_us();
+}
+
+/* Refill a token bucket, and tell how long to wait before sending
+ * Args:
+ *  - b: Bucket
+ *  - now: Current date (us)
+ * Return:
+ *  0 if it can send now, or the time (us) until the bytes sent ahead are paid back
+ *  */
+long long bucket_wait(struct token_bucket *b, long long now)
+{
+    long long elapsed, added;
+
+    if (b->rate == 0)
+        return 0;
+
+    // In whole seconds first: a long idle time times the rate could overflow
+    elapsed = now - b->last;
+    added = b->rate * (elapsed / USEC) + b->rate * (elapsed % USEC) / USEC;
+
+    // Fractions of a byte are kept for the next refill
+    if (added > 0) {
+        b->tokens += added;
+        b->last = now;
+
+        if (b->tokens > b->rate * BUCKET_BURST / USEC)
+            b->tokens = b->rate * BUCKET_BURST / USEC;
+    }
+
+    if (b->tokens >= 0)
+        return 0;
+
+    return (-b->tokens * USEC + b->rate - 1) / b->rate;
+}
+
+/* Count bytes sent in a token bucket, possibly more than it holds (paid back by waiting)
+ * Args:
+ *  - b: Bucket
+ *  - bytes: Bytes sent
+ *  */
+void bucket_take(struct token_bucket *b, long long bytes)
+{
+    if (b->rate > 0)
+        b->tokens -= bytes;
+}
+
+/* Bucket of an address or a subnet in the hash tables
+ * Args:
+ *  - family: AF_INET or AF_INET6
+ *  - addr: Address (4 or 16 bytes)
+ * Return:
+ *  Hash of the address
+ *  */
+uint64_t hash_addr(int family, const unsigned char *addr)
+{
+    return hash_content((const char*) addr, family == AF_INET6 ? 16 : 4);
+}
+
+/* Find the entry of a client address, created if unknown (with the lock held)
+ * Args:
+ *  - adm: Admission control
+ *  - peer: Address of the client (its port is ignored)
+ * Return:
+ *  The client, with its subnet if the subnets are limited
+ *  */
+struct admit_client *admit_client(struct admission *adm, const struct sockaddr_storage *peer)
+{
+    struct admit_client *c;
+    struct admit_subnet *net;
+    unsigned char addr[16], prefix[16];
+    int family = peer->ss_family, len, bits, i;
+    uint64_t h;
+
+    bzero(addr, sizeof(addr));
+
+    if (family == AF_INET6) {
+        memcpy(addr, &((const struct sockaddr_in6*) peer)->sin6_addr, 16);
+        len = 16;
+        bits = ADMIT_PREFIX6;
+    }
+    else {
+        memcpy(addr, &((const struct sockaddr_in*) peer)->sin_addr, 4);
+        len = 4;
+        bits = ADMIT_PREFIX4;
+    }
+
+    h = hash_addr(family, addr) % ADMIT_BUCKETS;
+
+    for (c = adm->clients[h]; c != NULL; c = c->next) {
+        if (c->family == family && memcmp(c->addr, addr, len) == 0)
+            return c;
+    }
+
+    c = calloc(1, sizeof(struct admit_client));
+    c->family = family;
+    memcpy(c->addr, addr, len);
+    c->adm = adm;
+    c->next = adm->clients[h];
+    adm->clients[h] = c;
+    adm->clients_known++;
+
+    if (adm->conf->subnet_rate == 0)
+        return c;
+
+    // Host bits cleared
+    memcpy(prefix, addr, sizeof(prefix));
+
+    for (i = bits / 8; i < len; i++)
+        prefix[i] = i == bits / 8 ? prefix[i] & (0xff << (8 - bits % 8)) : 0;
+
+    h = hash_addr(family, prefix) % ADMIT_BUCKETS;
+
+    for (net = adm->subnets[h]; net != NULL; net = net->next) {
+        if (net->family == family && memcmp(net->prefix, prefix, len) == 0)
+            break;
+    }
+
+    if (net == NULL) {
+        net = calloc(1, sizeof(struct admit_subnet));
+        net->family = family;
+        memcpy(net->prefix, prefix, len);
+        init_bucket(&net->bucket, adm->conf->subnet_rate);
+        net->next = adm->subnets[h];
+        adm->subnets[h] = net;
+        adm->subnets_known++;
+    }
+
+    net->refs++;
+    c->subnet = net;
+
+    return c;
+}
+
+/* Drop the entry of a client with no transfer running nor request waiting (with the lock held)
+ * Args:
+ *  - adm: Admission control
+ *  - c: Client, left untouched if still used
+ *  */
+void admit_forget(struct admission *adm, struct admit_client *c)
+{
+    struct admit_client **link;
+
+    if (c->active > 0 || c->queued > 0)
+        return;
+
+    for (link = &adm->clients[hash_addr(c->family, c->addr) % ADMIT_BUCKETS]; *link != c; link = &(*link)->next);
+
+    *link = c->next;
+    adm->clients_known--;
+
+    // Its subnet stays with the bytes sent ahead, for its next transfer: see admit_sweep()
+    if (c->subnet != NULL && --c->subnet->refs == 0)
+        c->subnet->idle = now_us();
+
+    free(c);
+}
+
+/* Drop the subnets left by their clients long enough ago, whose bucket is full again: a
+ * subnet kept until then starts its next transfer with what the previous ones sent ahead.
+ * Done at most every ADMIT_SWEEP, whichever worker calls it.
+ * Args:
+ *  - adm: Admission control
+ *  */
+void admit_sweep(struct admission *adm)
+{
+    struct admit_subnet **link;
+    struct admit_subnet *net;
+    long long now = now_us();
+    int h;
+
+    if (adm->conf->subnet_rate == 0 || now < __atomic_load_n(&adm->next_sweep, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&adm->lock);
+
+    // Another worker swept meanwhile
+    if (now < adm->next_sweep) {
+        pthread_mutex_unlock(&adm->lock);
+        return;
+    }
+
+    __atomic_store_n(&adm->next_sweep, now + ADMIT_SWEEP, __ATOMIC_RELAXED);
+
+    for (h = 0; h < ADMIT_BUCKETS; h++) {
+        for (link = &adm->subnets[h]; (net = *link) != NULL; ) {
+            if (net->refs == 0 && now - net->idle >= ADMIT_IDLE && bucket_wait(&net->bucket, now) == 0
+                    && net->bucket.tokens >= net->bucket.rate * BUCKET_BURST / USEC) {
+                *link = net->next;
+                adm->subnets_known--;
+                free(net);
+                continue;
+            }
+
+            link = &net->next;
+        }
+    }
+
+    pthread_mutex_unlock(&adm->lock);
+}
+
+/* Decide whether a request starts a transfer, from its address only: nothing is opened for it yet
+ * Args:
+ *  - adm: Admission control
+ *  - peer: Address of the client
+ *  - full: Is the worker receiving the request at its own maximum of sessions
+ *  - buffer: Request, copied if it has to wait
+ *  - n: Size of the request
+ *  - client: Set to the client counted if admitted, to be released with the session
+ * Return:
+ *  What to do with the request (enum admit_result)
+ *  */
+enum admit_result admit_request(struct admission *adm, const struct sockaddr_storage *peer, int full, const char *buffer, int n, struct admit_client **client)
+{
+    const struct server_conf *conf = adm->conf;
+    enum admit_result res;
+    struct admit_client *c;
+    struct admit_rq *q;
+    int over_client;
+
+    pthread_mutex_lock(&adm->lock);
+
+    // Retransmitted while waiting: it keeps its place
+    for (q = adm->queue; q != NULL; q = q->next) {
+        if (addr_equal(&q->peer, peer)) {
+            q->seen = now_us();
+            pthread_mutex_unlock(&adm->lock);
+            return ADMIT_QUEUED;
+        }
+    }
+
+    c = admit_client(adm, peer);
+    over_client = conf->max_per_client > 0 && c->active >= conf->max_per_client;
+
+    if (!over_client && !full && (conf->max_total == 0 || adm->active < conf->max_total)) {
+        c->active++;
+        c->last_admit = now_us();
+        adm->active++;
+        adm->admitted++;
+        pthread_mutex_unlock(&adm->lock);
+
+        *client = c;
+        return ADMIT_OK;
+    }
+
+    // Requests bigger than RFC2347 allows are not kept
+    if (adm->nb_queued < conf->max_queued && n <= (int) sizeof(q->dgram)) {
+        q = malloc(sizeof(struct admit_rq));
+        memcpy(&q->peer, peer, sizeof(q->peer));
+        memcpy(q->dgram, buffer, n);
+        q->len = n;
+        q->client = c;
+        q->seen = now_us();
+        q->next = NULL;
+
+        *adm->queue_end = q;
+        adm->queue_end = &q->next;
+        __atomic_store_n(&adm->nb_queued, adm->nb_queued + 1, __ATOMIC_RELAXED);
+        adm->waited++;
+        c->queued++;
+
+        pthread_mutex_unlock(&adm->lock);
+        return ADMIT_QUEUED;
+    }
+
+    if (over_client) {
+        adm->client_busy++;
+        res = ADMIT_CLIENT_BUSY;
+    }
+    else {
+        adm->busy++;
+        res = ADMIT_BUSY;
+    }
+
+    admit_forget(adm, c);
+    pthread_mutex_unlock(&adm->lock);
+
+    return res;
+}
+
+/* Release the transfer of a client, once its session is over
+ * Args:
+ *  - adm: Admission control
+ *  - c: Client counted when the request was admitted
+ *  */
+void admit_release(struct admission *adm, struct admit_client *c)
+{
+    pthread_mutex_lock(&adm->lock);
+
+    c->active--;
+    adm->active--;
+    admit_forget(adm, c);
+
+    pthread_mutex_unlock(&adm->lock);
+}
+
+/* Take the request waiting which starts a transfer next: the one of the client with the fewest
+ * transfers running, then whose last transfer started first (the clients take turns), then the
+ * oldest one, so that clients asking many files do not hold back the others.
+ * Requests whose client stopped retransmitting are dropped on the way.
+ * Args:
+ *  - adm: Admission control
+ * Return:
+ *  The request, counted for its client (to be freed by the caller), or NULL if none can start
+ *  */
+struct admit_rq *admit_next(struct admission *adm)
+{
+    const struct server_conf *conf = adm->conf;
+    struct admit_rq **link, **best_link = NULL;
+    struct admit_rq *q, *best = NULL;
+    long long now = now_us();
+
+    pthread_mutex_lock(&adm->lock);
+
+    if (conf->max_total > 0 && adm->active >= conf->max_total) {
+        pthread_mutex_unlock(&adm->lock);
+        return NULL;
+    }
+
+    for (link = &adm->queue; (q = *link) != NULL; ) {
+        if (now - q->seen > ADMIT_WAIT) {
+            if (adm->queue_end == &q->next)
+                adm->queue_end = link;
+
+            *link = q->next;
+            __atomic_store_n(&adm->nb_queued, adm->nb_queued - 1, __ATOMIC_RELAXED);
+            adm->expired++;
+            q->client->queued--;
+            admit_forget(adm, q->client);
+            free(q);
+            continue;
+        }
+
+        if ((conf->max_per_client == 0 || q->client->active < conf->max_per_client)
+                && (best == NULL || q->client->active < best->client->active
+                    || (q->client->active == best->client->active && q->client->last_admit < best->client->last_admit))) {
+            best = q;
+            best_link = link;
+        }
+
+        link = &q->next;
+    }
+
+    if (best != NULL) {
+        if (adm->queue_end == &best->next)
+            adm->queue_end = best_link;
+
+        *best_link = best->next;
+        __atomic_store_n(&adm->nb_queued, adm->nb_queued - 1, __ATOMIC_RELAXED);
+        best->client->queued--;
+        best->client->active++;
+        best->client->last_admit = now;
+        adm->active++;
+        adm->admitted++;
+    }
+
+    pthread_mutex_unlock(&adm->lock);
+
+    return best;
+}
+
+/* Tell if the next window may go out, or hold it back until what the transfer and its
+ * client's subnet sent ahead is paid back (see pace_charge())
+ * Args:
+ *  - s: Transfer about to send a window (server, admitted)
+ * Return:
+ *  - 0: The window can be sent
+ *  - 1: Held back, s->paced is the date it is sent at (also its deadline)
+ *  */
+int pace_window(struct session *s)
+{
+    struct admit_subnet *net = s->client->subnet;
+    long long now = now_us(), wait;
+
+    if ((wait = bucket_wait(&s->pace, now)) == 0 && net != NULL) {
+        pthread_mutex_lock(&s->client->adm->lock);
+        wait = bucket_wait(&net->bucket, now);
+        pthread_mutex_unlock(&s->client->adm->lock);
+    }
+
+    if (wait > 0) {
+        s->paced = now + wait;
+        s->deadline = s->paced;
+        STAT_ADD(s->conn.stats, paced, 1);
+        return 1;
+    }
+
+    s->paced = 0;
+
+    return 0;
+}
+
+/* Take a window sent from the buckets of its transfer and of its client's subnet
+ * Args:
+ *  - s: Transfer which sent a window let out by pace_window()
+ *  - bytes: Bytes of the datagrams queued (the last window is shorter)
+ *  */
+void pace_charge(struct session *s, long long bytes)
+{
+    struct admit_subnet *net = s->client->subnet;
+
+    bucket_take(&s->pace, bytes);
+
+    if (net != NULL) {
+        pthread_mutex_lock(&s->client->adm->lock);
+        bucket_take(&net->bucket, bytes);
+        pthread_mutex_unlock(&s->client->adm->lock);
+    }
+}
+
+/* Print the counters of the admission control
+ * Args:
+ *  - out: Where to print
+ *  - adm: Admission control
+ *  */
+void print_admission(FILE *out, struct admission *adm)
+{
+    pthread_mutex_lock(&adm->lock);
+
+    fprintf(out, "%-10s active=%d queued=%d clients=%lu subnets=%lu admitted=%lu waited=%lu expired=%lu busy=%lu client_busy=%lu\n", "admission",
+            adm->active, adm->nb_queued, adm->clients_known, adm->subnets_known,
+            adm->admitted, adm->waited, adm->expired, adm->busy, adm->client_busy);
+
+    pthread_mutex_unlock(&adm->lock);
+}
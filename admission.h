@@ -0,0 +1,95 @@
+#ifndef ADMISSION_H
+
+#define ADMISSION_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "network.h"
+
+#define ADMIT_BUCKETS 1024 // Size of the hash tables of the clients and of their subnets
+#define ADMIT_PREFIX4 24 // Bits of an IPv4 address making its subnet
+#define ADMIT_PREFIX6 64 // Bits of an IPv6 address making its subnet
+#define ADMIT_WAIT (3 * USEC) // A request queued whose client stayed silent this long is dropped (us)
+#define ADMIT_RQ_SIZE 512 // Largest request kept while waiting (RFC2347: a request with its options fits in 512 bytes)
+#define BUCKET_BURST (USEC / 10) // Tokens a bucket keeps at most, in time of its rate (us)
+#define ADMIT_SWEEP USEC // Time (us) between two sweeps of the subnets left by their clients
+#define ADMIT_IDLE (10 * USEC) // A subnet without clients is kept this long at least, and until its bucket is full (us)
+
+/* What the admission control does with a request */
+enum admit_result {
+    ADMIT_OK, // A transfer can start: counted for its client
+    ADMIT_QUEUED, // Waiting for a transfer to end (or already waiting, retransmitted)
+    ADMIT_BUSY, // Refused: the server is full and so is the queue
+    ADMIT_CLIENT_BUSY // Refused: its client has too many transfers and the queue is full
+};
+
+/* Addresses sharing a bandwidth (/24 in IPv4, /64 in IPv6) */
+struct admit_subnet {
+    int family; // AF_INET or AF_INET6
+    unsigned char prefix[16]; // Address, host bits cleared
+    struct token_bucket bucket; // Bytes its transfers may send together
+    int refs; // Clients of the subnet known
+    long long idle; // Date (us) its last client left (meaningless while refs > 0)
+    struct admit_subnet *next; // Next subnet in the same bucket
+};
+
+/* Address of a client with transfers running or requests waiting */
+struct admit_client {
+    int family; // AF_INET or AF_INET6
+    unsigned char addr[16]; // Address (4 or 16 bytes used)
+    int active; // Transfers running
+    int queued; // Requests waiting
+    long long last_admit; // Date (us) its last transfer started (0 if none yet)
+    struct admit_subnet *subnet; // Its subnet (NULL if subnets are not limited)
+    struct admission *adm; // Admission control holding the lock of the subnet
+    struct admit_client *next; // Next client in the same bucket
+};
+
+/* Request waiting for a transfer to end, with a copy of its datagram */
+struct admit_rq {
+    struct sockaddr_storage peer; // Client (TID of the request)
+    struct admit_client *client; // Its address
+    char dgram[ADMIT_RQ_SIZE]; // Request received
+    int len; // Size of the request
+    long long seen; // Date (us) the request was last received (retransmissions included)
+    struct admit_rq *next; // Next request, in the order they came
+};
+
+/* Limits on the transfers of all the workers, shared by them */
+struct admission {
+    const struct server_conf *conf; // Limits
+    pthread_mutex_t lock; // Protects everything below, and the buckets of the subnets
+    struct admit_client *clients[ADMIT_BUCKETS]; // Clients, by hash of their address
+    struct admit_subnet *subnets[ADMIT_BUCKETS]; // Subnets, by hash of their prefix
+    struct admit_rq *queue; // Requests waiting, oldest first
+    struct admit_rq **queue_end; // Where the next request queued is linked (next of the last one)
+    int nb_queued; // Requests waiting (read without the lock)
+    long long next_sweep; // Date (us) of the next sweep of the subnets (read without the lock)
+    int active; // Transfers running
+    unsigned long clients_known; // Clients in the table
+    unsigned long subnets_known; // Subnets in the table
+    unsigned long admitted; // Requests which started a transfer (at once or after waiting)
+    unsigned long waited; // Requests queued
+    unsigned long expired; // Requests dropped from the queue, their client gone
+    unsigned long busy; // Requests refused: server full
+    unsigned long client_busy; // Requests refused: client over its limit
+};
+
+void init_admission(struct admission *adm, const struct server_conf *conf);
+int admit_enabled(const struct server_conf *conf);
+void init_bucket(struct token_bucket *b, long long rate);
+long long bucket_wait(struct token_bucket *b, long long now);
+void bucket_take(struct token_bucket *b, long long bytes);
+uint64_t hash_addr(int family, const unsigned char *addr);
+struct admit_client *admit_client(struct admission *adm, const struct sockaddr_storage *peer);
+void admit_forget(struct admission *adm, struct admit_client *c);
+void admit_sweep(struct admission *adm);
+enum admit_result admit_request(struct admission *adm, const struct sockaddr_storage *peer, int full, const char *buffer, int n, struct admit_client **client);
+void admit_release(struct admission *adm, struct admit_client *c);
+struct admit_rq *admit_next(struct admission *adm);
+int pace_window(struct session *s);
+void pace_charge(struct session *s, long long bytes);
+void print_admission(FILE *out, struct admission *adm);
+
+#endif /* end of include guard: ADMISSION_H */
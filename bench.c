@@ -0,0 +1,617 @@
+#include "bench.h"
+
+/* Parse a size, with an optional K, M or G suffix (powers of 1024)
+ * Args:
+ *  - s: String to parse
+ * Return:
+ *  The size in bytes, or -1 if it is not a valid size
+ *  */
+long long parse_size(const char *s)
+{
+    char *end;
+    long long size;
+
+    size = strtoll(s, &end, 10);
+
+    switch (*end) {
+        case 'G': case 'g': size *= 1024; // fallthrough
+        case 'M': case 'm': size *= 1024; // fallthrough
+        case 'K': case 'k': size *= 1024; end++; break;
+    }
+
+    if (end == s || *end != 0 || size < 0)
+        return -1;
+
+    return size;
+}
+
+/* Write the synthetic file served during the benchmark
+ * Args:
+ *  - path: File to create
+ *  - size: Size of the file
+ *  */
+void make_file(const char *path, long long size)
+{
+    char chunk[65536];
+    FILE *f;
+    long long done;
+    size_t i, n;
+
+    if ((f = fopen(path, "wb")) == NULL)
+        error("Cannot create the benchmark file");
+
+    // Not all the same bytes, so nothing can shortcut the copy
+    srand(1);
+    for (i = 0; i < sizeof(chunk); i++)
+        chunk[i] = rand();
+
+    for (done = 0; done < size; done += n) {
+        n = size - done < (long long) sizeof(chunk) ? (size_t) (size - done) : sizeof(chunk);
+
+        if (fwrite(chunk, 1, n, f) != n)
+            error("Cannot write the benchmark file");
+    }
+
+    fclose(f);
+}
+
+/* Init the socket of a download, bound to any free port
+ * Args:
+ *  - conn: Connections info to set
+ *  - dst: Where to store the address of the server (pointed to by conn)
+ *  - port: Port of the server, on the loopback
+ *  */
+void bench_conn(struct conn_info *conn, struct sockaddr_storage *dst, int port)
+{
+    struct sockaddr_in src;
+    int fd;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        error("socket");
+
+    bzero(&src, sizeof(src));
+    src.sin_family = AF_INET;
+    src.sin_port = 0;
+    src.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr*) &src, sizeof(src)) < 0)
+        error("bind");
+
+    bzero(dst, sizeof(*dst));
+    ((struct sockaddr_in*) dst)->sin_family = AF_INET;
+    ((struct sockaddr_in*) dst)->sin_port = htons(port);
+    ((struct sockaddr_in*) dst)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bzero(conn, sizeof(*conn));
+    conn->fd = fd;
+    conn->sock = (struct sockaddr*) dst;
+    conn->addr_len = sizeof(struct sockaddr_in);
+}
+
+/* Note the date at which blocks were asked for the first time (request or ACK)
+ * Args:
+ *  - asked: Date (us) each block was asked, by block# % ring
+ *  - ring: Size of asked, at least the windowsize
+ *  - max_asked: Last block asked so far, updated
+ *  - upto: Last block asked now
+ *  */
+void bench_ask(long long *asked, int ring, long long *max_asked, long long upto)
+{
+    long long now = now_us();
+
+    for (; *max_asked < upto; (*max_asked)++)
+        asked[(*max_asked + 1) % ring] = now;
+}
+
+/* Record the latency of a block
+ * Args:
+ *  - b: Download receiving the block
+ *  - lat: Time between the block being asked and received (us)
+ *  */
+void bench_latency(struct bench_session *b, int lat)
+{
+    if (b->nb_lat == b->max_lat) {
+        b->max_lat = b->max_lat * 2 + 1024;
+
+        if ((b->lat = realloc(b->lat, b->max_lat * sizeof(int))) == NULL)
+            error("bench_latency");
+    }
+
+    b->lat[b->nb_lat++] = lat;
+}
+
+/* Download the synthetic file once, timing each block
+ * The latency of a block runs from the request or ACK which first asked for
+ * it to its arrival in order: losses show up as blocks waiting for a RTO.
+ * Args:
+ *  - arg: Download to run (struct bench_session)
+ *  */
+void *bench_session(void *arg)
+{
+    struct bench_session *b = arg;
+    const struct bench_conf *conf = b->conf;
+    struct client_conf cconf;
+    struct conn_info conn;
+    struct sockaddr_storage server;
+    struct session s;
+    struct dgram_batch in;
+    struct pollfd pfd;
+    char rq[DEFAULT_BLK_SIZE]; // Request sent
+    long long *asked; // Date (us) each block in flight was asked, by block# % windowsize
+    long long max_asked = 0; // Last block asked
+    long long last_block;
+    int status = 0;
+    int k, nb, n;
+
+    bzero(&cconf, sizeof(cconf));
+    cconf.type = RRQ;
+    cconf.retry = DEFAULT_RETRY;
+    cconf.pref_buffer_size = conf->blksize;
+    cconf.timeout = DEFAULT_TIMEOUT;
+    cconf.utimeout = conf->utimeout / 1000;
+    cconf.windowsize = conf->windowsize;
+    cconf.rollover = DEFAULT_ROLLOVER;
+
+    bench_conn(&conn, &server, conf->port);
+    init_batch(&in, conf->batch);
+
+    asked = calloc(conf->windowsize, sizeof(long long));
+
+    if ((n = send_rq(conn, RRQ, rq, sizeof(rq), BENCH_FILE, "octet", cconf.pref_buffer_size, cconf.timeout,
+                    conf->utimeout, cconf.windowsize, cconf.rollover, -1, 0, 0, 0)) < 0)
+        error("send_rq");
+
+    init_client_session(&s, conn, &cconf, NULL, rq, n);
+    bench_ask(asked, conf->windowsize, &max_asked, 1);
+
+    // The payload is thrown away, only the transfer is measured
+    if ((s.fd = fopen("/dev/null", "wb")) == NULL)
+        error("Cannot open /dev/null");
+
+    pfd.fd = conn.fd;
+    pfd.events = POLLIN;
+
+    while (status == 0) {
+        if (now_us() >= s.deadline && client_timeout(&s, BENCH_FILE)) {
+            status = -1;
+            break;
+        }
+
+        if (poll(&pfd, 1, timer_wait(s.deadline)) <= 0)
+            continue;
+
+        nb = recv_batch(conn.fd, &in, MSG_DONTWAIT, NULL);
+
+        for (k = 0; k < nb && status == 0; k++) {
+            last_block = s.last_block;
+
+            status = client_dgram(&s, BATCH_DGRAM(&in, k), BATCH_LEN(&in, k), &in.addrs[k], BENCH_FILE);
+
+            // OACK: the first window is asked by ACK 0
+            if (BATCH_LEN(&in, k) >= 2 && BATCH_DGRAM(&in, k)[1] == 6) {
+                if (s.windowsize > conf->windowsize)
+                    error("Windowsize granted above the one asked");
+
+                max_asked = 0;
+                bench_ask(asked, conf->windowsize, &max_asked, s.windowsize);
+            }
+
+            if (s.last_block == last_block)
+                continue;
+
+            // Timed before its slot is reused for the next window
+            bench_latency(b, now_us() - asked[s.last_block % conf->windowsize]);
+            bench_ask(asked, conf->windowsize, &max_asked, s.last_ack + s.windowsize);
+        }
+    }
+
+    b->failed = end_client_session(&s, BENCH_FILE, status) != 1;
+    b->bytes = s.total_size;
+
+    close(conn.fd);
+    free(asked);
+    free_batch(&in);
+
+    return NULL;
+}
+
+/* Compare two integers, for qsort()
+ * Args:
+ *  - a: First integer
+ *  - b: Second integer
+ * Return:
+ *  Negative, 0 or positive, like strcmp()
+ *  */
+int cmp_int(const void *a, const void *b)
+{
+    return *(const int*) a - *(const int*) b;
+}
+
+/* Print the results of a run
+ * Args:
+ *  - sessions: Downloads done
+ *  - conf: Parameters of the run
+ *  - elapsed: Duration of the run (us)
+ *  - ru: CPU time used by the whole process (clients and server) during the run
+ *  - st: Counters of the server, summed over its workers
+ *  */
+void print_bench(struct bench_session *sessions, const struct bench_conf *conf, long long elapsed, struct rusage *ru, struct server_stats *st)
+{
+    long long bytes = 0, nb_lat = 0, k;
+    double seconds, cpu;
+    int *lat;
+    int i, failed = 0;
+
+    for (i = 0; i < conf->sessions; i++) {
+        bytes += sessions[i].bytes;
+        nb_lat += sessions[i].nb_lat;
+        failed += sessions[i].failed;
+    }
+
+    // Latencies of every session together
+    lat = malloc((nb_lat + 1) * sizeof(int));
+
+    for (i = 0, k = 0; i < conf->sessions; k += sessions[i].nb_lat, i++)
+        memcpy(lat + k, sessions[i].lat, sessions[i].nb_lat * sizeof(int));
+
+    qsort(lat, nb_lat, sizeof(int), cmp_int);
+
+    seconds = elapsed / (double) USEC;
+    cpu = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+
+    printf("sessions   %d (%d failed), %lld bytes each, blksize %d, windowsize %d\n",
+            conf->sessions, failed, conf->size, conf->blksize, conf->windowsize);
+    printf("time       %.3f s\n", seconds);
+    printf("throughput %.1f MB/s\n", bytes / 1048576.0 / seconds);
+    printf("packets    %.0f pkts/s (server: %lu in, %lu out, %lu timeouts)\n",
+            (STAT_GET(st, pkts_in) + STAT_GET(st, pkts_out)) / seconds,
+            STAT_GET(st, pkts_in), STAT_GET(st, pkts_out), STAT_GET(st, timeouts));
+
+    if (nb_lat > 0)
+        printf("latency    p50 %d us, p99 %d us, max %d us (%lld blocks)\n",
+                lat[nb_lat / 2], lat[nb_lat * 99 / 100], lat[nb_lat - 1], nb_lat);
+
+    printf("cpu        %.3f s user, %.3f s sys (%.0f%% of a core)\n",
+            ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+            ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6, cpu / seconds * 100);
+
+    if (netem != NULL)
+        printf("network    %.2f%% loss, %.3f ms delay: %lu dropped, %lu delayed\n",
+                netem->loss * 100, netem->delay / 1000.0, netem->dropped, netem->delayed);
+
+    free(lat);
+}
+
+/* Tell whether a field parsed lies in its datagram, followed by its NUL
+ * Args:
+ *  - str: Field parsed
+ *  - pkt: Datagram it comes from
+ * Return:
+ *  1 if it does, 0 if the codec read past the datagram
+ *  */
+int bench_inside(const struct tftp_str *str, const struct bench_packet *pkt)
+{
+    return str->ptr >= pkt->data && str->len >= 0 && str->ptr + str->len < pkt->data + pkt->n && str->ptr[str->len] == '\0';
+}
+
+/* Measure the packet codec alone, without any transfer: parse a RRQ asking every option, its
+ * OACK, and damaged copies of the RRQ (every truncation, every byte zeroed or set), whose
+ * fields must all stay inside the datagram; then build the OACK
+ * Args:
+ *  - nb: Packets parsed or built by each measure
+ *  */
+void bench_codec(long long nb)
+{
+    long long values[NB_OPTIONS - 1] = { PREF_BLK_SIZE, 0, DEFAULT_TIMEOUT, PREF_WINDOWSIZE, 1, 50000, 0, 0 };
+    struct bench_packet rq, oack, *damaged;
+    struct tftp_packet p;
+    volatile unsigned long sink = 0; // Results used, so that no parse is optimized out
+    long long k, start, parse_rq, parse_oack_us, parse_damaged, build;
+    int i, j, len, nb_damaged = 0, refused = 0;
+    const char changes[] = { '\0', 'x' };
+
+    // Every numeric option, as asked by a client and acknowledged by the server
+    rq.data[0] = 0;
+    rq.data[1] = RRQ;
+    rq.n = put_string(rq.data, 2, BENCH_CODEC_FILE, strlen(BENCH_CODEC_FILE));
+    rq.n = put_string(rq.data, rq.n, "octet", 5);
+
+    oack.data[0] = 0;
+    oack.data[1] = 6;
+    oack.n = 2;
+
+    for (j = 0; j < NB_OPTIONS - 1; j++) {
+        rq.n = put_option(rq.data, rq.n, j, values[j]);
+        oack.n = put_option(oack.data, oack.n, j, j == OPT_TSIZE ? DEFAULT_BENCH_SIZE : values[j]);
+    }
+
+    damaged = malloc(3 * rq.n * sizeof(struct bench_packet));
+
+    for (i = 2; i < rq.n; i++) {
+        memcpy(damaged[nb_damaged].data, rq.data, i);
+        damaged[nb_damaged++].n = i;
+
+        // A NUL lost, or one more
+        for (j = 0; j < (int) sizeof(changes); j++) {
+            memcpy(damaged[nb_damaged].data, rq.data, rq.n);
+            damaged[nb_damaged].data[i] = changes[j];
+            damaged[nb_damaged++].n = rq.n;
+        }
+    }
+
+    for (i = 0; i < nb_damaged; i++) {
+        if (parse_request(damaged[i].data, damaged[i].n, &p) != CODEC_OK) {
+            refused++;
+            continue;
+        }
+
+        if (!bench_inside(&p.filename, &damaged[i]) || !bench_inside(&p.mode, &damaged[i]))
+            error("Request field parsed outside its datagram");
+
+        for (j = 0; j < NB_OPTIONS; j++) {
+            if (HAS_OPTION(&p, j) && !bench_inside(&p.values[j], &damaged[i]))
+                error("Option parsed outside its datagram");
+        }
+    }
+
+    start = now_us();
+    for (k = 0; k < nb; k++) {
+        parse_request(rq.data, rq.n, &p);
+        sink += p.asked;
+    }
+    parse_rq = now_us() - start;
+
+    start = now_us();
+    for (k = 0; k < nb; k++) {
+        parse_oack(oack.data, oack.n, &p);
+        sink += p.asked;
+    }
+    parse_oack_us = now_us() - start;
+
+    start = now_us();
+    for (k = 0; k < nb; k++) {
+        parse_request(damaged[k % nb_damaged].data, damaged[k % nb_damaged].n, &p);
+        sink += p.asked;
+    }
+    parse_damaged = now_us() - start;
+
+    // The values change, as the sizes of the files asked do
+    start = now_us();
+    for (k = 0; k < nb; k++) {
+        for (j = 0, len = 2; j < NB_OPTIONS - 1; j++)
+            len = put_option(oack.data, len, j, values[j] + k);
+        sink += len;
+    }
+    build = now_us() - start;
+
+    printf("rrq        %d bytes, %d options: %.1f ns/packet parsed\n", rq.n, NB_OPTIONS - 1, parse_rq * 1000.0 / nb);
+    printf("oack       %d bytes: %.1f ns/packet parsed, %.1f ns/packet built\n", oack.n, parse_oack_us * 1000.0 / nb, build * 1000.0 / nb);
+    printf("damaged    %d copies of the rrq, %d refused, none read outside: %.1f ns/packet parsed\n",
+            nb_damaged, refused, parse_damaged * 1000.0 / nb);
+
+    free(damaged);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_conf conf;
+    struct server_conf sconf;
+    struct bench_session *sessions;
+    struct server *workers;
+    struct file_cache cache;
+    struct storage store;
+    struct writer wr;
+    struct netem ne;
+    struct admission adm;
+    struct server_stats total;
+    struct rusage before, after;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char dir[] = "/tmp/tftp_bench.XXXXXX";
+    double loss = 0, delay = 0;
+    long long start, elapsed, codec = 0, bytes, floor;
+    int i, choice;
+
+    bzero(&conf, sizeof(conf));
+    conf.sessions = DEFAULT_BENCH_SESSIONS;
+    conf.size = DEFAULT_BENCH_SIZE;
+    conf.blksize = PREF_BLK_SIZE;
+    conf.windowsize = PREF_WINDOWSIZE;
+    conf.batch = DEFAULT_BATCH;
+
+    sconf.max_sessions = DEFAULT_MAX_SESSIONS;
+    sconf.workers = DEFAULT_WORKERS;
+    sconf.max_windowsize = MAX_WINDOWSIZE;
+    sconf.batch = DEFAULT_BATCH;
+    sconf.rollover = DEFAULT_ROLLOVER;
+    sconf.cache_size = (size_t) DEFAULT_CACHE_SIZE * 1024 * 1024;
+    sconf.dgram_cache_size = (size_t) DEFAULT_DGRAM_CACHE_SIZE * 1024 * 1024;
+    sconf.writers = 0; // Downloads only
+    sconf.readahead = DEFAULT_READAHEAD;
+    sconf.metrics = NULL;
+    sconf.access_log = NULL; // Measures the transfers, not the log
+    sconf.storage = STORE_FS;
+    sconf.max_upload = (size_t) DEFAULT_MAX_UPLOAD * 1024 * 1024;
+    sconf.rewrite = NULL; // Every session asks the synthetic file
+    sconf.max_total = 0; // Measures the transfers, not the admission control
+    sconf.max_per_client = 0;
+    sconf.session_rate = 0;
+    sconf.subnet_rate = 0;
+    sconf.max_queued = 0;
+    bzero(&sconf.multicast, sizeof(sconf.multicast)); // One client per file
+
+    while ((choice = getopt(argc, argv, "n:s:b:W:B:w:C:D:S:T:L:d:c:K:")) != -1) {
+        switch (choice) {
+            case 'n':
+                if ((conf.sessions = atoi(optarg)) <= 0)
+                    error("Number of sessions must be positive");
+                break;
+
+            case 's':
+                if ((conf.size = parse_size(optarg)) < 0)
+                    error("Wrong file size");
+                break;
+
+            case 'b':
+                conf.blksize = atoi(optarg);
+
+                if (conf.blksize < MIN_BLK_SIZE || conf.blksize > MAX_BLK_SIZE)
+                    error("Block size must be between 8 and 65464");
+                break;
+
+            case 'W':
+                conf.windowsize = atoi(optarg);
+
+                if (conf.windowsize < 1 || conf.windowsize > MAX_WINDOWSIZE)
+                    error("Windowsize must be between 1 and 65535");
+                break;
+
+            case 'B':
+                conf.batch = atoi(optarg);
+
+                if (conf.batch < 1 || conf.batch > MAX_BATCH)
+                    error("Batch size must be between 1 and 1024");
+
+                sconf.batch = conf.batch;
+                break;
+
+            case 'w':
+                if ((sconf.workers = atoi(optarg)) <= 0)
+                    error("Number of workers must be positive");
+                break;
+
+            case 'C':
+                sconf.cache_size = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+
+            case 'D':
+                sconf.dgram_cache_size = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+
+            case 'S':
+                if (strcmp(optarg, "fs") == 0)
+                    sconf.storage = STORE_FS;
+                else if (strcmp(optarg, "memory") == 0)
+                    sconf.storage = STORE_MEMORY;
+                else if (strcmp(optarg, "cas") == 0)
+                    sconf.storage = STORE_CAS;
+                else
+                    error("Storage must be fs, memory or cas");
+                break;
+
+            case 'T':
+                conf.utimeout = atoll(optarg) * 1000;
+
+                if (conf.utimeout < MIN_RTO || conf.utimeout > MAX_TIMEOUT * USEC)
+                    error("Timeout in milliseconds must be between 10 and 255000");
+                break;
+
+            case 'L':
+                loss = atof(optarg) / 100;
+
+                if (loss < 0 || loss >= 1)
+                    error("Loss must be a percentage, below 100");
+                break;
+
+            case 'd':
+                if ((delay = atof(optarg)) < 0)
+                    error("Delay cannot be negative");
+                break;
+
+            case 'c':
+                if ((codec = parse_size(optarg)) <= 0)
+                    error("Number of packets must be positive");
+                break;
+
+            case 'K':
+                if (atol(optarg) <= 0)
+                    error("Rate of the subnet must be positive");
+
+                sconf.subnet_rate = atoll(optarg) * 1024;
+                break;
+
+            default:
+                fprintf(stderr, "Usage: %s [-c packets[K|M|G]] [-n sessions] [-s size[K|M|G]] [-b blksize] [-W windowsize] [-B batch]"
+                        " [-w workers] [-C cache MB] [-D pre-built DATA MB] [-S fs|memory|cas] [-T timeout ms] [-L loss %%] [-d delay ms] [-K subnet KB/s]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // The codec alone: no server, no file
+    if (codec > 0) {
+        bench_codec(codec);
+        exit(EXIT_SUCCESS);
+    }
+
+    sconf.max_sessions = conf.sessions > sconf.max_sessions ? conf.sessions : sconf.max_sessions;
+
+    // Server and clients share the directory of the synthetic file
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0)
+        error("Cannot create the benchmark directory");
+
+    make_file(BENCH_FILE, conf.size);
+
+    if (loss > 0 || delay > 0)
+        init_netem(&ne, loss, delay * 1000, 1);
+
+    workers = start_workers(0, &sconf, &cache, &wr, &store, NULL, &adm);
+
+    addr_len = sizeof(addr);
+    if (getsockname(workers[0].fds[0], (struct sockaddr*) &addr, &addr_len) < 0)
+        error("getsockname");
+
+    conf.port = addr_port(&addr);
+
+    sessions = calloc(conf.sessions, sizeof(struct bench_session));
+
+    getrusage(RUSAGE_SELF, &before);
+    start = now_us();
+
+    for (i = 0; i < conf.sessions; i++) {
+        sessions[i].conf = &conf;
+
+        if ((errno = pthread_create(&sessions[i].thread, NULL, bench_session, &sessions[i])) != 0)
+            error("pthread_create");
+
+        // Paced: back-to-back downloads, each one after the previous one ended
+        if (sconf.subnet_rate > 0)
+            pthread_join(sessions[i].thread, NULL);
+    }
+
+    for (i = 0; i < conf.sessions && sconf.subnet_rate == 0; i++)
+        pthread_join(sessions[i].thread, NULL);
+
+    elapsed = now_us() - start;
+
+    // The loopback is one subnet: only its burst and the last window may go out unpaid
+    if (sconf.subnet_rate > 0) {
+        for (i = 0, bytes = 0; i < conf.sessions; i++)
+            bytes += sessions[i].bytes;
+
+        floor = (bytes - sconf.subnet_rate * BUCKET_BURST / USEC - (long long) conf.windowsize * conf.blksize) * USEC / sconf.subnet_rate;
+
+        if (elapsed < floor)
+            error("The downloads went faster than the rate of their subnet");
+    }
+    getrusage(RUSAGE_SELF, &after);
+
+    // CPU time of the run only
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+
+    bzero(&total, sizeof(total));
+
+    for (i = 0; i < sconf.workers; i++) {
+        total.pkts_in += STAT_GET(&workers[i].stats, pkts_in);
+        total.pkts_out += STAT_GET(&workers[i].stats, pkts_out);
+        total.timeouts += STAT_GET(&workers[i].stats, timeouts);
+    }
+
+    print_bench(sessions, &conf, elapsed, &after, &total);
+
+    unlink(BENCH_FILE);
+    rmdir(dir);
+
+    // The workers never return, leaving stops them
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,54 @@
+#ifndef BENCH_H
+
+#define BENCH_H
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "network.h"
+
+#define BENCH_FILE "bench.dat" // Synthetic file every session downloads
+#define DEFAULT_BENCH_SIZE (16 * 1024 * 1024) // Size of the file by default
+#define DEFAULT_BENCH_SESSIONS 1 // Concurrent downloads by default
+#define BENCH_CODEC_FILE "pxelinux.cfg/01-52-54-00-12-34-56" // Name asked by the RRQ of the codec measures
+
+/* Parameters of a benchmark run */
+struct bench_conf {
+    int sessions; // Concurrent downloads
+    long long size; // Size of the file downloaded
+    int blksize; // Block size asked
+    int windowsize; // Windowsize asked
+    int batch; // Datagrams sent/received per syscall (client side)
+    long long utimeout; // Timeout asked (us, 0 for the default one)
+    int port; // Port of the server started in the process
+};
+
+/* One download of the benchmark, run by its own thread */
+struct bench_session {
+    const struct bench_conf *conf; // Parameters of the run
+    pthread_t thread; // Thread running the download
+    long long bytes; // Payload received
+    int failed; // Did the download fail
+    int *lat; // Latency of each block (us), in the order received
+    long long nb_lat; // Number of latencies recorded
+    long long max_lat; // Room in lat
+};
+
+/* Datagram parsed by the codec measures */
+struct bench_packet {
+    char data[DEFAULT_BLK_SIZE]; // Bytes received
+    int n; // Size of the datagram
+};
+
+long long parse_size(const char *s);
+void make_file(const char *path, long long size);
+void bench_conn(struct conn_info *conn, struct sockaddr_storage *dst, int port);
+void bench_ask(long long *asked, int ring, long long *max_asked, long long upto);
+void bench_latency(struct bench_session *b, int lat);
+void *bench_session(void *arg);
+int cmp_int(const void *a, const void *b);
+void print_bench(struct bench_session *sessions, const struct bench_conf *conf, long long elapsed, struct rusage *ru, struct server_stats *st);
+int bench_inside(const struct tftp_str *str, const struct bench_packet *pkt);
+void bench_codec(long long nb);
+
+#endif /* end of include guard: BENCH_H */
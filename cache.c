@@ -0,0 +1,583 @@
+#include "cache.h"
+
+#include <fcntl.h>
+
+/* Init an empty file cache
+ * Args:
+ *  - c: Cache to initialize
+ *  - max_size: Memory budget, in bytes
+ *  - max_dgram_size: Memory budget of the pre-built DATA, in bytes
+ *  */
+void init_cache(struct file_cache *c, size_t max_size, size_t max_dgram_size)
+{
+    bzero(c, sizeof(*c));
+    c->max_size = max_size;
+    c->max_dgram_size = max_dgram_size;
+
+    if ((errno = pthread_mutex_init(&c->lock, NULL)) != 0)
+        error("pthread_mutex_init");
+
+    if ((errno = pthread_cond_init(&c->fill, NULL)) != 0)
+        error("pthread_cond_init");
+
+    if (max_size > 0 && (errno = pthread_create(&c->thread, NULL, cache_run, c)) != 0)
+        error("pthread_create");
+}
+
+/* Hash a path (djb2)
+ * Args:
+ *  - path: Path to hash
+ * Return:
+ *  Bucket of the path
+ *  */
+unsigned int hash_path(const char *path)
+{
+    unsigned int h = 5381;
+
+    while (*path)
+        h = h * 33 + (unsigned char) *path++;
+
+    return h % CACHE_BUCKETS;
+}
+
+/* Find a file in the cache (with the lock held)
+ * Args:
+ *  - c: Cache to search
+ *  - path: Path of the file
+ * Return:
+ *  The file, or NULL if not cached
+ *  */
+struct cached_file *cache_lookup(struct file_cache *c, const char *path)
+{
+    struct cached_file *f;
+
+    for (f = c->buckets[hash_path(path)]; f != NULL; f = f->next) {
+        if (strcmp(f->path, path) == 0)
+            return f;
+    }
+
+    return NULL;
+}
+
+/* Tell if a cached file is still the one on the disk
+ * Args:
+ *  - f: File cached
+ *  - st: Current attributes of the file on the disk
+ * Return:
+ *  - 1: Same file, same content
+ *  - 0: The file was modified or replaced
+ *  */
+int cache_valid(struct cached_file *f, struct stat *st)
+{
+    return f->dev == st->st_dev && f->ino == st->st_ino && f->size == (size_t) st->st_size
+        && f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Put a file at the head (most recently used) of the LRU list (with the lock held)
+ * Args:
+ *  - c: Cache of the file
+ *  - f: File used, either new or already in the list
+ *  */
+void lru_touch(struct file_cache *c, struct cached_file *f)
+{
+    if (c->lru_head == f)
+        return;
+
+    // Unlink it if already in the list
+    if (f->lru_prev != NULL)
+        f->lru_prev->lru_next = f->lru_next;
+    if (f->lru_next != NULL)
+        f->lru_next->lru_prev = f->lru_prev;
+    if (c->lru_tail == f)
+        c->lru_tail = f->lru_prev;
+
+    f->lru_prev = NULL;
+    f->lru_next = c->lru_head;
+
+    if (c->lru_head != NULL)
+        c->lru_head->lru_prev = f;
+    c->lru_head = f;
+
+    if (c->lru_tail == NULL)
+        c->lru_tail = f;
+}
+
+/* Drop the pre-built DATA of a file (with the lock held)
+ * Args:
+ *  - c: Cache of the file
+ *  - f: File whose sets are freed (no session must be using them)
+ *  */
+void free_block_sets(struct file_cache *c, struct cached_file *f)
+{
+    struct block_set *set;
+
+    while ((set = f->blocks) != NULL) {
+        f->blocks = set->next;
+        c->dgram_size -= set->size;
+
+        free(set->dgrams);
+        free(set);
+    }
+}
+
+/* Free a file and its content (its pre-built DATA must have been dropped)
+ * Args:
+ *  - f: File to free
+ *  */
+void free_cached_file(struct cached_file *f)
+{
+    free(f->path);
+    free(f->data);
+    free(f);
+}
+
+/* Remove a file from the cache (with the lock held)
+ * It is freed now if unused, or by the last session releasing it.
+ * Args:
+ *  - c: Cache of the file
+ *  - f: File to remove
+ *  */
+void cache_remove(struct file_cache *c, struct cached_file *f)
+{
+    struct cached_file **p;
+
+    for (p = &c->buckets[hash_path(f->path)]; *p != f; p = &(*p)->next);
+    *p = f->next;
+
+    if (f->lru_prev != NULL)
+        f->lru_prev->lru_next = f->lru_next;
+    else
+        c->lru_head = f->lru_next;
+
+    if (f->lru_next != NULL)
+        f->lru_next->lru_prev = f->lru_prev;
+    else
+        c->lru_tail = f->lru_prev;
+
+    c->size -= f->size;
+    c->entries--;
+
+    if (f->refs == 0) {
+        free_block_sets(c, f);
+        free_cached_file(f);
+    }
+    else {
+        f->stale = 1;
+    }
+}
+
+/* Read a whole file in memory
+ * Args:
+ *  - path: File to read
+ *  - st: Filled with the attributes of the file read
+ * Return:
+ *  The file (not cached yet), or NULL if it cannot be read
+ *  */
+struct cached_file *load_file(const char *path, struct stat *st)
+{
+    struct cached_file *f;
+    size_t done;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(fd, st) < 0 || st->st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    f = calloc(1, sizeof(struct cached_file));
+    f->path = strdup(path);
+    f->size = st->st_size;
+    f->dev = st->st_dev;
+    f->ino = st->st_ino;
+    f->mtime = st->st_mtim;
+
+    if ((f->data = malloc(f->size)) == NULL) {
+        close(fd);
+        free_cached_file(f);
+        return NULL;
+    }
+
+    // A file shrinking while we read it is not cached
+    for (done = 0; done < f->size; done += n) {
+        if ((n = pread(fd, f->data + done, f->size - done, done)) <= 0) {
+            close(fd);
+            free_cached_file(f);
+            return NULL;
+        }
+    }
+
+    close(fd);
+
+    return f;
+}
+
+/* Tell if two jobs of the loader thread do the same
+ * Args:
+ *  - a: Job
+ *  - b: Other job
+ * Return:
+ *  1 if they read the same file or build the same DATA, 0 otherwise
+ *  */
+int fill_equal(const struct cache_fill *a, const struct cache_fill *b)
+{
+    if (a->path != NULL || b->path != NULL)
+        return a->path != NULL && b->path != NULL && strcmp(a->path, b->path) == 0;
+
+    return a->file == b->file && a->blksize == b->blksize && a->rollover == b->rollover;
+}
+
+/* Tell if a job is already waiting for the loader thread, or running (with the lock held)
+ * Args:
+ *  - c: Cache to fill
+ *  - job: File missing, or DATA missing
+ * Return:
+ *  - 1: It will be done, nothing to do
+ *  - 0: Not queued
+ *  */
+int fill_queued(struct file_cache *c, const struct cache_fill *job)
+{
+    struct cache_fill *q;
+
+    if (c->running != NULL && fill_equal(c->running, job))
+        return 1;
+
+    for (q = c->fill_head; q != NULL; q = q->next) {
+        if (fill_equal(q, job))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Ask the loader thread to read a file missing from the cache, or to build DATA of a cached
+ * file (with the lock held). Nothing is done if it is already queued, or if too many jobs are.
+ * Args:
+ *  - c: Cache to fill
+ *  - job: What to do, copied (its file is held until it is done)
+ *  */
+void cache_fill(struct file_cache *c, const struct cache_fill *job)
+{
+    struct cache_fill *q;
+
+    if (c->nb_fills >= CACHE_FILL_QUEUE || fill_queued(c, job))
+        return;
+
+    q = calloc(1, sizeof(struct cache_fill));
+    q->path = job->path != NULL ? strdup(job->path) : NULL;
+    q->file = job->file;
+    q->blksize = job->blksize;
+    q->rollover = job->rollover;
+
+    if (q->file != NULL)
+        q->file->refs++;
+
+    if (c->fill_tail != NULL)
+        c->fill_tail->next = q;
+    else
+        c->fill_head = q;
+    c->fill_tail = q;
+    c->nb_fills++;
+
+    pthread_cond_signal(&c->fill);
+}
+
+/* Add a file just read to the cache, unused yet (with the lock held)
+ * Args:
+ *  - c: Cache to fill
+ *  - loaded: File read by load_file(), freed if it cannot be added
+ *  - st: Attributes of the file on the disk once read
+ *  */
+void cache_insert(struct file_cache *c, struct cached_file *loaded, struct stat *st)
+{
+    struct cached_file *f, *prev;
+
+    // Replaced or modified while we read it
+    if (!cache_valid(loaded, st)) {
+        free_cached_file(loaded);
+        return;
+    }
+
+    // Another copy may be there already (file replaced and asked again)
+    if ((f = cache_lookup(c, loaded->path)) != NULL) {
+        if (cache_valid(f, st)) {
+            free_cached_file(loaded);
+            return;
+        }
+
+        cache_remove(c, f);
+    }
+
+    // Make room, least recently used first, the files in use cannot go
+    for (f = c->lru_tail; f != NULL && c->size + loaded->size > c->max_size; f = prev) {
+        prev = f->lru_prev;
+
+        if (f->refs > 0)
+            continue;
+
+        cache_remove(c, f);
+        c->evictions++;
+    }
+
+    if (c->size + loaded->size > c->max_size) {
+        free_cached_file(loaded);
+        return;
+    }
+
+    loaded->next = c->buckets[hash_path(loaded->path)];
+    c->buckets[hash_path(loaded->path)] = loaded;
+    lru_touch(c, loaded);
+
+    c->size += loaded->size;
+    c->entries++;
+    c->loads++;
+}
+
+/* Loader thread: read the files missing from the cache and build the DATA asked, one at a time
+ * Args:
+ *  - arg: Cache to fill
+ * Return:
+ *  Never returns
+ *  */
+void *cache_run(void *arg)
+{
+    struct file_cache *c = arg;
+    struct cached_file *loaded;
+    struct cache_fill *q;
+    struct stat st;
+
+    pthread_mutex_lock(&c->lock);
+
+    while (1) {
+        while (c->fill_head == NULL)
+            pthread_cond_wait(&c->fill, &c->lock);
+
+        q = c->fill_head;
+        c->fill_head = q->next;
+        if (c->fill_head == NULL)
+            c->fill_tail = NULL;
+        c->running = q;
+        loaded = NULL;
+
+        // The workers keep using the cache while we read the file or build its DATA
+        pthread_mutex_unlock(&c->lock);
+
+        if (q->file != NULL) {
+            build_blocks(c, q->file, q->blksize, q->rollover);
+            cache_release(c, q->file);
+        }
+        else if ((loaded = load_file(q->path, &st)) != NULL && stat(q->path, &st) < 0) {
+            free_cached_file(loaded);
+            loaded = NULL;
+        }
+
+        pthread_mutex_lock(&c->lock);
+
+        if (loaded != NULL)
+            cache_insert(c, loaded, &st);
+
+        c->running = NULL;
+        c->nb_fills--;
+
+        free(q->path);
+        free(q);
+    }
+
+    return NULL;
+}
+
+/* Get the content of a file from the cache
+ * A file missing (or changed) is queued to the loader thread, so that the event
+ * loop never waits for a whole file to be read: the next requests get it.
+ * Args:
+ *  - c: Cache to use
+ *  - path: File asked by a RRQ
+ * Return:
+ *  The file, to give back with cache_release(), or NULL if it is not cached
+ *  (yet, or empty, too big, unreadable...): read it from the disk instead
+ *  */
+struct cached_file *cache_get(struct file_cache *c, const char *path)
+{
+    struct cached_file *f;
+    struct cache_fill job;
+    struct stat st;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+
+    pthread_mutex_lock(&c->lock);
+
+    f = cache_lookup(c, path);
+
+    if (f != NULL && cache_valid(f, &st)) {
+        f->refs++;
+        f->hits++;
+        lru_touch(c, f);
+        c->hits++;
+
+        pthread_mutex_unlock(&c->lock);
+        return f;
+    }
+
+    // Modified or replaced since it was read
+    if (f != NULL)
+        cache_remove(c, f);
+
+    c->misses++;
+
+    if ((size_t) st.st_size <= c->max_size) {
+        bzero(&job, sizeof(job));
+        job.path = (char*) path;
+        cache_fill(c, &job);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return NULL;
+}
+
+/* Give back a file got with cache_get()
+ * Args:
+ *  - c: Cache of the file
+ *  - f: File no longer used by the session
+ *  */
+void cache_release(struct file_cache *c, struct cached_file *f)
+{
+    pthread_mutex_lock(&c->lock);
+
+    f->refs--;
+
+    if (f->refs == 0 && f->stale) {
+        free_block_sets(c, f);
+        free_cached_file(f);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Build every DATA datagram of a cached file for a block size (run by the loader thread)
+ * Args:
+ *  - c: Cache of the file
+ *  - f: File held by the job, see cache_blocks()
+ *  - blksize: Block size negotiated
+ *  - rollover: Block# following 65535 (0 or 1)
+ *  */
+void build_blocks(struct file_cache *c, struct cached_file *f, int blksize, int rollover)
+{
+    struct block_set *set;
+    struct cached_file *g;
+    size_t k, nb_blocks, len;
+
+    // The last block is shorter than blksize, even empty
+    nb_blocks = f->size / blksize + 1;
+
+    set = calloc(1, sizeof(struct block_set));
+    set->blksize = blksize;
+    set->rollover = rollover;
+    set->size = nb_blocks * (blksize + 4);
+
+    pthread_mutex_lock(&c->lock);
+
+    // Make room, from the least recently used files not being sent
+    for (g = c->lru_tail; g != NULL && c->dgram_size + set->size > c->max_dgram_size; g = g->lru_prev) {
+        if (g->refs > 0 || g->blocks == NULL)
+            continue;
+
+        free_block_sets(c, g);
+        c->dgram_evictions++;
+    }
+
+    if (c->dgram_size + set->size > c->max_dgram_size) {
+        pthread_mutex_unlock(&c->lock);
+        free(set);
+        return;
+    }
+
+    // Reserved while built without the lock
+    c->dgram_size += set->size;
+
+    pthread_mutex_unlock(&c->lock);
+
+    if ((set->dgrams = malloc(set->size)) != NULL) {
+        for (k = 0; k < nb_blocks; k++) {
+            len = f->size - k * blksize < (size_t) blksize ? f->size - k * blksize : (size_t) blksize;
+
+            set->dgrams[k * (blksize + 4)] = 0;
+            set->dgrams[k * (blksize + 4) + 1] = 3;
+            set->dgrams[k * (blksize + 4) + 2] = block_wire(k + 1, rollover) / 256;
+            set->dgrams[k * (blksize + 4) + 3] = block_wire(k + 1, rollover) % 256;
+
+            memcpy(set->dgrams + k * (blksize + 4) + 4, f->data + k * blksize, len);
+        }
+    }
+
+    pthread_mutex_lock(&c->lock);
+
+    if (set->dgrams == NULL || f->stale) {
+        c->dgram_size -= set->size;
+        pthread_mutex_unlock(&c->lock);
+
+        free(set->dgrams);
+        free(set);
+        return;
+    }
+
+    set->next = f->blocks;
+    f->blocks = set;
+
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Get every DATA datagram of a cached file for a block size, built only once
+ * They are only built for files asked more than once, within the budget, by the
+ * loader thread: the sessions starting before they are ready build their DATA one by one.
+ * Args:
+ *  - c: Cache of the file
+ *  - f: File got with cache_get(), the datagrams are valid until it is released
+ *  - blksize: Block size negotiated
+ *  - rollover: Block# following 65535 (0 or 1)
+ * Return:
+ *  The datagrams (block# k at (k - 1) * (blksize + 4)), or NULL to build them one by one
+ *  */
+char *cache_blocks(struct file_cache *c, struct cached_file *f, int blksize, int rollover)
+{
+    struct block_set *set;
+    struct cache_fill job;
+
+    pthread_mutex_lock(&c->lock);
+
+    for (set = f->blocks; set != NULL && (set->blksize != blksize || set->rollover != rollover); set = set->next);
+
+    // A set larger than the whole budget is never built
+    if (set == NULL && f->hits > 0 && !f->stale && (f->size / blksize + 1) * (blksize + 4) <= c->max_dgram_size) {
+        bzero(&job, sizeof(job));
+        job.file = f;
+        job.blksize = blksize;
+        job.rollover = rollover;
+        cache_fill(c, &job);
+    }
+
+    pthread_mutex_unlock(&c->lock);
+
+    return set != NULL ? set->dgrams : NULL;
+}
+
+/* Print the counters of the cache
+ * Args:
+ *  - out: Where to print
+ *  - c: Cache to print
+ *  */
+void print_cache(FILE *out, struct file_cache *c)
+{
+    pthread_mutex_lock(&c->lock);
+
+    fprintf(out, "%-10s entries=%lu size=%zu max_size=%zu hits=%lu misses=%lu evictions=%lu loads=%lu"
+            " dgram_size=%zu max_dgram_size=%zu dgram_evictions=%lu\n", "cache",
+            c->entries, c->size, c->max_size, c->hits, c->misses, c->evictions, c->loads,
+            c->dgram_size, c->max_dgram_size, c->dgram_evictions);
+
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,94 @@
+#ifndef CACHE_H
+
+#define CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "network.h"
+
+#define DEFAULT_CACHE_SIZE 64 // Memory budget of the file cache by default (MB)
+#define DEFAULT_DGRAM_CACHE_SIZE 0 // Memory budget of the pre-built DATA by default (MB)
+#define CACHE_BUCKETS 256 // Size of the hash table of the file cache
+#define CACHE_FILL_QUEUE 64 // Jobs waiting for the loader thread, the next misses are not cached (nor their DATA built)
+
+/* Every DATA datagram of a cached file for one block size (and rollover), ready to be sent */
+struct block_set {
+    int blksize; // Block size negotiated
+    int rollover; // Block# following 65535 (0 or 1)
+    char *dgrams; // Datagram of block# k is at (k - 1) * (blksize + 4)
+    size_t size; // Size of dgrams
+    struct block_set *next; // Set of the same file for another block size
+};
+
+/* Content of a file, shared by every session reading it */
+struct cached_file {
+    char *path; // Name asked by the clients (key of the cache)
+    char *data; // Content of the file
+    size_t size; // Size of the file
+    dev_t dev; // Device, inode and modification date of the file when read,
+    ino_t ino; //  to notice when it is replaced or modified
+    struct timespec mtime;
+    int refs; // Number of sessions using it
+    unsigned long hits; // Requests served from this copy
+    struct block_set *blocks; // Pre-built DATA, one set per block size asked
+    int stale; // Removed from the cache, freed with its last session
+    struct cached_file *next; // Next file in the same bucket
+    struct cached_file *lru_prev; // Most recently used neighbour
+    struct cached_file *lru_next; // Least recently used neighbour
+};
+
+/* Job of the loader thread: a file missing from the cache to read, or the DATA of a cached file to build */
+struct cache_fill {
+    char *path; // Name asked by the client (NULL to build DATA)
+    struct cached_file *file; // File whose DATA are built, held until they are (NULL to read path)
+    int blksize; // Block size of the DATA to build
+    int rollover; // Block# following 65535 in the DATA to build
+    struct cache_fill *next; // Next job
+};
+
+/* Files read by RRQ, kept in memory and shared by all the workers */
+struct file_cache {
+    pthread_mutex_t lock; // Protects everything below
+    struct cached_file *buckets[CACHE_BUCKETS]; // Files, by hash of their path
+    struct cached_file *lru_head; // Most recently used file
+    struct cached_file *lru_tail; // Least recently used file, evicted first
+    size_t max_size; // Memory budget
+    size_t size; // Memory used by the files
+    size_t max_dgram_size; // Memory budget of the pre-built DATA (0 to disable them)
+    size_t dgram_size; // Memory used (or being filled) by the pre-built DATA
+    unsigned long entries; // Number of files cached
+    unsigned long hits; // Requests served from the cache
+    unsigned long misses; // Requests for files not cached (or changed)
+    unsigned long evictions; // Files evicted to make room for others
+    unsigned long dgram_evictions; // Sets of pre-built DATA dropped to make room for others
+    unsigned long loads; // Files read by the loader thread
+    struct cache_fill *fill_head; // Oldest job waiting
+    struct cache_fill *fill_tail; // Newest job waiting
+    int nb_fills; // Jobs waiting, or running
+    struct cache_fill *running; // Job run by the loader thread (NULL if none)
+    pthread_cond_t fill; // Jobs were queued
+    pthread_t thread; // Loader thread, reading the files and building their DATA off the event loops of the workers
+};
+
+void init_cache(struct file_cache *c, size_t max_size, size_t max_dgram_size);
+unsigned int hash_path(const char *path);
+struct cached_file *cache_lookup(struct file_cache *c, const char *path);
+int cache_valid(struct cached_file *f, struct stat *st);
+void lru_touch(struct file_cache *c, struct cached_file *f);
+void free_block_sets(struct file_cache *c, struct cached_file *f);
+void free_cached_file(struct cached_file *f);
+void cache_remove(struct file_cache *c, struct cached_file *f);
+struct cached_file *load_file(const char *path, struct stat *st);
+int fill_equal(const struct cache_fill *a, const struct cache_fill *b);
+int fill_queued(struct file_cache *c, const struct cache_fill *job);
+void cache_fill(struct file_cache *c, const struct cache_fill *job);
+void cache_insert(struct file_cache *c, struct cached_file *loaded, struct stat *st);
+void *cache_run(void *arg);
+struct cached_file *cache_get(struct file_cache *c, const char *path);
+void cache_release(struct file_cache *c, struct cached_file *f);
+void build_blocks(struct file_cache *c, struct cached_file *f, int blksize, int rollover);
+char *cache_blocks(struct file_cache *c, struct cached_file *f, int blksize, int rollover);
+void print_cache(FILE *out, struct file_cache *c);
+
+#endif /* end of include guard: CACHE_H */
@@ -4,32 +4,59 @@ int main(int argc, const char *argv[])
 {
     int no_ext = 0; // Flag to show if can use RFC2347 extensions (0 = can use extension, 1 = no extension)
 
-    size_t buffer_size = DEFAULT_BLK_SIZE; // Default buffer size until renegociated
     size_t pref_buffer_size = PREF_BLK_SIZE; // Block size going to be negociate
 
     int server_port = DEFAULT_SERVER_PORT;
 
-    struct conn_info conn; // Struct in which we will put all connection infos
-
     char host[HOST_LEN] =  ""; // Destination's address
     char **filenames; // Array of all files
     int retry = DEFAULT_RETRY; // Number of retries on errors
-    char *buffer;
     size_t timeout = DEFAULT_TIMEOUT;
-    int i;
-
-    int server_fd; // Server's socket's file descriptor
+    size_t utimeout = 0; // Timeout going to be negociated in milliseconds (0 for seconds only)
+    size_t windowsize = PREF_WINDOWSIZE; // Windowsize going to be negociated
+    int batch = DEFAULT_BATCH; // Datagrams sent/received per syscall
+    int rollover = DEFAULT_ROLLOVER; // Block# following 65535
+    int jobs = DEFAULT_JOBS; // Files transferred at once
+    int segments = DEFAULT_SEGMENTS; // Byte ranges each download is split into
+    int multicast = 0; // Ask to join multicast transfers
+    int failed; // Files which could not be transferred
+
+    struct server_conf sconf; // Server's tunables
+    struct client_conf cconf; // Client's tunables
 
     enum request_code type = RRQ;
     enum tftp_role role = CLIENT;
 
-    buffer=malloc(buffer_size * sizeof(char));
+    sconf.max_sessions = DEFAULT_MAX_SESSIONS;
+    sconf.workers = DEFAULT_WORKERS;
+    sconf.max_windowsize = PREF_MAX_WINDOWSIZE;
+    sconf.batch = DEFAULT_BATCH;
+    sconf.rollover = DEFAULT_ROLLOVER;
+    sconf.cache_size = (size_t) DEFAULT_CACHE_SIZE * 1024 * 1024;
+    sconf.dgram_cache_size = (size_t) DEFAULT_DGRAM_CACHE_SIZE * 1024 * 1024;
+    sconf.writers = DEFAULT_WRITERS;
+    sconf.max_inflight = (size_t) DEFAULT_MAX_INFLIGHT * 1024 * 1024;
+    sconf.fsync = FSYNC_NONE;
+    sconf.readahead = DEFAULT_READAHEAD;
+    sconf.metrics = NULL;
+    sconf.access_log = "-";
+    sconf.log_json = 0;
+    sconf.log_rate = DEFAULT_LOG_RATE;
+    sconf.storage = STORE_FS;
+    sconf.max_upload = (size_t) DEFAULT_MAX_UPLOAD * 1024 * 1024;
+    sconf.rewrite = NULL;
+    sconf.max_total = 0;
+    sconf.max_per_client = 0;
+    sconf.session_rate = 0;
+    sconf.subnet_rate = 0;
+    sconf.max_queued = 0;
+    bzero(&sconf.multicast, sizeof(sconf.multicast));
 
     filenames=malloc(argc * sizeof(char*));
     bzero(filenames, argc * sizeof(char*));
 
     // Parsing CLI
-    opts(argc, argv, &server_port, &pref_buffer_size, &timeout, &no_ext, &type, &retry, &role, host, HOST_LEN, filenames);
+    opts(argc, argv, &server_port, &pref_buffer_size, &timeout, &utimeout, &windowsize, &batch, &rollover, &no_ext, &jobs, &segments, &multicast, &type, &retry, &role, host, HOST_LEN, filenames, &sconf);
 
     if (role == CLIENT) {
         if (strlen(host) == 0)
@@ -38,35 +65,38 @@ int main(int argc, const char *argv[])
         if (filenames[0] == NULL)
             error("No file asked");
 
-        for (i = 0; filenames[i] != NULL ; i++) {
-            init_client_conn(&conn, host, server_port);
+        cconf.host = host;
+        cconf.server_port = server_port;
+        cconf.type = type;
+        cconf.retry = retry;
+        cconf.pref_buffer_size = pref_buffer_size;
+        cconf.timeout = timeout;
+        cconf.utimeout = utimeout;
+        cconf.windowsize = windowsize;
+        cconf.batch = batch;
+        cconf.rollover = rollover;
+        cconf.no_ext = no_ext;
+        cconf.segments = segments;
+        cconf.multicast = multicast;
 
-            bzero(buffer, buffer_size * sizeof(char));
+        // Every segment of a file needs its own slot
+        cconf.jobs = jobs > segments ? jobs : segments;
 
-            if (type == RRQ)
-                fprintf(stderr, "Downloading: %s\n", filenames[i]);
-            else
-                fprintf(stderr, "Uploading: %s\n", filenames[i]);
+        failed = run_transfers(&cconf, filenames);
 
-            if(send_rq(conn, type, buffer, buffer_size, filenames[i], "octet", pref_buffer_size, timeout, no_ext) < 0)
-                error("send_rq");
+        // A traced client keeps what happened to its transfers
+        if (TRACE_ENABLED)
+            trace_save();
 
-            if(get_data(conn, type, retry, &buffer, buffer_size, filenames[i]) < 0)
-                error("get_data");
+        free (filenames);
 
-            free_conn(conn);
-        }
+        return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
     }
     else {
-        server_fd = init_server_conn(server_port);
-
-        while (1) {
-            rcv_data(server_fd);
-        }
+        run_server(server_port, &sconf);
     }
 
     free (filenames);
-    free (buffer);
 
     return 0;
 }
@@ -0,0 +1,259 @@
+#include "codec.h"
+
+// Options understood in a request, in the order of enum tftp_option
+char *server_options[NB_OPTIONS + 1] = { "blksize", "tsize", "timeout", "windowsize", "rollover", "utimeout", "offset", "length", "multicast", NULL };
+const int option_lens[NB_OPTIONS] = { 7, 5, 7, 10, 8, 8, 6, 6, 9 };
+
+/* Find an option by its name, whatever its case (RFC2347)
+ * Args:
+ *  - name: Name in the datagram
+ *  - len: Size of the name
+ * Return:
+ *  Its index in server_options, or -1 if unknown
+ *  */
+int option_index(const char *name, int len)
+{
+    int k;
+
+    // The size and the first letter single out the option, one comparison confirms it
+    switch (len) {
+        case 5:
+            k = OPT_TSIZE;
+            break;
+        case 6:
+            k = (name[0] | 0x20) == 'o' ? OPT_OFFSET : OPT_LENGTH;
+            break;
+        case 7:
+            k = (name[0] | 0x20) == 'b' ? OPT_BLKSIZE : OPT_TIMEOUT;
+            break;
+        case 8:
+            k = (name[0] | 0x20) == 'r' ? OPT_ROLLOVER : OPT_UTIMEOUT;
+            break;
+        case 9:
+            k = OPT_MULTICAST;
+            break;
+        case 10:
+            k = OPT_WINDOWSIZE;
+            break;
+        default:
+            return -1;
+    }
+
+    return strncasecmp(name, server_options[k], len) == 0 ? k : -1;
+}
+
+/* Read the decimal number at the start of a value, as strtoll() would without the spaces
+ * Args:
+ *  - str: Value in the datagram
+ *  - len: Size of the value
+ * Return:
+ *  The number (0 if none, LLONG_MIN or LLONG_MAX if too big)
+ *  */
+long long parse_number(const char *str, int len)
+{
+    unsigned long long v = 0;
+    int i = 0, neg = 0, digit;
+
+    if (len > 0 && (str[0] == '-' || str[0] == '+')) {
+        neg = str[0] == '-';
+        i++;
+    }
+
+    for (; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+        digit = str[i] - '0';
+
+        if (v > (unsigned long long) (LLONG_MAX - digit) / 10)
+            return neg ? LLONG_MIN : LLONG_MAX;
+
+        v = v * 10 + digit;
+    }
+
+    return neg ? -(long long) v : (long long) v;
+}
+
+/* Tell if a value is a size: only decimal digits, and not too big for a long long
+ * Args:
+ *  - str: Value in the datagram
+ * Return:
+ *  1 if it is, 0 if it is empty, signed, followed by anything or too big
+ *  */
+int is_size(const struct tftp_str *str)
+{
+    int i;
+
+    if (str->len == 0 || str->len > NUMBER_SIZE - 3)
+        return 0;
+
+    for (i = 0; i < str->len; i++) {
+        if (str->ptr[i] < '0' || str->ptr[i] > '9')
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Parse the options of a request or an OACK: pairs of NUL terminated name and value
+ * Unknown options are skipped (RFC2347), a pair cut by the end of the datagram ends them.
+ * Args:
+ *  - buffer: Datagram
+ *  - i: Where the first option starts
+ *  - n: Size of the datagram
+ *  - p: Packet to fill
+ *  */
+void parse_options(const char *buffer, int i, int n, struct tftp_packet *p)
+{
+    const char *name, *value, *end = buffer + n;
+    const char *name_end, *value_end;
+    int k;
+
+    while (i < n) {
+        name = buffer + i;
+
+        if ((name_end = memchr(name, 0, end - name)) == NULL || name_end + 1 >= end)
+            break;
+
+        value = name_end + 1;
+
+        if ((value_end = memchr(value, 0, end - value)) == NULL)
+            break;
+
+        i = value_end + 1 - buffer;
+
+        if ((k = option_index(name, name_end - name)) < 0)
+            continue;
+
+        p->asked |= 1u << k;
+        p->values[k].ptr = value;
+        p->values[k].len = value_end - value;
+        p->numbers[k] = parse_number(value, value_end - value);
+    }
+}
+
+/* Parse a RRQ/WRQ in place: the packet points into the datagram
+ * Args:
+ *  - buffer: Datagram received (at least its 2 bytes of opcode)
+ *  - n: Size of the datagram
+ *  - p: Packet to fill (its file name is set even if the mode is wrong)
+ * Return:
+ *  CODEC_OK, or what is wrong with the request
+ *  */
+enum codec_error parse_request(const char *buffer, int n, struct tftp_packet *p)
+{
+    const char *end;
+    int i = 2, k;
+
+    p->opcode = buffer[1];
+    p->filename.ptr = NULL;
+    p->mode.ptr = NULL;
+    p->asked = 0;
+
+    for (k = 0; k < NB_OPTIONS; k++)
+        p->numbers[k] = -1;
+
+    if (n - i < 2 || (end = memchr(buffer + i, 0, n - i)) == NULL)
+        return CODEC_NO_FILENAME;
+
+    p->filename.ptr = buffer + i;
+    p->filename.len = end - p->filename.ptr;
+    i += p->filename.len + 1;
+
+    if (n - i < 2 || (end = memchr(buffer + i, 0, n - i)) == NULL)
+        return CODEC_NO_MODE;
+
+    p->mode.ptr = buffer + i;
+    p->mode.len = end - p->mode.ptr;
+    i += p->mode.len + 1;
+
+    // Any combination of upper and lower case (RFC1350)
+    if (!(p->mode.len == 5 && strncasecmp(p->mode.ptr, "octet", 5) == 0)
+            && !(p->mode.len == 8 && strncasecmp(p->mode.ptr, "netascii", 8) == 0))
+        return CODEC_BAD_MODE;
+
+    parse_options(buffer, i, n, p);
+
+    return CODEC_OK;
+}
+
+/* Parse an OACK in place: the packet points into the datagram
+ * Args:
+ *  - buffer: Datagram received (at least its 2 bytes of opcode)
+ *  - n: Size of the datagram
+ *  - p: Packet to fill
+ *  */
+void parse_oack(const char *buffer, int n, struct tftp_packet *p)
+{
+    int k;
+
+    p->opcode = buffer[1];
+    p->filename.ptr = NULL;
+    p->mode.ptr = NULL;
+    p->asked = 0;
+
+    for (k = 0; k < NB_OPTIONS; k++)
+        p->numbers[k] = -1;
+
+    parse_options(buffer, 2, n, p);
+}
+
+/* Write a number in decimal, without going through a format string
+ * Args:
+ *  - out: Where to write it, followed by a NUL (NUMBER_SIZE bytes are enough)
+ *  - value: Number to write
+ * Return:
+ *  Number of characters written, NUL excluded
+ *  */
+int format_number(char *out, long long value)
+{
+    unsigned long long v = value < 0 ? -(unsigned long long) value : (unsigned long long) value;
+    char digits[NUMBER_SIZE];
+    int nb = 0, i = 0;
+
+    if (value < 0)
+        out[i++] = '-';
+
+    // Last digit first, then reversed
+    do {
+        digits[nb++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+
+    while (nb > 0)
+        out[i++] = digits[--nb];
+
+    out[i] = '\0';
+
+    return i;
+}
+
+/* Append a NUL terminated string to a datagram being built
+ * Args:
+ *  - buffer: Datagram
+ *  - i: Where to write the string
+ *  - str: String to write
+ *  - len: Size of the string
+ * Return:
+ *  Where the next field goes, after the NUL
+ *  */
+int put_string(char *buffer, int i, const char *str, int len)
+{
+    memcpy(buffer + i, str, len);
+    buffer[i + len] = '\0';
+
+    return i + len + 1;
+}
+
+/* Append an option and its numeric value to a datagram being built
+ * Args:
+ *  - buffer: Datagram
+ *  - i: Where to write the option
+ *  - k: Option
+ *  - value: Its value
+ * Return:
+ *  Where the next field goes, after the NUL of the value
+ *  */
+int put_option(char *buffer, int i, enum tftp_option k, long long value)
+{
+    i = put_string(buffer, i, server_options[k], option_lens[k]);
+
+    return i + format_number(buffer + i, value) + 1;
+}
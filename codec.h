@@ -0,0 +1,64 @@
+#ifndef CODEC_H
+
+#define CODEC_H
+
+#include <limits.h>
+
+#include "network.h"
+
+#define NUMBER_SIZE 21 // Longest number formatted: sign, 19 digits and NUL
+
+/* Options understood, in the order of server_options (and of the options of a session) */
+enum tftp_option {
+    OPT_BLKSIZE, // RFC2348
+    OPT_TSIZE, // RFC2349
+    OPT_TIMEOUT, // RFC2349 (seconds)
+    OPT_WINDOWSIZE, // RFC7440
+    OPT_ROLLOVER, // Block# following 65535 (non standard)
+    OPT_UTIMEOUT, // Timeout in microseconds (non standard, as tftp-hpa)
+    OPT_OFFSET, // First byte sent (non standard: segmented downloads)
+    OPT_LENGTH, // Bytes sent from offset (non standard)
+    OPT_MULTICAST // RFC2090, its value is a string
+};
+
+/* Is an option in a parsed packet */
+#define HAS_OPTION(p, k) (((p)->asked >> (k)) & 1)
+
+/* Bytes of a datagram, never copied: the datagram holds the NUL following them */
+struct tftp_str {
+    const char *ptr; // First byte (NULL if missing)
+    int len; // Number of bytes, NUL excluded
+};
+
+/* RRQ/WRQ or OACK parsed in place, pointing into the datagram received */
+struct tftp_packet {
+    int opcode; // 1 (RRQ), 2 (WRQ) or 6 (OACK)
+    struct tftp_str filename; // File asked (requests)
+    struct tftp_str mode; // "octet" or "netascii" (requests)
+    unsigned int asked; // Options in the packet (bit 1 << option), the last one wins if repeated
+    struct tftp_str values[NB_OPTIONS]; // Value of each option in it, as sent
+    long long numbers[NB_OPTIONS]; // The same read as a decimal number (-1 if not in the packet)
+};
+
+/* Why a request cannot be parsed */
+enum codec_error {
+    CODEC_OK, // Parsed
+    CODEC_NO_FILENAME, // No NUL terminated file name
+    CODEC_NO_MODE, // No NUL terminated mode after it
+    CODEC_BAD_MODE // Neither octet nor netascii
+};
+
+extern char *server_options[NB_OPTIONS + 1]; // Options understood in a request (NULL terminated)
+extern const int option_lens[NB_OPTIONS]; // Size of each name of server_options
+
+int option_index(const char *name, int len);
+long long parse_number(const char *str, int len);
+int is_size(const struct tftp_str *str);
+void parse_options(const char *buffer, int i, int n, struct tftp_packet *p);
+enum codec_error parse_request(const char *buffer, int n, struct tftp_packet *p);
+void parse_oack(const char *buffer, int n, struct tftp_packet *p);
+int format_number(char *out, long long value);
+int put_string(char *buffer, int i, const char *str, int len);
+int put_option(char *buffer, int i, enum tftp_option k, long long value);
+
+#endif /* end of include guard: CODEC_H */
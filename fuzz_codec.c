@@ -0,0 +1,93 @@
+#include "fuzz_codec.h"
+
+/* Tell if a field parsed lies inside the datagram, NUL included
+ * Args:
+ *  - str: Field parsed (NULL if missing)
+ *  - data: Datagram
+ *  - n: Size of the datagram
+ * Return:
+ *  1 if it does (or is missing), 0 if the codec read past the datagram
+ *  */
+int fuzz_inside(const struct tftp_str *str, const char *data, int n)
+{
+    if (str->ptr == NULL)
+        return 1;
+
+    return str->ptr >= data && str->len >= 0 && str->ptr + str->len < data + n && str->ptr[str->len] == '\0';
+}
+
+/* Check a packet parsed from a datagram: every field in it, every number of an option not asked -1
+ * Args:
+ *  - p: Packet parsed
+ *  - data: Datagram
+ *  - n: Size of the datagram
+ *  */
+void fuzz_check(const struct tftp_packet *p, const char *data, int n)
+{
+    int k;
+
+    if (!fuzz_inside(&p->filename, data, n) || !fuzz_inside(&p->mode, data, n))
+        __builtin_trap();
+
+    for (k = 0; k < NB_OPTIONS; k++) {
+        if (HAS_OPTION(p, k) ? !fuzz_inside(&p->values[k], data, n) : p->numbers[k] != -1)
+            __builtin_trap();
+    }
+}
+
+/* Entry point of libFuzzer: parse the input as a request and as an OACK
+ * The input is copied to a buffer of its exact size, so that AddressSanitizer
+ * catches any byte read past the datagram.
+ * Args:
+ *  - input: Datagram generated by the fuzzer
+ *  - size: Size of the datagram
+ * Return:
+ *  0 (inputs are never rejected)
+ *  */
+int LLVMFuzzerTestOneInput(const uint8_t *input, size_t size)
+{
+    struct tftp_packet p;
+    char *data;
+
+    // The workers only parse datagrams with an opcode, and never more than a block
+    if (size < 2 || size > MAX_BLK_SIZE + 4)
+        return 0;
+
+    data = malloc(size);
+    memcpy(data, input, size);
+
+    parse_request(data, size, &p);
+    fuzz_check(&p, data, size);
+
+    parse_oack(data, size, &p);
+    fuzz_check(&p, data, size);
+
+    free(data);
+
+    return 0;
+}
+
+#ifdef FUZZ_REPLAY
+/* Without libFuzzer (e.g. gcc): run the files given, crashes found or a corpus */
+int main(int argc, char *argv[])
+{
+    uint8_t buffer[MAX_BLK_SIZE + 4];
+    size_t size;
+    FILE *in;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if ((in = fopen(argv[i], "rb")) == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        size = fread(buffer, 1, sizeof(buffer), in);
+        fclose(in);
+
+        LLVMFuzzerTestOneInput(buffer, size);
+    }
+
+    return 0;
+}
+#endif
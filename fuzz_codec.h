@@ -0,0 +1,13 @@
+#ifndef FUZZ_CODEC_H
+
+#define FUZZ_CODEC_H
+
+#include <stdint.h>
+
+#include "codec.h"
+
+int fuzz_inside(const struct tftp_str *str, const char *data, int n);
+void fuzz_check(const struct tftp_packet *p, const char *data, int n);
+int LLVMFuzzerTestOneInput(const uint8_t *input, size_t size);
+
+#endif /* end of include guard: FUZZ_CODEC_H */
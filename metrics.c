@@ -0,0 +1,403 @@
+#include "metrics.h"
+
+// 10ms to 60s: from a small file on the loopback to a large one over a lossy link
+const long long duration_bounds[NB_DURATION_BUCKETS - 1] = {
+    10000, 50000, 100000, 500000, USEC, 5 * USEC, 10 * USEC, 30 * USEC, 60 * USEC
+};
+
+/* Count a transfer in the histogram of the durations
+ * Args:
+ *  - st: Counters of the worker which ran it
+ *  - duration: Time from the request to the end of the session (us)
+ *  */
+void observe_duration(struct server_stats *st, long long duration)
+{
+    int k;
+
+    for (k = 0; k < NB_DURATION_BUCKETS - 1 && duration > duration_bounds[k]; k++)
+        ;
+
+    STAT_ADD(st, durations[k], 1);
+    STAT_ADD(st, duration_sum, duration);
+}
+
+/* Create the listening socket of the metrics
+ * Args:
+ *  - addr: Path of a Unix socket (with a '/'), host:port, or port (on METRICS_HOST)
+ * Return:
+ *  - socket's file descriptor
+ *  */
+int init_metrics_conn(const char *addr)
+{
+    struct sockaddr_storage in;
+    struct sockaddr_un un;
+    char host[64];
+    const char *port;
+    int enable = 1;
+    int fd;
+
+    if (strchr(addr, '/') != NULL) {
+        bzero(&un, sizeof(un));
+        un.sun_family = AF_UNIX;
+
+        if (strlen(addr) >= sizeof(un.sun_path))
+            error("Metrics socket path too long");
+
+        strcpy(un.sun_path, addr);
+
+        // Left by a previous run
+        unlink(addr);
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            error("socket(metrics)");
+
+        if (bind(fd, (struct sockaddr*) &un, sizeof(un)) < 0)
+            error("bind(metrics)");
+    }
+    else {
+        // Only local scrapers by default: the counters tell what is transferred
+        snprintf(host, sizeof(host), "%s", METRICS_HOST);
+        port = addr;
+
+        // The last ':' ends the host, [::1]:9090 for IPv6
+        if (strrchr(addr, ':') != NULL) {
+            snprintf(host, sizeof(host), "%.*s", (int) (strrchr(addr, ':') - addr), addr);
+            port = strrchr(addr, ':') + 1;
+        }
+
+        if (atoi(port) <= 0 || resolve_addr(host, atoi(port), &in) < 0) {
+            errno = 0;
+            error("Metrics address must be PORT, HOST:PORT or the path of a Unix socket");
+        }
+
+        if ((fd = socket(in.ss_family, SOCK_STREAM, 0)) < 0)
+            error("socket(metrics)");
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+            error("setsockopt(reuse addr) failed");
+
+        if (bind(fd, (struct sockaddr*) &in, addr_size(&in)) < 0)
+            error("bind(metrics)");
+    }
+
+    if (listen(fd, 16) < 0)
+        error("listen(metrics)");
+
+    return fd;
+}
+
+/* Start the thread serving the metrics
+ * Args:
+ *  - m: Endpoint to initialize
+ *  - addr: Where to serve them (see init_metrics_conn())
+ *  - workers: Workers whose counters are exported
+ *  - nb_workers: Number of workers
+ *  - cache: File cache shared by the workers
+ *  - wr: Writer threads (NULL if disabled)
+ *  */
+void start_metrics(struct metrics *m, const char *addr, struct server *workers, int nb_workers, struct file_cache *cache, struct writer *wr)
+{
+    bzero(m, sizeof(*m));
+    m->fd = init_metrics_conn(addr);
+    m->workers = workers;
+    m->nb_workers = nb_workers;
+    m->cache = cache;
+    m->writer = wr;
+
+    if ((errno = pthread_create(&m->thread, NULL, serve_metrics, m)) != 0)
+        error("pthread_create");
+}
+
+/* Print the HELP and TYPE lines of a metric
+ * Args:
+ *  - out: Where to print
+ *  - name: Name of the metric
+ *  - type: counter, gauge or histogram
+ *  - help: Description
+ *  */
+void metric_header(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Print a counter of every worker
+ * Args:
+ *  - out: Where to print
+ *  - m: Endpoint
+ *  - name: Name of the metric
+ *  - type: counter or gauge
+ *  - help: Description
+ *  - field: Offset of the counter in struct server_stats
+ *  */
+void worker_metric(FILE *out, struct metrics *m, const char *name, const char *type, const char *help, size_t field)
+{
+    unsigned long *v;
+    int i;
+
+    metric_header(out, name, type, help);
+
+    for (i = 0; i < m->nb_workers; i++) {
+        v = (unsigned long*) ((char*) &m->workers[i].stats + field);
+        fprintf(out, "%s{worker=\"%d\"} %lu\n", name, m->workers[i].id, __atomic_load_n(v, __ATOMIC_RELAXED));
+    }
+}
+
+/* Print a counter of a pool
+ * Args:
+ *  - out: Where to print
+ *  - name: Name of the metric
+ *  - owner: Worker or writer owning the pool
+ *  - p: Pool
+ *  - field: Offset of the counter in struct pool
+ *  */
+void print_pool_value(FILE *out, const char *name, const char *owner, struct pool *p, size_t field)
+{
+    unsigned long v;
+
+    pthread_mutex_lock(&p->lock);
+    v = *(unsigned long*) ((char*) p + field);
+    pthread_mutex_unlock(&p->lock);
+
+    fprintf(out, "%s{owner=\"%s\",pool=\"%s\"} %lu\n", name, owner, p->name, v);
+}
+
+/* Print a counter of every pool (sessions of the workers, blocks of the writer)
+ * Args:
+ *  - out: Where to print
+ *  - m: Endpoint
+ *  - name: Name of the metric
+ *  - type: counter or gauge
+ *  - help: Description
+ *  - field: Offset of the counter in struct pool
+ *  */
+void pool_metric(FILE *out, struct metrics *m, const char *name, const char *type, const char *help, size_t field)
+{
+    char owner[16];
+    int i;
+
+    metric_header(out, name, type, help);
+
+    for (i = 0; i < m->nb_workers; i++) {
+        snprintf(owner, sizeof(owner), "worker%d", m->workers[i].id);
+        print_pool_value(out, name, owner, &m->workers[i].session_pool, field);
+    }
+
+    if (m->writer != NULL) {
+        print_pool_value(out, name, "writer", &m->writer->mtu_pool, field);
+        print_pool_value(out, name, "writer", &m->writer->jumbo_pool, field);
+    }
+}
+
+/* Print every metric in the Prometheus text format
+ * Args:
+ *  - out: Where to print
+ *  - m: Endpoint
+ *  */
+void print_metrics(FILE *out, struct metrics *m)
+{
+    struct server_stats *st;
+    unsigned long count, hits, misses, evictions, loads, files, dgram_evictions;
+    unsigned long writes, syncs, stalls, errors;
+    size_t size, max_size, dgram_size, inflight;
+    int i, k;
+
+    worker_metric(out, m, "tftp_sessions_active", "gauge", "Transfers running",
+            offsetof(struct server_stats, active));
+    worker_metric(out, m, "tftp_rrq_total", "counter", "Read requests accepted",
+            offsetof(struct server_stats, rrq));
+    worker_metric(out, m, "tftp_wrq_total", "counter", "Write requests accepted",
+            offsetof(struct server_stats, wrq));
+    worker_metric(out, m, "tftp_refused_total", "counter", "Requests refused",
+            offsetof(struct server_stats, refused));
+    worker_metric(out, m, "tftp_timeouts_total", "counter", "Retransmission timers expired",
+            offsetof(struct server_stats, timeouts));
+    worker_metric(out, m, "tftp_aborted_total", "counter", "Sessions given up without progress",
+            offsetof(struct server_stats, aborted));
+    worker_metric(out, m, "tftp_retransmits_total", "counter", "Windows or datagrams sent again",
+            offsetof(struct server_stats, retransmits));
+    worker_metric(out, m, "tftp_send_errors_total", "counter", "Datagrams the kernel refused to send",
+            offsetof(struct server_stats, send_errors));
+    worker_metric(out, m, "tftp_multicast_joins_total", "counter", "Clients which joined a running multicast transfer",
+            offsetof(struct server_stats, mcast_joins));
+    worker_metric(out, m, "tftp_paced_total", "counter", "Windows held back by the rate limits",
+            offsetof(struct server_stats, paced));
+    worker_metric(out, m, "tftp_packets_in_total", "counter", "Datagrams received",
+            offsetof(struct server_stats, pkts_in));
+    worker_metric(out, m, "tftp_bytes_in_total", "counter", "Bytes received",
+            offsetof(struct server_stats, bytes_in));
+    worker_metric(out, m, "tftp_packets_out_total", "counter", "Datagrams sent",
+            offsetof(struct server_stats, pkts_out));
+    worker_metric(out, m, "tftp_bytes_out_total", "counter", "Bytes sent",
+            offsetof(struct server_stats, bytes_out));
+    worker_metric(out, m, "tftp_syscalls_total", "counter", "Send/receive syscalls",
+            offsetof(struct server_stats, syscalls));
+
+    metric_header(out, "tftp_options_total", "counter", "Requests asking an option");
+
+    for (i = 0; i < m->nb_workers; i++) {
+        for (k = 0; k < NB_OPTIONS; k++)
+            fprintf(out, "tftp_options_total{worker=\"%d\",option=\"%s\"} %lu\n",
+                    m->workers[i].id, server_options[k], STAT_GET(&m->workers[i].stats, options[k]));
+    }
+
+    metric_header(out, "tftp_errors_sent_total", "counter", "ERROR sent, by code");
+
+    for (i = 0; i < m->nb_workers; i++) {
+        for (k = 0; k < NB_ERROR_CODES; k++)
+            fprintf(out, "tftp_errors_sent_total{worker=\"%d\",code=\"%d\"} %lu\n",
+                    m->workers[i].id, k, STAT_GET(&m->workers[i].stats, errors[k]));
+    }
+
+    metric_header(out, "tftp_transfer_duration_seconds", "histogram", "Time from the request to the end of the session");
+
+    for (i = 0; i < m->nb_workers; i++) {
+        st = &m->workers[i].stats;
+
+        // Buckets are cumulative in the exposition, not in the counters
+        for (k = 0, count = 0; k < NB_DURATION_BUCKETS; k++) {
+            count += STAT_GET(st, durations[k]);
+
+            if (k < NB_DURATION_BUCKETS - 1)
+                fprintf(out, "tftp_transfer_duration_seconds_bucket{worker=\"%d\",le=\"%g\"} %lu\n",
+                        m->workers[i].id, (double) duration_bounds[k] / USEC, count);
+            else
+                fprintf(out, "tftp_transfer_duration_seconds_bucket{worker=\"%d\",le=\"+Inf\"} %lu\n",
+                        m->workers[i].id, count);
+        }
+
+        fprintf(out, "tftp_transfer_duration_seconds_sum{worker=\"%d\"} %.6f\n",
+                m->workers[i].id, (double) STAT_GET(st, duration_sum) / USEC);
+        fprintf(out, "tftp_transfer_duration_seconds_count{worker=\"%d\"} %lu\n", m->workers[i].id, count);
+    }
+
+    // Copies taken under the lock, printed without it
+    pthread_mutex_lock(&m->cache->lock);
+    files = m->cache->entries;
+    size = m->cache->size;
+    max_size = m->cache->max_size;
+    hits = m->cache->hits;
+    misses = m->cache->misses;
+    evictions = m->cache->evictions;
+    loads = m->cache->loads;
+    dgram_size = m->cache->dgram_size;
+    dgram_evictions = m->cache->dgram_evictions;
+    pthread_mutex_unlock(&m->cache->lock);
+
+    metric_header(out, "tftp_cache_files", "gauge", "Files in the cache");
+    fprintf(out, "tftp_cache_files %lu\n", files);
+    metric_header(out, "tftp_cache_bytes", "gauge", "Memory used by the files cached");
+    fprintf(out, "tftp_cache_bytes %zu\n", size);
+    metric_header(out, "tftp_cache_max_bytes", "gauge", "Memory budget of the file cache");
+    fprintf(out, "tftp_cache_max_bytes %zu\n", max_size);
+    metric_header(out, "tftp_cache_hits_total", "counter", "Requests served from the cache");
+    fprintf(out, "tftp_cache_hits_total %lu\n", hits);
+    metric_header(out, "tftp_cache_misses_total", "counter", "Requests for files not cached (or changed)");
+    fprintf(out, "tftp_cache_misses_total %lu\n", misses);
+    metric_header(out, "tftp_cache_evictions_total", "counter", "Files evicted to make room for others");
+    fprintf(out, "tftp_cache_evictions_total %lu\n", evictions);
+    metric_header(out, "tftp_cache_loads_total", "counter", "Files read into the cache by the loader thread");
+    fprintf(out, "tftp_cache_loads_total %lu\n", loads);
+    metric_header(out, "tftp_dgram_cache_bytes", "gauge", "Memory used by the pre-built DATA");
+    fprintf(out, "tftp_dgram_cache_bytes %zu\n", dgram_size);
+    metric_header(out, "tftp_dgram_cache_evictions_total", "counter", "Sets of pre-built DATA dropped");
+    fprintf(out, "tftp_dgram_cache_evictions_total %lu\n", dgram_evictions);
+
+    if (m->writer != NULL) {
+        pthread_mutex_lock(&m->writer->lock);
+        inflight = m->writer->inflight;
+        writes = m->writer->writes;
+        syncs = m->writer->syncs;
+        stalls = m->writer->stalls;
+        errors = m->writer->errors;
+        pthread_mutex_unlock(&m->writer->lock);
+
+        metric_header(out, "tftp_writer_inflight_bytes", "gauge", "Upload bytes queued and not written yet");
+        fprintf(out, "tftp_writer_inflight_bytes %zu\n", inflight);
+        metric_header(out, "tftp_writer_writes_total", "counter", "Upload blocks written");
+        fprintf(out, "tftp_writer_writes_total %lu\n", writes);
+        metric_header(out, "tftp_writer_syncs_total", "counter", "fsync() of the uploads");
+        fprintf(out, "tftp_writer_syncs_total %lu\n", syncs);
+        metric_header(out, "tftp_writer_stalls_total", "counter", "Times a worker waited for the disk");
+        fprintf(out, "tftp_writer_stalls_total %lu\n", stalls);
+        metric_header(out, "tftp_writer_errors_total", "counter", "Upload blocks which could not be written");
+        fprintf(out, "tftp_writer_errors_total %lu\n", errors);
+    }
+
+    pool_metric(out, m, "tftp_pool_used", "gauge", "Objects handed out",
+            offsetof(struct pool, used));
+    pool_metric(out, m, "tftp_pool_peak", "gauge", "Most objects handed out at once",
+            offsetof(struct pool, peak));
+    pool_metric(out, m, "tftp_pool_objects", "gauge", "Objects carved from the slabs",
+            offsetof(struct pool, total));
+}
+
+/* Read the request of a scraper and answer it, whatever the path asked
+ * Args:
+ *  - m: Endpoint
+ *  - fd: Connection of the scraper
+ *  */
+void answer_scraper(struct metrics *m, int fd)
+{
+    char req[METRICS_REQ_SIZE];
+    struct timeval tv;
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out;
+    int n;
+
+    // A silent scraper must not hold the others
+    tv.tv_sec = METRICS_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if ((n = recv(fd, req, sizeof(req) - 1, 0)) <= 0)
+        return;
+
+    req[n] = '\0';
+
+    if (strncmp(req, "GET ", 4) != 0) {
+        dprintf(fd, "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        return;
+    }
+
+    if ((out = open_memstream(&body, &body_len)) == NULL)
+        return;
+
+    print_metrics(out, m);
+    fclose(out);
+
+    dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+
+    if (write(fd, body, body_len) < 0)
+        fprintf(stderr, "Cannot send the metrics: %s\n", strerror(errno));
+
+    free(body);
+}
+
+/* Answer the scrapers one after the other, until the process stops
+ * Args:
+ *  - arg: Endpoint (struct metrics*)
+ * Return:
+ *  Never returns
+ *  */
+void *serve_metrics(void *arg)
+{
+    struct metrics *m = arg;
+    int fd;
+
+    while (1) {
+        if ((fd = accept(m->fd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            error("accept(metrics)");
+        }
+
+        answer_scraper(m, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef METRICS_H
+
+#define METRICS_H
+
+#include <sys/un.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#include "network.h"
+
+#define METRICS_HOST "127.0.0.1" // Address the metrics are served on when only a port is given
+#define METRICS_TIMEOUT 1 // Time given to a scraper to send its request (s)
+#define METRICS_REQ_SIZE 1024 // Bytes of the HTTP request read (the rest is ignored)
+
+extern const long long duration_bounds[NB_DURATION_BUCKETS - 1]; // Upper bound (us) of each bucket but the last (+Inf)
+
+/* Endpoint serving the counters of the server in the Prometheus text format */
+struct metrics {
+    int fd; // Listening socket (TCP or Unix)
+    pthread_t thread; // Thread answering the scrapers
+    struct server *workers; // Workers whose counters are exported
+    int nb_workers; // Number of workers
+    struct file_cache *cache; // File cache shared by the workers
+    struct writer *writer; // Writer threads (NULL if disabled)
+};
+
+void observe_duration(struct server_stats *st, long long duration);
+int init_metrics_conn(const char *addr);
+void start_metrics(struct metrics *m, const char *addr, struct server *workers, int nb_workers, struct file_cache *cache, struct writer *wr);
+void metric_header(FILE *out, const char *name, const char *type, const char *help);
+void worker_metric(FILE *out, struct metrics *m, const char *name, const char *type, const char *help, size_t field);
+void print_pool_value(FILE *out, const char *name, const char *owner, struct pool *p, size_t field);
+void pool_metric(FILE *out, struct metrics *m, const char *name, const char *type, const char *help, size_t field);
+void print_metrics(FILE *out, struct metrics *m);
+void answer_scraper(struct metrics *m, int fd);
+void *serve_metrics(void *arg);
+
+#endif /* end of include guard: METRICS_H */
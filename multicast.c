@@ -0,0 +1,571 @@
+#include "multicast.h"
+
+unsigned long mcast_next_port = 0;
+
+/* Add a client to a multicast group
+ * Args:
+ *  - g: Group joined
+ *  - addr: TID of the client
+ * Return:
+ *  - 0: Client added (or already there, its request was sent again)
+ *  - -1: No memory for one more client
+ *  */
+int mcast_add(struct mcast_group *g, struct sockaddr_storage *addr)
+{
+    struct mcast_member *members;
+    int i;
+
+    for (i = 0; i < g->nb_members; i++) {
+        if (addr_equal(&g->members[i].addr, addr))
+            return 0;
+    }
+
+    if (g->nb_members == g->max_members) {
+        members = realloc(g->members, (g->max_members > 0 ? g->max_members * 2 : 16) * sizeof(struct mcast_member));
+
+        if (members == NULL)
+            return -1;
+
+        g->members = members;
+        g->max_members = g->max_members > 0 ? g->max_members * 2 : 16;
+    }
+
+    g->members[g->nb_members++].addr = *addr;
+
+    return 0;
+}
+
+/* Send the OACK telling a client which group to listen to (RFC2090: multicast "addr,port,mc")
+ * It goes from the TID of the group, where every ACK comes to.
+ * Args:
+ *  - g: Group of the client
+ *  - s: Session whose options are acknowledged, the OACK is built in its buffer
+ *  - to: TID of the client
+ *  - master: Is the client the master client (it ACKs the DATA)
+ * Return:
+ *  Size of the OACK, -1 if the kernel refused it
+ *  */
+int mcast_oack(struct mcast_group *g, struct session *s, struct sockaddr_storage *to, int master)
+{
+    struct conn_info conn;
+    char ip[INET_ADDRSTRLEN], value[INET_ADDRSTRLEN + 16];
+
+    conn = g->s->conn;
+    conn.sock = (struct sockaddr*) to;
+    conn.addr_len = addr_size(to);
+
+    inet_ntop(AF_INET, &((struct sockaddr_in*) &g->addr)->sin_addr, ip, sizeof(ip));
+    snprintf(value, sizeof(value), "%s,%d,%d", ip, addr_port(&g->addr), master);
+
+    s->options[OPT_MULTICAST] = master;
+
+    return send_oack(conn, s->buffer, s->options, value);
+}
+
+/* Make a session the sender of a new multicast group, its client being the master client
+ * Args:
+ *  - srv: Worker running the session
+ *  - s: Session of the first client asking the file
+ * Return:
+ *  - 0: Group opened, OACK sent
+ *  - -1: Cannot send to a group from the socket of the session
+ *  */
+int mcast_open(struct server *srv, struct session *s)
+{
+    struct mcast_group *g;
+    int ttl = MCAST_TTL, loop = 1;
+
+    // The clients of this host listen to the group too
+    if (setsockopt(s->conn.fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+            || setsockopt(s->conn.fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+        return -1;
+
+    if ((g = malloc(sizeof(struct mcast_group))) == NULL)
+        return -1;
+
+    bzero(g, sizeof(*g));
+    g->s = s;
+
+    if (mcast_add(g, &s->peer) < 0) {
+        free(g);
+        return -1;
+    }
+
+    // Each group on its own port, whichever worker opens it
+    memcpy(&g->addr, &srv->conf->multicast, sizeof(srv->conf->multicast));
+    ((struct sockaddr_in*) &g->addr)->sin_port = htons(ntohs(srv->conf->multicast.sin_port)
+            + __atomic_fetch_add(&mcast_next_port, 1, __ATOMIC_RELAXED) % MCAST_PORTS);
+
+    g->blocks = store_size(s) / (s->buffer_size - 4) + 1;
+
+    if (store_stat(s, &g->file) < 0) {
+        free(g->members);
+        free(g);
+        return -1;
+    }
+
+    // DATA go to the group, the ACK still come from the master client
+    s->conn.sock = (struct sockaddr*) &g->addr;
+    s->conn.addr_len = addr_size(&g->addr);
+    s->group = g;
+
+    g->next = srv->groups;
+    srv->groups = g;
+
+    // The group is closed with the session
+    if ((s->sent_len = mcast_oack(g, s, &s->peer, 1)) < 0) {
+        send_failed(s);
+        return 0;
+    }
+
+    rtt_arm(s, 0);
+    reset_timer(s);
+
+    return 0;
+}
+
+/* Answer a request asking for multicast: join the group already sending the file, or open one
+ * Args:
+ *  - srv: Worker receiving the request
+ *  - s: Session opened for the request (handle_rq() accepted it without answering)
+ * Return:
+ *  - 0: The session goes on: it sends to a new group, or to its client alone
+ *  - 1: The client joined a running group, its session is not needed anymore
+ *  */
+int mcast_request(struct server *srv, struct session *s)
+{
+    struct mcast_group *g;
+    struct stat st;
+
+    // Not knowing which copy of the file we send, we cannot share it
+    if (store_stat(s, &st) < 0)
+        g = NULL;
+    else
+        g = srv->groups;
+
+    // Same copy of the file and same DATA (same content if generated per client): one more client for the group
+    for (; g != NULL; g = g->next) {
+        if (g->s->buffer_size == s->buffer_size && g->s->windowsize == s->windowsize && strcmp(g->s->filename, s->filename) == 0
+                && g->s->blob == s->blob && g->file.st_dev == st.st_dev && g->file.st_ino == st.st_ino
+                && g->file.st_size == st.st_size && g->file.st_mtim.tv_sec == st.st_mtim.tv_sec
+                && g->file.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+            break;
+    }
+
+    if (g != NULL && mcast_add(g, &s->peer) == 0) {
+        // Not the master client: it gets the DATA from where the group is
+        mcast_oack(g, s, &s->peer, 0);
+        STAT_ADD(&srv->stats, mcast_joins, 1);
+
+        s->end = END_JOINED;
+        return 1;
+    }
+
+    if (g == NULL && mcast_open(srv, s) == 0)
+        return 0;
+
+    // Without the option, as any other client
+    s->options[OPT_MULTICAST] = -1;
+    if ((s->sent_len = send_oack(s->conn, s->buffer, s->options, NULL)) < 0) {
+        send_failed(s);
+        return 0;
+    }
+
+    rtt_arm(s, 0);
+    reset_timer(s);
+
+    return 0;
+}
+
+/* Make the first client of a group its master client, when the previous one left
+ * Its first ACK tells from which block it misses the file.
+ * Args:
+ *  - g: Group whose master client changed
+ *  */
+void mcast_handoff(struct mcast_group *g)
+{
+    struct session *s = g->s;
+
+    // Not sent: the group goes on with the DATA until this client gives up too
+    if ((s->sent_len = mcast_oack(g, s, &g->members[0].addr, 1)) < 0)
+        s->sent_len = 0;
+
+    g->handoff = 1;
+
+    // The new client answers the OACK, not the DATA sent so far
+    s->rtt_sent = 0;
+    rtt_arm(s, 0);
+    reset_timer(s);
+}
+
+/* Remove a client from a group: it has the file, sent an ERROR or stopped answering
+ * Args:
+ *  - g: Group of the client
+ *  - i: Index of the client
+ * Return:
+ *  - 0: Other clients remain
+ *  - 1: The group is empty, its session is over
+ *  */
+int mcast_remove(struct mcast_group *g, int i)
+{
+    // Kept in order of arrival: the longest waiting client is the next master
+    memmove(&g->members[i], &g->members[i + 1], (g->nb_members - i - 1) * sizeof(struct mcast_member));
+    g->nb_members--;
+
+    if (g->nb_members == 0)
+        return 1;
+
+    if (i == 0)
+        mcast_handoff(g);
+
+    return 0;
+}
+
+/* Handle a datagram received on the TID of a multicast group, from any of its clients
+ * Args:
+ *  - s: Session of the group
+ *  - buffer: Buffer with the datagram
+ *  - n: Size of the datagram
+ *  - from: Client which sent it
+ * Return:
+ *  - 0: The group goes on
+ *  - 1: Every client left, the session is over
+ *  */
+int mcast_dgram(struct session *s, char *buffer, int n, struct sockaddr_storage *from)
+{
+    struct mcast_group *g = s->group;
+    struct conn_info to;
+    long long block_nb;
+    int i;
+
+    for (i = 0; i < g->nb_members && !addr_equal(from, &g->members[i].addr); i++);
+
+    to = s->conn;
+    to.sock = (struct sockaddr*) from;
+    to.addr_len = addr_size(from);
+
+    // ERROR are never answered, two peers would bounce them forever
+    if (i == g->nb_members) {
+        if (n < 2 || buffer[1] != 5)
+            send_error(to, 5, "Unknown transfer ID");
+        return 0;
+    }
+
+    // A client giving up leaves the group
+    if (n >= 4 && buffer[0] == 0 && buffer[1] == 5)
+        return mcast_remove(g, i);
+
+    if (n != 4 || buffer[0] != 0 || buffer[1] != 4) {
+        send_error(to, 4, "Illegal TFTP operation");
+        return mcast_remove(g, i);
+    }
+
+    block_nb = (unsigned char) buffer[2] * 256 + (unsigned char) buffer[3];
+
+    // ACK of the last block: this client has the whole file, master or not
+    if (block_nb == g->blocks) {
+        TRACE(TRACE_ACK, s, block_nb, i);
+        s->end = END_DONE;
+        return mcast_remove(g, i);
+    }
+
+    // Only the master client drives the transfer (RFC2090)
+    if (i != 0) {
+        TRACE(TRACE_ACK, s, block_nb, i);
+        return 0;
+    }
+
+    // A new master client, or one which got the blocks it missed from DATA sent before it took over:
+    // the group goes on from the first block it misses
+    if (g->handoff || (block_nb > s->last_block && block_nb < g->blocks)) {
+        TRACE(TRACE_ACK, s, block_nb, i);
+
+        if (g->handoff && s->rtt_sent != 0)
+            rtt_sample(s);
+
+        g->handoff = 0;
+        s->sent_len = 0;
+        s->last_block = s->last_ack = block_nb;
+        s->wait_last_ack = 0;
+
+        if (s->map == NULL)
+            fseeko(s->fd, (off_t) block_nb * (s->buffer_size - 4), SEEK_SET);
+
+        if (send_window(s) < 0)
+            return 1;
+
+        reset_timer(s);
+
+        return 0;
+    }
+
+    s->sent_len = 0;
+
+    if (handle_ack(s, buffer, n) == 0)
+        reset_timer(s);
+
+    return 0;
+}
+
+/* Retransmit to a multicast group whose master client stayed silent for a RTO
+ * Args:
+ *  - s: Session of the group
+ * Return:
+ *  - 0: Sent again, or another client is now the master
+ *  - 1: No client left, the session is over
+ *  */
+int mcast_timeout(struct session *s)
+{
+    struct mcast_group *g = s->group;
+    struct conn_info to;
+
+    // The master client is gone: the next one takes over
+    if (now_us() >= s->giveup) {
+        STAT_ADD(s->conn.stats, aborted, 1);
+        TRACE(TRACE_GIVEUP, s, s->last_block, 0);
+
+        if (mcast_remove(g, 0)) {
+            s->end = END_TIMEOUT;
+            return 1;
+        }
+
+        return 0;
+    }
+
+    TRACE(TRACE_TIMEOUT, s, s->last_block, s->rto);
+
+    // OACK not answered yet: to the master client only
+    if (s->sent_len > 0) {
+        to = s->conn;
+        to.sock = (struct sockaddr*) &g->members[0].addr;
+        to.addr_len = addr_size(&g->members[0].addr);
+
+        // The master client cannot be reached: the next one takes over
+        if (send_dgram(to, s->buffer, s->sent_len) < 0) {
+            if (mcast_remove(g, 0)) {
+                send_failed(s);
+                return 1;
+            }
+
+            return 0;
+        }
+
+        STAT_ADD(s->conn.stats, retransmits, 1);
+        TRACE(TRACE_RESEND, s, s->last_block, 1);
+    }
+    else if (retransmit(s) < 0) {
+        return 1;
+    }
+
+    backoff_timer(s);
+    STAT_ADD(s->conn.stats, timeouts, 1);
+
+    return 0;
+}
+
+/* Forget a multicast group whose session is freed
+ * Args:
+ *  - srv: Worker running the group
+ *  - s: Session of the group
+ *  */
+void mcast_close(struct server *srv, struct session *s)
+{
+    struct mcast_group **prev;
+
+    for (prev = &srv->groups; *prev != NULL && *prev != s->group; prev = &(*prev)->next);
+
+    if (*prev != NULL)
+        *prev = s->group->next;
+
+    free(s->group->members);
+    free(s->group);
+    s->group = NULL;
+}
+
+/* Read the multicast option of an OACK: "addr,port,mc" (addr and port may be empty after the first one)
+ * Args:
+ *  - s: Transfer of the client
+ *  - value: Value of the option
+ * Return:
+ *  - 0: Group and role known
+ *  - -1: Malformed value, or not a multicast group
+ *  */
+int mcast_option(struct session *s, char *value)
+{
+    struct sockaddr_in *group;
+    char *port, *mc;
+
+    if ((port = strchr(value, ',')) == NULL || (mc = strchr(port + 1, ',')) == NULL || (mc[1] != '0' && mc[1] != '1'))
+        return -1;
+
+    if (s->mcast == NULL) {
+        if ((s->mcast = malloc(sizeof(struct mcast_rx))) == NULL)
+            error("malloc");
+
+        bzero(s->mcast, sizeof(*s->mcast));
+        s->mcast->fd = -1;
+
+        group = (struct sockaddr_in*) &s->mcast->addr;
+        group->sin_family = AF_INET;
+        group->sin_port = htons(atoi(port + 1));
+
+        *port = '\0';
+        if (inet_pton(AF_INET, value, &group->sin_addr) != 1 || !IN_MULTICAST(ntohl(group->sin_addr.s_addr)) || group->sin_port == 0) {
+            free(s->mcast);
+            s->mcast = NULL;
+            return -1;
+        }
+        *port = ',';
+    }
+
+    s->mcast->master = mc[1] == '1';
+
+    return 0;
+}
+
+/* Join the group of a multicast transfer
+ * Args:
+ *  - m: Multicast transfer of the client
+ * Return:
+ *  - 0: Listening to the group
+ *  - -1: Cannot join it (reason printed)
+ *  */
+int mcast_listen(struct mcast_rx *m)
+{
+    struct ip_mreq mreq;
+    int enable = 1;
+
+    if ((m->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("socket(multicast)");
+        return -1;
+    }
+
+    // Several clients of this host may get the same group
+    bzero(&mreq, sizeof(mreq));
+    mreq.imr_multiaddr = ((struct sockaddr_in*) &m->addr)->sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if (setsockopt(m->fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0
+            || bind(m->fd, (struct sockaddr*) &m->addr, addr_size(&m->addr)) < 0
+            || setsockopt(m->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("Cannot join the multicast group");
+        close(m->fd);
+        m->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Handle a DATA of a multicast transfer, in any order: it is written at its place in the file
+ * Args:
+ *  - s: Transfer of the client
+ *  - buffer: Buffer with the DATA
+ *  - n: Size of the DATA
+ * Return:
+ *  - 0: DATA written, or the group is alive
+ *  - 1: Every block received, the server was told
+ *  - -1: DATA already received or out of the file (ignored)
+ *  - -2: Cannot write the DATA (ERROR already sent), or cannot send the ACK
+ *  */
+int mcast_data(struct session *s, char *buffer, int n)
+{
+    struct mcast_rx *m = s->mcast;
+    long long block_nb, blksize = s->buffer_size - 4;
+    long long contiguous = s->last_block; // Blocks received in order before this one
+
+    n -= 4;
+    block_nb = (unsigned char) buffer[2] * 256 + (unsigned char) buffer[3];
+    TRACE(TRACE_DATA, s, block_nb, n);
+
+    // From tsize, or from the last DATA (shorter than the others)
+    if (m->blocks == 0 && s->final_size >= 0)
+        m->blocks = s->final_size / blksize + 1;
+    else if (m->blocks == 0 && n < blksize)
+        m->blocks = block_nb;
+
+    if (block_nb == 0 || (m->blocks > 0 && block_nb > m->blocks) || n > blksize)
+        return -1;
+
+    if (m->master && s->rtt_sent != 0 && block_nb == s->rtt_block)
+        rtt_sample(s);
+
+    if (m->have[block_nb / 8] & (1 << (block_nb % 8))) {
+        // Sent again for another client: nothing to do unless we are the master client
+        if (!m->master)
+            return 0;
+    }
+    else {
+        if (pwrite(fileno(s->fd), buffer+4, n, (block_nb - 1) * blksize) != n) {
+            send_error(s->conn, 3, "Disk full");
+            return -2;
+        }
+
+        m->have[block_nb / 8] |= 1 << (block_nb % 8);
+        m->received++;
+        s->total_size += n;
+    }
+
+    while (s->last_block < MCAST_MAX_BLOCKS && (m->have[(s->last_block + 1) / 8] & (1 << ((s->last_block + 1) % 8))))
+        s->last_block++;
+
+    // The server removes us from the group
+    if (m->blocks > 0 && m->received == m->blocks) {
+        if (send_ack(s->conn, m->blocks) < 0) {
+            send_failed(s);
+            return -2;
+        }
+
+        s->last_ack = s->last_block;
+        return 1;
+    }
+
+    if (!m->master)
+        return 0;
+
+    // The master client ACKs as in unicast, from the first block it misses
+    if (block_nb != contiguous + 1) {
+        // A block number going backward starts a new burst (retransmission)
+        if (s->gap_block == 0 || block_nb <= s->gap_block) {
+            if (send_ack(s->conn, s->last_block) < 0) {
+                send_failed(s);
+                return -2;
+            }
+
+            s->last_ack = s->last_block;
+            s->rtt_sent = 0;
+        }
+
+        s->gap_block = block_nb;
+
+        return -1;
+    }
+
+    s->gap_block = 0;
+
+    if (s->last_block - s->last_ack >= s->windowsize) {
+        if (send_ack(s->conn, s->last_block) < 0) {
+            send_failed(s);
+            return -2;
+        }
+
+        s->last_ack = s->last_block;
+        rtt_arm(s, s->last_block + 1);
+    }
+
+    return 0;
+}
+
+/* Leave the group of a multicast transfer which is over
+ * Args:
+ *  - s: Transfer of the client
+ *  */
+void mcast_leave(struct session *s)
+{
+    // Closing the socket drops the membership, and removes it from epoll
+    if (s->mcast->fd >= 0)
+        close(s->mcast->fd);
+
+    free(s->mcast);
+    s->mcast = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef MULTICAST_H
+
+#define MULTICAST_H
+
+#include "network.h"
+
+#define DEFAULT_MCAST_PORT 1758 // Port of the first multicast group if -G does not give one
+#define MCAST_PORTS 256 // Ports given in turn to the groups, from the first one
+#define MCAST_TTL 1 // Hops the multicast DATA may go through (the local network)
+#define MCAST_MAX_BLOCKS 65535 // Block# are never wrapped in a multicast transfer (RFC2090)
+
+/* A client of a multicast transfer (server side) */
+struct mcast_member {
+    struct sockaddr_storage addr; // Its TID, where its OACK go and its ACK come from
+};
+
+/* File sent once to a multicast group, for every client asking it at the same time (server side) */
+struct mcast_group {
+    struct session *s; // Session sending the DATA, conn.sock points to addr
+    struct sockaddr_storage addr; // Group address and port the DATA are sent to
+    struct mcast_member *members; // Clients receiving the file, the master client first, then by arrival
+    int nb_members; // Number of clients
+    int max_members; // Size of members
+    int handoff; // Is the master client new: its first ACK tells where to send from
+    long long blocks; // Number of blocks of the file
+    struct stat file; // Identity of the file sent (see store_stat), a copy replaced since is another group
+    struct mcast_group *next; // Another group of the same worker
+};
+
+/* Multicast transfer joined by a client */
+struct mcast_rx {
+    int fd; // Socket joined to the group (-1 until joined)
+    struct sockaddr_storage addr; // Group address and port
+    int master; // Are we the master client: the server follows our ACKs
+    long long blocks; // Number of blocks of the file (0 until known)
+    long long received; // Number of distinct blocks received
+    unsigned char have[MCAST_MAX_BLOCKS / 8 + 1]; // Blocks received, by block#
+};
+
+extern unsigned long mcast_next_port; // Groups opened by all the workers, the next one takes the next port
+
+int mcast_add(struct mcast_group *g, struct sockaddr_storage *addr);
+int mcast_oack(struct mcast_group *g, struct session *s, struct sockaddr_storage *to, int master);
+int mcast_open(struct server *srv, struct session *s);
+int mcast_request(struct server *srv, struct session *s);
+void mcast_handoff(struct mcast_group *g);
+int mcast_remove(struct mcast_group *g, int i);
+int mcast_dgram(struct session *s, char *buffer, int n, struct sockaddr_storage *from);
+int mcast_timeout(struct session *s);
+void mcast_close(struct server *srv, struct session *s);
+int mcast_option(struct session *s, char *value);
+int mcast_listen(struct mcast_rx *m);
+int mcast_data(struct session *s, char *buffer, int n);
+void mcast_leave(struct session *s);
+
+#endif /* end of include guard: MULTICAST_H */
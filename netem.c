@@ -0,0 +1,170 @@
+#include "netem.h"
+
+struct netem *netem = NULL;
+
+/* Start a fake network and send every datagram of the process through it
+ * Args:
+ *  - ne: Fake network to initialize
+ *  - loss: Probability to drop a datagram (0 to 1)
+ *  - delay: Delay added to every datagram (us)
+ *  - seed: Seed of the losses, the same one drops the same datagrams
+ *  */
+void init_netem(struct netem *ne, double loss, long long delay, unsigned int seed)
+{
+    pthread_condattr_t attr;
+
+    bzero(ne, sizeof(*ne));
+    ne->loss = loss;
+    ne->delay = delay;
+    ne->seed = seed;
+
+    // Dates come from now_us()
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    if ((errno = pthread_mutex_init(&ne->lock, NULL)) != 0 || (errno = pthread_cond_init(&ne->cond, &attr)) != 0)
+        error("init_netem");
+
+    pthread_condattr_destroy(&attr);
+
+    if (delay > 0 && (errno = pthread_create(&ne->thread, NULL, netem_run, ne)) != 0)
+        error("pthread_create(netem)");
+
+    netem = ne;
+}
+
+/* Send a datagram through the fake network, instead of sendto()
+ * Args:
+ *  - fd: Socket sending it
+ *  - buffer: Datagram to send
+ *  - n: Size of the datagram
+ *  - addr: Destination
+ *  - addr_len: Size of the destination
+ * Return:
+ *  Same as sendto(): a datagram dropped or delayed counts as sent
+ *  */
+ssize_t netem_sendto(int fd, const void *buffer, size_t n, const struct sockaddr *addr, socklen_t addr_len)
+{
+    struct netem_dgram *d;
+
+    pthread_mutex_lock(&netem->lock);
+
+    if (netem->loss > 0 && rand_r(&netem->seed) < netem->loss * RAND_MAX) {
+        netem->dropped++;
+        pthread_mutex_unlock(&netem->lock);
+        return n;
+    }
+
+    if (netem->delay == 0) {
+        pthread_mutex_unlock(&netem->lock);
+        return sendto(fd, buffer, n, 0, addr, addr_len);
+    }
+
+    d = malloc(sizeof(struct netem_dgram) + n);
+    d->fd = fd;
+    memcpy(&d->addr, addr, addr_len);
+    d->addr_len = addr_len;
+    d->date = now_us() + netem->delay;
+    d->len = n;
+    d->next = NULL;
+    memcpy(d->data, buffer, n);
+
+    // Same delay for all: the queue stays sorted by date
+    if (netem->tail != NULL)
+        netem->tail->next = d;
+    else
+        netem->head = d;
+    netem->tail = d;
+
+    netem->delayed++;
+
+    pthread_cond_signal(&netem->cond);
+    pthread_mutex_unlock(&netem->lock);
+
+    return n;
+}
+
+/* Send messages through the fake network, instead of sendmmsg()
+ * A message split with UDP GSO goes through as the datagrams it holds.
+ * Args:
+ *  - fd: Socket sending them
+ *  - msgs: Messages to send
+ *  - vlen: Number of messages
+ * Return:
+ *  Same as sendmmsg()
+ *  */
+int netem_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen)
+{
+    char buffer[MAX_GSO_SIZE];
+    struct msghdr *msg;
+    struct cmsghdr *cm;
+    unsigned int i;
+    size_t k, len, seg, off;
+
+    for (i = 0; i < vlen; i++) {
+        msg = &msgs[i].msg_hdr;
+
+        for (k = 0, len = 0; k < msg->msg_iovlen; k++) {
+            memcpy(buffer + len, msg->msg_iov[k].iov_base, msg->msg_iov[k].iov_len);
+            len += msg->msg_iov[k].iov_len;
+        }
+
+        seg = len;
+
+        for (cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_SEGMENT)
+                seg = *((uint16_t*) CMSG_DATA(cm));
+        }
+
+        for (off = 0; off < len || off == 0; off += seg) {
+            if (netem_sendto(fd, buffer + off, len - off < seg ? len - off : seg, msg->msg_name, msg->msg_namelen) < 0)
+                return i > 0 ? (int) i : -1;
+
+            if (seg == 0)
+                break;
+        }
+
+        msgs[i].msg_len = len;
+    }
+
+    return vlen;
+}
+
+/* Thread sending the datagrams delayed, once their date is reached
+ * Args:
+ *  - arg: Fake network to run
+ *  */
+void *netem_run(void *arg)
+{
+    struct netem *ne = arg;
+    struct netem_dgram *d;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ne->lock);
+
+    while (1) {
+        if ((d = ne->head) == NULL) {
+            pthread_cond_wait(&ne->cond, &ne->lock);
+            continue;
+        }
+
+        if (d->date > now_us()) {
+            ts.tv_sec = d->date / USEC;
+            ts.tv_nsec = d->date % USEC * 1000;
+            pthread_cond_timedwait(&ne->cond, &ne->lock, &ts);
+            continue;
+        }
+
+        ne->head = d->next;
+        if (ne->head == NULL)
+            ne->tail = NULL;
+
+        // The socket may be closed meanwhile, like a datagram lost
+        pthread_mutex_unlock(&ne->lock);
+        sendto(d->fd, d->data, d->len, 0, (struct sockaddr*) &d->addr, d->addr_len);
+        free(d);
+        pthread_mutex_lock(&ne->lock);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef NETEM_H
+
+#define NETEM_H
+
+#include "network.h"
+
+#include <pthread.h>
+
+/* Datagram held by the fake network until it reaches the wire */
+struct netem_dgram {
+    int fd; // Socket sending it
+    struct sockaddr_storage addr; // Destination
+    socklen_t addr_len; // Size of the destination
+    long long date; // Date (us) at which it is really sent
+    int len; // Size of the datagram
+    struct netem_dgram *next; // Datagram sent after this one
+    char data[]; // Content of the datagram
+};
+
+/* Fake network between the sockets of the process, dropping and delaying datagrams */
+struct netem {
+    double loss; // Probability to drop a datagram (0 to 1)
+    long long delay; // Delay added to every datagram (us)
+    unsigned int seed; // State of the random generator, for reproducible losses
+    pthread_mutex_t lock; // Protects everything below
+    pthread_cond_t cond; // Signaled when a datagram is queued
+    struct netem_dgram *head; // Next datagram to send
+    struct netem_dgram *tail; // Last datagram queued
+    pthread_t thread; // Thread sending the datagrams delayed
+    unsigned long dropped; // Datagrams dropped
+    unsigned long delayed; // Datagrams delayed
+};
+
+extern struct netem *netem; // Fake network every datagram goes through (NULL for the real one)
+
+void init_netem(struct netem *ne, double loss, long long delay, unsigned int seed);
+ssize_t netem_sendto(int fd, const void *buffer, size_t n, const struct sockaddr *addr, socklen_t addr_len);
+int netem_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int vlen);
+void *netem_run(void *arg);
+
+#endif /* end of include guard: NETEM_H */
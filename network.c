@@ -1,40 +1,143 @@
 #include "network.h"
 
-/* Struct with all we need to send a datagram */
+/* Send a datagram to the peer of a connection
+ * Args:
+ *  - conn: Connections info to be able to send the datagram
+ *  - buffer: Datagram to send
+ *  - n: Size of the datagram
+ * Return:
+ *  Same as sendto()
+ *  */
+int send_dgram(struct conn_info conn, char *buffer, int n)
+{
+    int ret;
+
+    // The benchmark may put a fake network between the sockets
+    if (netem != NULL)
+        ret = netem_sendto(conn.fd, buffer, n, conn.sock, conn.addr_len);
+    else
+        ret = sendto(conn.fd, buffer, n, 0, conn.sock, conn.addr_len);
+    STAT_ADD(conn.stats, syscalls, 1);
+
+    if (ret >= 0) {
+        STAT_ADD(conn.stats, pkts_out, 1);
+        STAT_ADD(conn.stats, bytes_out, ret);
+    }
+    else {
+        STAT_ADD(conn.stats, send_errors, 1);
+    }
+
+    return ret;
+}
+
 /* Send an ERROR TFTP datagram
  * Args:
  *  - conn: Connections info to be able to send the ACK
  *  - err_code: Error code
  *  - err_msg: Error message
+ * Return:
+ *  0 if sent, -1 if the kernel refused it (e.g. to a bogus peer: nothing else to do but drop it)
  *  */
-void send_error(struct conn_info conn, int err_code, char *err_msg)
+int send_error(struct conn_info conn, int err_code, char *err_msg)
 {
-    char *buffer;
+    char buffer[DEFAULT_BLK_SIZE]; // Messages are short, truncated otherwise
     int n;
 
-    buffer = malloc((4 + strlen(err_msg) + 1) * sizeof(char));
+    STAT_ADD(conn.stats, errors[(unsigned) err_code < NB_ERROR_CODES ? err_code : 0], 1);
 
     buffer[0] = 0;
     buffer[1] = 5;
     buffer[2] = err_code / 256;
     buffer[3] = err_code % 256;
 
-    n = sprintf(buffer+4, "%s", err_msg);
+    n = snprintf(buffer+4, sizeof(buffer) - 4, "%s", err_msg);
+    if (n > (int) sizeof(buffer) - 5)
+        n = sizeof(buffer) - 5;
 
-    if(sendto(conn.fd, buffer, 4+n, 0, conn.sock, conn.addr_len) < 0) {
-        free(buffer);
-        error("send_error");
-    }
+    return send_dgram(conn, buffer, 4+n) < 0 ? -1 : 0;
+}
+
+/* Send an ERROR to the peer of a session, and keep it as the reason the session ends
+ * Args:
+ *  - s: Session to end
+ *  - err_code: Error code
+ *  - err_msg: Error message (kept as is, must outlive the session)
+ *  */
+void session_error(struct session *s, int err_code, char *err_msg)
+{
+    send_error(s->conn, err_code, err_msg);
+
+    s->end = END_ERROR_SENT;
+    s->end_code = err_code;
+    s->end_msg = err_msg;
+}
+
+/* End a session whose peer cannot be reached: the kernel refused a datagram to it
+ * Args:
+ *  - s: Session to end
+ * Return:
+ *  -1
+ *  */
+int send_failed(struct session *s)
+{
+    s->end = END_SEND_FAILED;
+
+    return -1;
+}
+
+/* Get the block# put on the wire for a block: it has only 16 bits, so after
+ * 65535 it goes back to 0 or 1 (rollover)
+ * Args:
+ *  - block: Number of the block since the beginning of the transfer
+ *  - rollover: Block# following 65535 (0 or 1)
+ * Return:
+ *  Block# of the datagram
+ *  */
+int block_wire(long long block, int rollover)
+{
+    if (rollover == 1 && block > 0)
+        return (block - 1) % 65535 + 1;
+
+    return block % 65536;
+}
+
+/* Get the number of a block since the beginning of the transfer from its block#,
+ * as the closest one to where the transfer is
+ * Args:
+ *  - wire: Block# received
+ *  - ref: Number of the block expected
+ *  - rollover: Block# following 65535 (0 or 1)
+ * Return:
+ *  Number of the block (not wrapped)
+ *  */
+long long block_unwrap(int wire, long long ref, int rollover)
+{
+    int period, d;
+
+    // Nothing wrapped yet, and block# 0 only exists before the first wrap with rollover 1
+    if (ref <= 0 || (rollover == 1 && wire == 0))
+        return wire;
+
+    period = rollover == 1 ? 65535 : 65536;
+
+    d = (wire - block_wire(ref, rollover)) % period;
+
+    if (d < 0)
+        d += period;
+    if (d >= period / 2)
+        d -= period;
 
-    free(buffer);
+    return ref + d;
 }
 
 /* Send a ACK (ACKnowledgement) TFTP datagram
  * Args:
  *  - conn: Connections info to be able to send the ACK
- *  - block_nb: Block# being acknowledged
+ *  - block_nb: Block# being acknowledged (as on the wire)
+ * Return:
+ *  0 if sent, -1 if the kernel refused it
  *  */
-void send_ack(struct conn_info conn, int block_nb)
+int send_ack(struct conn_info conn, int block_nb)
 {
     char buffer[4];
 
@@ -43,260 +146,431 @@ void send_ack(struct conn_info conn, int block_nb)
     buffer[2] = block_nb / 256;
     buffer[3] = block_nb % 256;
 
-    if(sendto(conn.fd, buffer, 4, 0, conn.sock, conn.addr_len) < 0)
-        error("send_ack");
+    return send_dgram(conn, buffer, 4) < 0 ? -1 : 0;
 }
 
 /* Handle DATA datagram (either client or server)
+ * In-order blocks are written and acknowledged at the end of each window
+ * (RFC7440). On a gap or a duplicate, the last in-order block is acknowledged
+ * once per burst from the sender, so that it goes back to it.
  * Args:
- *  - conn: Connections info to be able to send back ACK/ERROR
+ *  - s: Transfer the DATA belongs to
  *  - buffer: Buffer with the data received
  *  - n: Number of bytes in the buffer
- *  - last_block: Value pointed to is the block# from the last OK DATA
- *  - total_size: Value pointed to is the incremental size we got in this transaction
- *  - fd_dst: file descriptor to the file in which we write the data
+ *  - st: Storage the upload is committed to before its last ACK (server only, NULL on the client)
+ * Return:
+ *  - 0: DATA written
+ *  - 1: Last DATA written (and committed) and acknowledged
+ *  - 2: Last DATA written, acknowledged once the writer threads put the upload in place (see end_commit())
+ *  - -1: DATA out of order (ignored)
+ *  - -2: Cannot write the DATA (ERROR already sent), or cannot send the ACK (the session is over)
  *  */
-int handle_data(struct conn_info conn, char* buffer, int n, int *last_block, int *total_size, FILE *fd_dst)
+int handle_data(struct session *s, char* buffer, int n, struct storage *st)
 {
-    int block_nb; // Current block#
+    long long block_nb; // Current block (not wrapped)
 
     // Minus opcode and block number
     n -= 4;
 
-    block_nb = (unsigned char) buffer[2] * 256 + (unsigned char) buffer[3];
+    block_nb = block_unwrap((unsigned char) buffer[2] * 256 + (unsigned char) buffer[3], s->last_block + 1, s->rollover);
+    TRACE(TRACE_DATA, s, block_nb, n);
+
+    // First DATA of the window asked by our last ACK
+    if (s->rtt_sent != 0 && block_nb == s->rtt_block)
+        rtt_sample(s);
+
+    if (block_nb != s->last_block + 1) {
+        // A block number going backward starts a new burst (retransmission)
+        if (s->gap_block == 0 || block_nb <= s->gap_block) {
+            if (send_ack(s->conn, block_wire(s->last_block, s->rollover)) < 0) {
+                send_failed(s);
+                return -2;
+            }
+
+            s->last_ack = s->last_block;
+            s->rtt_sent = 0;
+        }
+
+        s->gap_block = block_nb;
 
-    if (block_nb != *last_block + 1)
         return -1;
+    }
+
+    s->last_block++;
+    s->gap_block = 0;
+
+    // Server: queued to the writer threads (the ACK does not wait on the disk), or kept in memory
+    if ((s->wfile != NULL || s->blob != NULL) && store_write(s, buffer+4, n, s->total_size) < 0) {
+        session_error(s, 3, "Disk full");
+        return -2;
+    }
+
+    // Segments of the same file write at their own place
+    if (s->ranged && pwrite(fileno(s->fd), buffer+4, n, s->range_start + s->total_size) != n) {
+        session_error(s, 3, "Disk full");
+        return -2;
+    }
 
-    (*last_block)++;
+    if (s->wfile == NULL && s->blob == NULL && !s->ranged && (int) fwrite(buffer+4, sizeof(char), n, s->fd) != n) {
+        session_error(s, 3, "Disk full");
+        return -2;
+    }
+
+    s->total_size += n;
+
+    // Last DATA is shorter than the block size
+    if (n < s->buffer_size - 4) {
+        // Acknowledged once in place: a client told the upload is done can rely on it
+        switch (st != NULL ? store_commit(st, s) : 0) {
+            case 1:
+                s->committing = 1;
+                return 2;
+            case -1:
+                session_error(s, 3, "Disk full");
+                return -2;
+        }
+
+        if (send_ack(s->conn, block_wire(s->last_block, s->rollover)) < 0) {
+            send_failed(s);
+            return -2;
+        }
 
-    if ((int) fwrite(buffer+4, sizeof(char), n, fd_dst) != n) {
-        send_error(conn, 3, "Disk full");
-        error("Cannot write/disk full");
+        s->last_ack = s->last_block;
+        return 1;
     }
 
-    *total_size += n;
+    if (s->last_block - s->last_ack >= s->windowsize) {
+        if (send_ack(s->conn, block_wire(s->last_block, s->rollover)) < 0) {
+            send_failed(s);
+            return -2;
+        }
 
-    send_ack(conn, block_nb);
+        s->last_ack = s->last_block;
+        rtt_arm(s, s->last_block + 1);
+    }
 
     return 0;
 }
 
-/* Check if ACK we received is for the last DATA sent (ignore otherwise)
+/* Acknowledge the last DATA of an upload, put in place by the writer threads
+ * Args:
+ *  - s: Session whose upload was committed (see handle_data())
+ *  - err: errno of the write, flush or rename which failed (0 if none)
+ * Return:
+ *  - 1: Upload in place and acknowledged
+ *  - -2: Cannot write it (ERROR sent), or cannot send the ACK
+ *  */
+int end_commit(struct session *s, int err)
+{
+    s->committing = 0;
+
+    if (err != 0) {
+        fprintf(stderr, "Cannot write '%s': %s\n", s->filename, strerror(err));
+        session_error(s, 3, "Disk full");
+        return -2;
+    }
+
+    if (send_ack(s->conn, block_wire(s->last_block, s->rollover)) < 0) {
+        send_failed(s);
+        return -2;
+    }
+
+    s->last_ack = s->last_block;
+    s->end = END_DONE;
+
+    return 1;
+}
+
+/* Handle ACK datagram: move the window forward and send the next one
  * Args:
+ *  - s: Transfer the ACK belongs to
  *  - buffer: Buffer with the data received
- *  - buffer_size: Buffer size
- *  - last_block: Number of last block sent (should get it's number here)
+ *  - n: Number of bytes in the buffer
  * Return:
- *  - 0: Got the ACK for the last DATA sent
- *  - -1: Got an ACK for another DATA
+ *  - 0: Got the ACK for DATA sent, the next window is sent
+ *  - 1: Got the ACK for the last DATA, the transfer is over
+ *  - -1: Got an ACK for another DATA (ignored)
+ *  - -2: Malformed ACK
+ *  - -3: Cannot send the next window (the session is over)
  * */
-int handle_ack(char *buffer, int buffer_size, int last_block)
+int handle_ack(struct session *s, char *buffer, int n)
 {
-    int block_nb = 0;
+    long long block_nb = 0; // Block acknowledged (not wrapped)
+
+    if (n != 4)
+        return -2;
 
-    if (buffer_size != 4)
-        error("Wrong ACK received");
+    // Closest to the middle of the blocks waiting for an ACK
+    block_nb = block_unwrap((unsigned char) buffer[2] * 256 + (unsigned char) buffer[3], (s->last_ack + s->last_block + 1) / 2, s->rollover);
+    TRACE(TRACE_ACK, s, block_nb, 0);
 
-    block_nb = (unsigned char) buffer[2] * 256 + (unsigned char) buffer[3];
+    // ACK of the request or of the OACK: start the transfer
+    if (block_nb == 0 && s->last_block == 0) {
+        if (s->rtt_sent != 0)
+            rtt_sample(s);
+
+        return send_window(s) < 0 ? -3 : 0;
+    }
 
-    if (block_nb != last_block)
+    // Only move forward on an ACK for a block sent and not acknowledged yet
+    if (block_nb <= s->last_ack || block_nb > s->last_block)
         return -1;
 
-    return 0;
+    if (s->rtt_sent != 0 && block_nb >= s->rtt_block)
+        rtt_sample(s);
+
+    s->last_ack = block_nb;
+
+    if (s->wait_last_ack && s->last_ack == s->last_block)
+        return 1;
+
+    return send_window(s) < 0 ? -3 : 0;
 }
 
+/* Build the next DATA datagram
+ * Args:
+ *  - s: Transfer to build the DATA for
+ *  - buffer: Where to build the datagram (at least buffer_size bytes)
+ * Return:
+ *  Size of the datagram (last chunk if smaller than buffer_size)
+ * */
+int fill_data(struct session *s, char *buffer)
+{
+    int n;
+
+    // Opcode for DATA
+    buffer[0] = 0;
+    buffer[1] = 3;
+
+    s->last_block++;
 
-/* Check if ACK we received is for the last DATA sent (ignore otherwise)
+    buffer[2] = block_wire(s->last_block, s->rollover) / 256;
+    buffer[3] = block_wire(s->last_block, s->rollover) % 256;
+
+    n = s->buffer_size - 4;
+
+    // The range asked ends before the end of the file
+    if (s->range_len > 0 && (s->last_block - 1) * n + n > s->range_len)
+        n = s->range_len > (s->last_block - 1) * n ? s->range_len - (s->last_block - 1) * n : 0;
+
+    n = fread(buffer+4, sizeof(char), n, s->fd);
+
+    return 4+n;
+}
+
+/* Add the next DATA datagram to a batch, its payload pointing into the mapped file
+ * (or the whole datagram pointing into the pre-built ones)
  * Args:
- *  - conn: Connections info to be able to send back ACK/ERROR
- *  - buffer: Buffer filled with data sent
- *  - buffer_size: Maximum buffer size
- *  - last_block: Set the number of current data
- *  - fd: FD of source file
+ *  - s: Transfer to build the DATA for (with a mapped file)
+ *  - b: Batch the DATA is added to
  * Return:
- *  - 0: There are still other chunks to send
- *  - 1: Last chunk
+ *  Size of the datagram (last chunk if smaller than buffer_size)
  * */
-int send_data(struct conn_info conn, char **buffer, int buffer_size, int *last_block, FILE *fd)
+int map_data(struct session *s, struct dgram_batch *b)
 {
+    char *buffer;
+    size_t offset, end;
     int n;
 
-    bzero(*buffer, buffer_size);
+    // Same block, same place in the file: a retransmission costs nothing more
+    offset = s->range_start + (size_t) s->last_block * (s->buffer_size - 4);
+
+    end = s->map_size;
+    if (s->range_len > 0 && (size_t) (s->range_start + s->range_len) < end)
+        end = s->range_start + s->range_len;
+
+    n = 0;
+    if (offset < end)
+        n = end - offset < (size_t) s->buffer_size - 4 ? (int) (end - offset) : s->buffer_size - 4;
+
+    // Nothing to build at all when the whole datagram is ready
+    if (s->dgrams != NULL) {
+        batch_push_ref(b, 0, s->dgrams + (size_t) s->last_block * s->buffer_size, 4+n);
+        s->last_block++;
+
+        return 4+n;
+    }
+
+    buffer = batch_next(b);
 
     // Opcode for DATA
-    (*buffer)[0] = 0;
-    (*buffer)[1] = 3;
+    buffer[0] = 0;
+    buffer[1] = 3;
 
-    (*last_block)++;
+    s->last_block++;
 
-    (*buffer)[2] = *last_block / 256;
-    (*buffer)[3] = *last_block % 256;
+    buffer[2] = block_wire(s->last_block, s->rollover) / 256;
+    buffer[3] = block_wire(s->last_block, s->rollover) % 256;
 
-    n = fread(*buffer+4, sizeof(char), buffer_size-4, fd);
+    batch_push_ref(b, 4, s->map + offset, n);
 
-    if(sendto(conn.fd, *buffer, 4+n, 0, conn.sock, conn.addr_len) < 0)
-        error("send_ack");
+    return 4+n;
+}
 
-    if ( n < buffer_size - 4)
-        return 1;
+/* Map the file of a transfer in memory, so its DATA are sent without copying it
+ * The file is read through fd instead if it cannot be mapped (or is empty).
+ * Args:
+ *  - s: Transfer to map the file of
+ * */
+void map_file(struct session *s)
+{
+    struct stat st;
+    void *map;
 
-    return 0;
+    if (fstat(fileno(s->fd), &st) < 0 || st.st_size == 0)
+        return;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(s->fd), 0);
+
+    if (map == MAP_FAILED)
+        return;
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    s->map = map;
+    s->map_size = st.st_size;
 }
 
-/* Loop in which we handle all data received for our request
+/* Ask the disk for the next windows of a file before they are sent
+ * The kernel reads them in the background, they are in the page cache when the ACKs come.
  * Args:
- *  - conn: Connections info to be able to send back ACK/ERROR
- *  - type: Type of initial request (RRQ/WRQ)
- *  - retry: Number of retries on errors
- *  - buffer: Buffer with the data received
- *  - buffer_size: Maximum buffer size
- *  - filename: File we work on
- *  */
-int get_data(struct conn_info conn, enum request_code type, const int oretry, char **buffer, int buffer_size, char *filename)
+ *  - s: Transfer sending a file from the disk (not cached)
+ * */
+void prefetch(struct session *s)
 {
-    int end = 0; // Flag wether or not we can continue the loop
-    int last_block = 0; // Block# of the last OK DATA
-    int total_size = 0; // Incremental size of the file we got so far
-    int final_size = -1; // Total size of the file we're supposed to get
-    int n; // Size of the last datagram we got
-    int got_one = 0 ; // Do we get at least one reply
-    int wait_last_ack = 0 ; // Do we just wait for the last ACK (no more DATA to send)
-    int retry = oretry ;
-    FILE *fd_dst;
-
-    char fmode[3] = ".b"; // Mode to open the file
-
-    switch (type) {
-        case RRQ:
-            fmode[0] = 'a';
-            break;
-
-        case WRQ:
-            fmode[0] = 'r';
-            break;
-
-        default:
-            error("Mode don't exist");
-            break;
-    }
+    long long pos, end;
 
-    errno = 0;
+    if (s->readahead == 0 || s->fd == NULL)
+        return;
 
-    bzero(*buffer, buffer_size);
-    while ((n = recvfrom(conn.fd, *buffer, buffer_size, 0, conn.sock, (socklen_t *) &(conn.addr_len)))) {
-        // On receive fail
-        if (n < 0) {
-            retry--;
+    pos = s->range_start + s->last_block * (s->buffer_size - 4);
+    end = pos + s->readahead;
 
-            // If we did all retries, break the main loop
-            if (retry <= 0)
-                break;
+    // Asked by halves of the depth: one syscall every few windows
+    if (s->prefetched - pos >= s->readahead / 2)
+        return;
 
-            continue;
-        }
+    if (s->prefetched > pos)
+        pos = s->prefetched;
 
-        // Reset retry for next failed receive
-        retry = oretry;
+    posix_fadvise(fileno(s->fd), pos, end - pos, POSIX_FADV_WILLNEED);
+    s->prefetched = end;
+}
 
-        if (got_one == 0) {
-            // Remove file before trying to write to it if download
-            if (type == RRQ)
-                unlink (filename);
+/* Send a window of DATA datagrams, starting after the last block acknowledged
+ * The window goes out in batches of s->batch->max datagrams per syscall.
+ * Args:
+ *  - s: Transfer to send the window for
+ * Return:
+ *  - 0: There are still other windows to send
+ *  - 1: Last DATA sent
+ *  - -1: The peer cannot be reached (the session is over)
+ * */
+int send_window(struct session *s)
+{
+    int k, n;
+    int resend = 0; // Does the window start with blocks already sent
+    long long bytes = 0; // Size of the datagrams of the window
+
+    // Over the rate limits of the transfer or of its client's subnet: sent once paid back
+    if (s->client != NULL && s->group == NULL && pace_window(s))
+        return s->wait_last_ack;
+
+    // Go back to the first block not acknowledged (gap or timeout)
+    if (s->last_block != s->last_ack) {
+        if (s->map == NULL)
+            fseeko(s->fd, s->range_start + (off_t) s->last_ack * (s->buffer_size - 4), SEEK_SET);
+        s->last_block = s->last_ack;
+        s->wait_last_ack = 0;
+        resend = 1;
+        STAT_ADD(s->conn.stats, retransmits, 1);
+        TRACE(TRACE_RESEND, s, s->last_ack + 1, 0);
+    }
 
-            if ((fd_dst = fopen (filename, fmode)) == NULL)
-                error("Cannot open result file");
+    prefetch(s);
 
-            got_one = 1;
-        }
+    for (k = 0; k < s->windowsize && !s->wait_last_ack; k++) {
+        if (s->batch->nb == s->batch->max && flush_batch(s->conn, s->batch) < 0)
+            return send_failed(s);
 
-        if ((*buffer)[0] == 0) {
-            switch ((*buffer)[1]) {
-                case 3:
-                    // DATA
-                    if (type == WRQ) {
-                        send_error(conn, 4, "Illegal TFTP operation");
-                        end = 1;
-                        break;
-                    }
-
-                    if (handle_data(conn, *buffer, n, &last_block, &total_size, fd_dst) == 0 &&
-                            n < buffer_size - 4) {
-                        end = 1;
-                        break;
-                    }
-                    break;
-                case 4:
-                    // ACK
-                    if (type == RRQ) {
-                        send_error(conn, 4, "Illegal TFTP operation");
-                        end = 1;
-                        break;
-                    }
-
-                    if (handle_ack(*buffer, n, last_block) == 0) {
-                        if (wait_last_ack != 1) {
-                            wait_last_ack = send_data(conn, buffer, buffer_size, &last_block, fd_dst);
-                        }
-                        else {
-                            end = 1;
-                        }
-                    }
-
-                    break;
-                case 5:
-                    // ERROR
-                    end = 1;
-                    break;
-                case 6:
-                    // OACK (Option ACK)
-                    handle_oack_c(conn, buffer, &buffer_size, n, &final_size, filename);
-
-                    if (type == RRQ) {
-                        send_ack(conn, 0);
-                    }
-                    else if (type == WRQ) {
-                        wait_last_ack = send_data(conn, buffer, buffer_size, &last_block, fd_dst);
-                    }
-                    break;
-                default:
-                    // Anything else is an error (RRQ/WRQ or non specified)
-                    send_error(conn, 4, "Illegal TFTP operation");
-                    end = 1;
-                    break;
-            }
+        if (s->map != NULL) {
+            n = map_data(s, s->batch);
         }
         else {
-            send_error(conn, 4, "Illegal TFTP operation");
-            end = 1;
+            n = fill_data(s, batch_next(s->batch));
+            batch_push(s->batch, n);
         }
 
-        bzero(*buffer, buffer_size);
-
-        if (end == 1)
-            break;
+        s->wait_last_ack = n < s->buffer_size;
+        bytes += n;
     }
 
-    // If we didn't get any answer from server
-    if (got_one == 0)
-        return -1;
+    if (flush_batch(s->conn, s->batch) < 0)
+        return send_failed(s);
 
-    fclose(fd_dst);
+    if (s->client != NULL && s->group == NULL)
+        pace_charge(s, bytes);
 
+    TRACE(TRACE_SEND, s, s->last_block - k + 1, k);
 
-    if (type == RRQ && final_size != -1 && final_size != total_size) {
-        fprintf(stderr, "Final size of '%s' is wrong. Got %dB instead of %dB\n", filename, total_size, final_size);
-        return -1;
+    // Time the ACK of the window, only if none of its blocks was sent before (Karn)
+    if (resend)
+        s->rtt_sent = 0;
+    else
+        rtt_arm(s, s->last_block);
+
+    return s->wait_last_ack;
+}
+
+/* Send again what the peer should have answered to, after a timeout
+ * Args:
+ *  - s: Transfer which timed out
+ * Return:
+ *  0 if sent, -1 if the peer cannot be reached (the session is over)
+ * */
+int retransmit(struct session *s)
+{
+    // Sender: send the window again from the last block acknowledged
+    if (s->sending && s->last_block > 0) {
+        return send_window(s) < 0 ? -1 : 0;
+    }
+    else if (s->sent_len > 0) {
+        if (send_dgram(s->conn, s->buffer, s->sent_len) < 0)
+            return send_failed(s);
+
+        STAT_ADD(s->conn.stats, retransmits, 1);
+        TRACE(TRACE_RESEND, s, s->last_block, 1);
+    }
+    else {
+        STAT_ADD(s->conn.stats, retransmits, 1);
+        TRACE(TRACE_RESEND, s, s->last_block, 2);
+
+        if (send_ack(s->conn, block_wire(s->last_block, s->rollover)) < 0)
+            return send_failed(s);
+
+        s->last_ack = s->last_block;
+        s->gap_block = 0;
     }
 
     return 0;
 }
 
-/* Free the content of a struct conn_info
+/* Let the socket of a receiver queue a whole window, so that big blocks are not dropped
  * Args:
- *  - conn: The struct to free
- *  */
-void free_conn(struct conn_info conn)
+ *  - s: Transfer receiving the DATA
+ *  - fd: Socket the DATA come to (TID or multicast group)
+ * */
+void size_rcvbuf(struct session *s, int fd)
 {
-    if (conn.free != NULL) free(conn.free);
+    int size;
+
+    // The kernel accounts for more than the payload of each datagram
+    size = s->windowsize * s->buffer_size * 2;
+
+    if (size < s->windowsize || size > MAX_RCVBUF)
+        size = MAX_RCVBUF;
+
+    // Beyond net.core.rmem_max, only allowed with CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
 }
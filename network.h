@@ -3,32 +3,83 @@
 #define NETWORK_H
 
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 #include "structs.h"
 #include "utils.h"
+#include "network_batch.h"
+#include "network_timer.h"
+#include "netem.h"
+#include "trace.h"
+#include "pool.h"
+#include "codec.h"
+#include "cache.h"
+#include "writer.h"
+#include "storage.h"
+#include "rewrite.h"
+#include "admission.h"
 #include "network_client.h"
 #include "network_server.h"
+#include "access_log.h"
+#include "server.h"
+#include "multicast.h"
+#include "metrics.h"
+#include "transfers.h"
 
 #define DEFAULT_SERVER_PORT 69   // Server port defined in RFC1350
 #define DEFAULT_BLK_SIZE 516 // Default value defined in RFC1350 is 512 of payload + 4 of headers
 #define DEFAULT_TIMEOUT 1 // Default timeout is 1 second
+#define DEFAULT_WINDOWSIZE 1 // Default value defined in RFC7440 (lock-step)
+#define MAX_WINDOWSIZE 65535 // Maximum windowsize allowed by RFC7440
+
+#define MIN_BLK_SIZE 8 // Minimum block size allowed by RFC2348
+#define MAX_BLK_SIZE 65464 // Maximum block size allowed by RFC2348
 
 #define PREF_BLK_SIZE 1468 // Maximum block size possible:
                       // Ethernet MTU (1500) - UDP headers (8) - IP (20)
+#define PREF_BLK_SIZE6 1448 // Same over IPv6, whose header is 40 bytes
+#define PREF_WINDOWSIZE 16 // Windowsize going to be negociated
+#define PREF_MAX_WINDOWSIZE 64 // Largest windowsize accepted by default by the server
+
+#define DEFAULT_ROLLOVER 0 // Block# following 65535, like most implementations
+
+#define DEFAULT_BATCH 32 // Datagrams sent/received per syscall
+#define MAX_BATCH 1024 // Maximum number of datagrams per syscall (UIO_MAXIOV)
 
 #define HOST_LEN 128  // Maximum length of a hostname
-#define PORT_MIN 10000 // Minimum port used as TID (source)
-#define PORT_MAX 50000 // Maximum port used as TID (source)
 
 #define DEFAULT_RETRY 3 // Number of retries on errors
+#define RANGE_DONE_MSG "Range received" // ERROR (code 0) of a segment stopping at the end of its range, not a failure
+#define MAX_RCVBUF (64 * 1024 * 1024) // Largest receive buffer asked for a window
+
+/* Update a counter read concurrently by other threads, without any lock */
+#define STAT_ADD(stats, field, v) \
+    do { \
+        if ((stats) != NULL) \
+            __atomic_store_n(&(stats)->field, (stats)->field + (v), __ATOMIC_RELAXED); \
+    } while (0)
+
+#define STAT_GET(stats, field) __atomic_load_n(&(stats)->field, __ATOMIC_RELAXED)
 
-void send_error(struct conn_info conn, int err_code, char *err_msg);
-void send_ack(struct conn_info conn, int block_nb);
-int send_data(struct conn_info conn, char** buffer, int buffer_size, int* last_block, FILE* fd);
-int handle_data(struct conn_info conn, char* buffer, int n, int *last_block, int *total_size, FILE *fd_dst);
-int handle_ack(char* buffer, int buffer_size, int last_block);
-int get_data(struct conn_info conn, enum request_code type, const int retry, char **buffer, int buffer_size, char *filename);
-void free_conn(struct conn_info conn);
+int send_dgram(struct conn_info conn, char *buffer, int n);
+int send_error(struct conn_info conn, int err_code, char *err_msg);
+void session_error(struct session *s, int err_code, char *err_msg);
+int send_failed(struct session *s);
+int block_wire(long long block, int rollover);
+long long block_unwrap(int wire, long long ref, int rollover);
+int send_ack(struct conn_info conn, int block_nb);
+int handle_data(struct session *s, char* buffer, int n, struct storage *st);
+int end_commit(struct session *s, int err);
+int handle_ack(struct session *s, char* buffer, int n);
+int fill_data(struct session *s, char *buffer);
+int map_data(struct session *s, struct dgram_batch *b);
+void map_file(struct session *s);
+void prefetch(struct session *s);
+int send_window(struct session *s);
+int retransmit(struct session *s);
+void size_rcvbuf(struct session *s, int fd);
 
 #endif /* end of include guard: NETWORK_H */
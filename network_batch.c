@@ -0,0 +1,236 @@
+#include "network_batch.h"
+
+/* Allocate a batch of datagrams
+ * Args:
+ *  - b: Batch to initialize
+ *  - max: Maximum number of datagrams sent or received per syscall
+ *  */
+void init_batch(struct dgram_batch *b, int max)
+{
+    bzero(b, sizeof(*b));
+
+    b->max = max;
+    b->gso = 1;
+
+    b->msgs = calloc(max, sizeof(struct mmsghdr));
+    b->lens = calloc(max, sizeof(int));
+    b->first_iov = calloc(max + 1, sizeof(int));
+
+    // A datagram to send may be a header and a payload referenced in place
+    b->iovs = calloc(2 * max, sizeof(struct iovec));
+    b->addrs = calloc(max, sizeof(struct sockaddr_storage));
+    b->cmsgs = calloc(max, CMSG_SPACE(sizeof(uint16_t)));
+
+    // Only the pages actually used get backed by memory
+    b->data = malloc(max * BATCH_SLOT_SIZE * sizeof(char));
+
+    if (b->msgs == NULL || b->lens == NULL || b->first_iov == NULL || b->iovs == NULL || b->addrs == NULL || b->cmsgs == NULL || b->data == NULL)
+        error("init_batch");
+}
+
+/* Free the content of a batch
+ * Args:
+ *  - b: Batch to free
+ *  */
+void free_batch(struct dgram_batch *b)
+{
+    free(b->msgs);
+    free(b->lens);
+    free(b->first_iov);
+    free(b->iovs);
+    free(b->addrs);
+    free(b->cmsgs);
+    free(b->data);
+}
+
+/* Get where to build the next datagram to send
+ * Args:
+ *  - b: Batch the datagram is added to (must not be full)
+ * Return:
+ *  Buffer of at least BATCH_SLOT_SIZE bytes
+ *  */
+char *batch_next(struct dgram_batch *b)
+{
+    return b->data + b->used;
+}
+
+/* Add the datagram built in batch_next() to the batch
+ * Args:
+ *  - b: Batch to update
+ *  - n: Size of the datagram
+ *  */
+void batch_push(struct dgram_batch *b, int n)
+{
+    batch_push_ref(b, n, NULL, 0);
+}
+
+/* Add the header built in batch_next() to the batch, followed by a payload
+ * which is referenced and not copied: it must stay valid until the batch is sent
+ * Args:
+ *  - b: Batch to update
+ *  - header_len: Size of the header (0 if the payload is the whole datagram)
+ *  - payload: Payload of the datagram
+ *  - payload_len: Size of the payload (0 for none)
+ *  */
+void batch_push_ref(struct dgram_batch *b, int header_len, char *payload, int payload_len)
+{
+    b->first_iov[b->nb] = b->nb_iovs;
+    b->lens[b->nb] = header_len + payload_len;
+
+    if (header_len > 0) {
+        b->iovs[b->nb_iovs].iov_base = b->data + b->used;
+        b->iovs[b->nb_iovs].iov_len = header_len;
+        b->nb_iovs++;
+    }
+
+    if (payload_len > 0) {
+        b->iovs[b->nb_iovs].iov_base = payload;
+        b->iovs[b->nb_iovs].iov_len = payload_len;
+        b->nb_iovs++;
+    }
+
+    b->used += header_len;
+    b->nb++;
+    b->first_iov[b->nb] = b->nb_iovs;
+    b->rx_ready = 0;
+}
+
+/* Send all the datagrams of a batch to the peer of a connection, with one syscall
+ * Consecutive datagrams of the same size (the last one may be shorter) are
+ * given to the kernel as one message split with UDP GSO, when it supports it.
+ * Args:
+ *  - conn: Connections info to be able to send the datagrams
+ *  - b: Batch to send, empty on return
+ * Return:
+ *  - Number of datagrams sent
+ *  - -1: sendmmsg() failed (the datagrams are dropped)
+ *  */
+int flush_batch(struct conn_info conn, struct dgram_batch *b)
+{
+    struct msghdr *msg;
+    struct cmsghdr *cm;
+    int i, k, nb_msgs, seg, len, sent, ret;
+
+    if (b->nb == 0)
+        return 0;
+
+    for (i = 0, nb_msgs = 0; i < b->nb; i += k, nb_msgs++) {
+        seg = b->lens[i];
+        len = seg;
+
+        // Every segment but the last one must be exactly seg bytes
+        for (k = 1; b->gso && i + k < b->nb && k < MAX_GSO_SEGMENTS; k++) {
+            if (b->lens[i+k-1] != seg || b->lens[i+k] > seg || len + b->lens[i+k] > MAX_GSO_SIZE)
+                break;
+
+            len += b->lens[i+k];
+        }
+
+        // Every field set, no need to clear the header first
+        msg = &b->msgs[nb_msgs].msg_hdr;
+        msg->msg_name = conn.sock;
+        msg->msg_namelen = conn.addr_len;
+        msg->msg_iov = &b->iovs[b->first_iov[i]];
+        msg->msg_iovlen = b->first_iov[i+k] - b->first_iov[i];
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+        msg->msg_flags = 0;
+
+        if (k > 1) {
+            msg->msg_control = b->cmsgs + nb_msgs * CMSG_SPACE(sizeof(uint16_t));
+            msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+            cm = CMSG_FIRSTHDR(msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *((uint16_t*) CMSG_DATA(cm)) = seg;
+        }
+    }
+
+    for (sent = 0; sent < nb_msgs; sent += ret) {
+        if (netem != NULL)
+            ret = netem_sendmmsg(conn.fd, b->msgs + sent, nb_msgs - sent);
+        else
+            ret = sendmmsg(conn.fd, b->msgs + sent, nb_msgs - sent, 0);
+        STAT_ADD(conn.stats, syscalls, 1);
+
+        if (ret < 0) {
+            // No GSO for this kernel or route, send the datagrams one by one from now on
+            if (b->gso && sent == 0 && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+                b->gso = 0;
+
+                // Refused one by one too: the peer was the cause, not GSO
+                if ((ret = flush_batch(conn, b)) < 0)
+                    b->gso = 1;
+
+                return ret;
+            }
+
+            // The batch is shared by the sessions: what was not sent is dropped, not sent to the next peer
+            STAT_ADD(conn.stats, send_errors, 1);
+            b->nb = 0;
+            b->nb_iovs = 0;
+            b->used = 0;
+
+            return -1;
+        }
+    }
+
+    STAT_ADD(conn.stats, pkts_out, b->nb);
+
+    for (i = 0; i < b->nb; i++)
+        STAT_ADD(conn.stats, bytes_out, b->lens[i]);
+
+    ret = b->nb;
+    b->nb = 0;
+    b->nb_iovs = 0;
+    b->used = 0;
+
+    return ret;
+}
+
+/* Receive as many datagrams as available (up to the batch size), with one syscall
+ * Args:
+ *  - fd: Socket to read
+ *  - b: Batch to fill, see BATCH_DGRAM()/BATCH_LEN() and b->addrs for the result
+ *  - flags: Flags of recvmmsg() (MSG_DONTWAIT, MSG_WAITFORONE)
+ *  - stats: Counters to update (NULL for clients)
+ * Return:
+ *  Same as recvmmsg()
+ *  */
+int recv_batch(int fd, struct dgram_batch *b, int flags, struct server_stats *stats)
+{
+    struct msghdr *msg;
+    int i, nb;
+
+    // Set up once, then kept as long as the batch is only used to receive
+    for (i = 0; i < b->max && !b->rx_ready; i++) {
+        b->iovs[i].iov_base = b->data + i * BATCH_SLOT_SIZE;
+        b->iovs[i].iov_len = BATCH_SLOT_SIZE;
+
+        msg = &b->msgs[i].msg_hdr;
+        bzero(msg, sizeof(*msg));
+        msg->msg_name = &b->addrs[i];
+        msg->msg_namelen = sizeof(b->addrs[i]);
+        msg->msg_iov = &b->iovs[i];
+        msg->msg_iovlen = 1;
+    }
+
+    b->rx_ready = 1;
+
+    nb = recvmmsg(fd, b->msgs, b->max, flags, NULL);
+    STAT_ADD(stats, syscalls, 1);
+
+    b->nb = nb > 0 ? nb : 0;
+
+    for (i = 0; i < b->nb; i++) {
+        STAT_ADD(stats, pkts_in, 1);
+        STAT_ADD(stats, bytes_in, b->msgs[i].msg_len);
+
+        // The only field the kernel changed that we give it back
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+    }
+
+    return nb;
+}
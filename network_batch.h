@@ -0,0 +1,30 @@
+#ifndef NETWORK_BATCH_H
+
+#define NETWORK_BATCH_H
+
+#include "network.h"
+
+#include <stdint.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 // UDP GSO (Linux 4.18), missing from old headers
+#endif
+
+#define BATCH_SLOT_SIZE (MAX_BLK_SIZE + 4) // Room for any datagram of a batch
+#define MAX_GSO_SEGMENTS 64 // Datagrams the kernel accepts to split at once
+#define MAX_GSO_SIZE 65507 // Largest UDP payload over IPv4
+
+/* Datagram number i of a batch, and its size */
+#define BATCH_DGRAM(b, i) ((char*) (b)->iovs[i].iov_base)
+#define BATCH_LEN(b, i) ((int) (b)->msgs[i].msg_len)
+
+void init_batch(struct dgram_batch *b, int max);
+void free_batch(struct dgram_batch *b);
+char *batch_next(struct dgram_batch *b);
+void batch_push(struct dgram_batch *b, int n);
+void batch_push_ref(struct dgram_batch *b, int header_len, char *payload, int payload_len);
+int flush_batch(struct conn_info conn, struct dgram_batch *b);
+int recv_batch(int fd, struct dgram_batch *b, int flags, struct server_stats *stats);
+
+#endif /* end of include guard: NETWORK_BATCH_H */
@@ -10,12 +10,18 @@
  *  - mode: mode of the request ("asciinet", "octet")
  *  - pref_buffer_size: Buffer size going to be negociated
  *  - timeout: Timeout going to be negociated
+ *  - utimeout: Timeout going to be negociated in microseconds (0 to only ask in seconds)
+ *  - windowsize: Windowsize going to be negociated
+ *  - rollover: Block# following 65535 (asked only if not the default one)
+ *  - offset: First byte of the file asked (-1 for the whole file)
+ *  - length: Bytes asked from offset (0 up to the end of the file)
+ *  - multicast: Ask to join a multicast transfer of the file (RFC2090)
  *  - no_ext: Flag to show if can use RFC2347 extensions (0 = can use extension, 1 = no extension)
  * Return:
  *  Size of the datagram sent, or
  *  -1: Buffer too small
  *  */
-int send_rq(struct conn_info conn, enum request_code type, char* buffer, int buffer_size, char* filename, char* mode, size_t pref_buffer_size, size_t timeout, int no_ext)
+int send_rq(struct conn_info conn, enum request_code type, char* buffer, int buffer_size, char* filename, char* mode, size_t pref_buffer_size, size_t timeout, long long utimeout, size_t windowsize, int rollover, long long offset, long long length, int multicast, int no_ext)
 {
     struct stat st;
     int total_len; // Final length of the datagram (used to avoid buffer overflow)
@@ -25,163 +31,491 @@ int send_rq(struct conn_info conn, enum request_code type, char* buffer, int buf
     filename_l = strlen(filename);
     mode_l = strlen(mode);
 
-    bzero(buffer, buffer_size);
-
-    total_len = 2 + filename_l + 1 + mode_l + 1 + 7 + 1 + 4 + 1 + 5 + 1 + 1 + 1 ;
+    // Opcode, filename, mode, then each option with its longest value
+    total_len = 2 + filename_l + 1 + mode_l + 1
+        + 7 + 1 + 5 + 1 // blksize
+        + 5 + 1 + 20 + 1 // tsize (64 bits)
+        + 7 + 1 + 3 + 1 // timeout
+        + 10 + 1 + 5 + 1 // windowsize
+        + 8 + 1 + 1 + 1 // rollover
+        + 8 + 1 + 9 + 1 // utimeout
+        + 6 + 1 + 20 + 1 // offset
+        + 6 + 1 + 20 + 1 // length
+        + 9 + 1 + 1; // multicast
 
     if (total_len > buffer_size)
         return -1;
 
-    // Op code
+    // Op code, every field after it ends with the NUL written by put_string()
+    buffer[0] = 0;
     buffer[1] = type;
 
     i = 2;
 
-    // The +1 is for the final \0
-    i += 1 + sprintf(buffer+i, "%s", filename);
-
-    i += 1 + sprintf(buffer+i, "%s", mode);
+    i = put_string(buffer, i, filename, filename_l);
+    i = put_string(buffer, i, mode, mode_l);
 
-    if (type == RRQ && no_ext != 1) {
+    if (no_ext != 1) {
         switch (type) {
             case RRQ:
-                i += 1 + sprintf(buffer+i, "tsize");
-                i += 1 + sprintf(buffer+i, "0");
+                i = put_option(buffer, i, OPT_TSIZE, 0);
                 break;
 
             case WRQ:
-                stat(filename, &st);
+                if (stat(filename, &st) < 0)
+                    break;
 
-                i += 1 + sprintf(buffer+i, "tsize");
-                i += 1 + sprintf(buffer+i, "%ld", st.st_size);
+                i = put_option(buffer, i, OPT_TSIZE, st.st_size);
                 break;
 
             case NO: break; // Cannot happen
         }
     }
 
-    if (pref_buffer_size != 0 && no_ext != 1) {
-        i += 1 + sprintf(buffer+i, "blksize");
-        i += 1 + sprintf(buffer+i, "%d", (int) pref_buffer_size);
+    if (pref_buffer_size != 0 && no_ext != 1)
+        i = put_option(buffer, i, OPT_BLKSIZE, pref_buffer_size);
+
+    if (timeout != 0 && no_ext != 1)
+        i = put_option(buffer, i, OPT_TIMEOUT, timeout);
+
+    // Servers not knowing it still get the timeout in seconds
+    if (utimeout != 0 && no_ext != 1)
+        i = put_option(buffer, i, OPT_UTIMEOUT, utimeout);
+
+    if (windowsize > 1 && no_ext != 1)
+        i = put_option(buffer, i, OPT_WINDOWSIZE, windowsize);
+
+    if (rollover != DEFAULT_ROLLOVER && no_ext != 1)
+        i = put_option(buffer, i, OPT_ROLLOVER, rollover);
+
+    // Non-standard: only a byte range of the file, as if it was the whole file
+    if (offset >= 0 && type == RRQ && no_ext != 1) {
+        i = put_option(buffer, i, OPT_OFFSET, offset);
+
+        if (length > 0)
+            i = put_option(buffer, i, OPT_LENGTH, length);
     }
 
-    if (timeout != 0 && no_ext != 1) {
-        i += 1 + sprintf(buffer+i, "timeout");
-        i += 1 + sprintf(buffer+i, "%d", (int) timeout);
+    // The server chooses the group, the value is empty
+    if (multicast && type == RRQ && no_ext != 1) {
+        i = put_string(buffer, i, server_options[OPT_MULTICAST], option_lens[OPT_MULTICAST]);
+        i = put_string(buffer, i, "", 0);
     }
 
-    if(sendto(conn.fd, buffer, i, 0, conn.sock, conn.addr_len) < 0)
-        error("send_rq");
+    if(send_dgram(conn, buffer, i) < 0)
+        return -1;
 
     return i;
 }
 
+/* Refuse an OACK whose option cannot be used: only this transfer fails (RFC2347: ERROR 8)
+ * Args:
+ *  - s: Transfer of the OACK
+ *  - option: Name of the option
+ *  - filename: File we work on
+ * Return:
+ *  -1, the transfer is over
+ *  */
+int oack_refused(struct session *s, char *option, char *filename)
+{
+    fprintf(stderr, "Wrong %s in OACK for '%s'\n", option, filename);
+    send_error(s->conn, 8, "Options refused");
+
+    return -1;
+}
+
 /* Handle OACK (Option ACKnowledgement) datagram from a client perspective
  * Args:
- *  - conn: Connections info to be able to modify socket's timeout
- *  - buffer: Buffer with the data received
- *  - buffer_size: Maximum buffer size (can be modified here)
+ *  - s: Transfer to update with the options
+ *  - buffer: Buffer with the OACK received
  *  - n: Number of bytes in the buffer
- *  - final_size: Value pointed to is the total size of the file we're supposed to get
  *  - filename: File we work on
+ * Return:
+ *  - 0: Options applied
+ *  - -1: An option has a wrong value, the transfer is over (reason printed)
  *  */
-void handle_oack_c(struct conn_info conn, char **buffer, int *buffer_size, int n, int *final_size, char* filename)
+int handle_oack_c(struct session *s, char *buffer, int n, char* filename)
 {
-    int i, timeout;
-    struct timeval tv;
+    struct tftp_packet p;
+    long long *v = p.numbers;
 
-    for (i = 2; i < n; i++) {
-        if (strncmp(*buffer+i, "blksize\0", 8) == 0) {
-            i += 8;
+    parse_oack(buffer, n, &p);
 
-            // Size asked + TFTP header
-            *buffer_size = atoi(*buffer + i) + 4;
+    if (HAS_OPTION(&p, OPT_BLKSIZE)) {
+        if (v[OPT_BLKSIZE] < MIN_BLK_SIZE || v[OPT_BLKSIZE] > MAX_BLK_SIZE)
+            return oack_refused(s, "blksize", filename);
 
-            *buffer = realloc (*buffer, *buffer_size * sizeof(char));
-        }
-        else if (strncmp(*buffer+i, "tsize\0", 6) == 0) {
-            i += 6;
+        // Size asked + TFTP header
+        s->buffer_size = v[OPT_BLKSIZE] + 4;
+    }
 
-            *final_size = atoi(*buffer + i);
-            fprintf(stderr, "Size of '%s': %d\n",filename, *final_size);
-        }
-        else if (strncmp(*buffer+i, "timeout\0", 8) == 0) {
-            timeout = atoi(*buffer + i);
+    if (HAS_OPTION(&p, OPT_TSIZE)) {
+        // Told again when we become the master client of a multicast group
+        if (s->final_size == -1)
+            fprintf(stderr, "Size of '%s': %lld\n", filename, v[OPT_TSIZE]);
 
-            tv.tv_sec = timeout; // Timeout in seconds
-            tv.tv_usec = 0; // Timeout in microseconds
+        s->final_size = v[OPT_TSIZE];
+    }
 
-            //set timer for recv_socket
-            if (setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-                error("setsockopt(custom rcv timeout) failed");
-        }
+    // utimeout wins over timeout
+    if (HAS_OPTION(&p, OPT_TIMEOUT)) {
+        if (v[OPT_TIMEOUT] < 1 || v[OPT_TIMEOUT] > MAX_TIMEOUT)
+            return oack_refused(s, "timeout", filename);
+
+        if (!HAS_OPTION(&p, OPT_UTIMEOUT))
+            set_timeout(s, v[OPT_TIMEOUT] * USEC);
+    }
+
+    if (HAS_OPTION(&p, OPT_UTIMEOUT)) {
+        if (v[OPT_UTIMEOUT] < MIN_RTO || v[OPT_UTIMEOUT] > MAX_TIMEOUT * USEC)
+            return oack_refused(s, "utimeout", filename);
 
-        // Consume last chars until next \0
-        while ((*buffer)[i] != 0 && i < n)
-            i++;
+        set_timeout(s, v[OPT_UTIMEOUT]);
     }
+
+    if (HAS_OPTION(&p, OPT_WINDOWSIZE)) {
+        if (v[OPT_WINDOWSIZE] < 1 || v[OPT_WINDOWSIZE] > MAX_WINDOWSIZE)
+            return oack_refused(s, "windowsize", filename);
+
+        s->windowsize = v[OPT_WINDOWSIZE];
+    }
+
+    if (HAS_OPTION(&p, OPT_ROLLOVER)) {
+        if (v[OPT_ROLLOVER] != 0 && v[OPT_ROLLOVER] != 1)
+            return oack_refused(s, "rollover", filename);
+
+        s->rollover = v[OPT_ROLLOVER];
+    }
+
+    // The server knows ranges: DATA go at their place in the file
+    if (HAS_OPTION(&p, OPT_OFFSET)) {
+        if (v[OPT_OFFSET] != s->range_start)
+            return oack_refused(s, "offset", filename);
+
+        s->ranged = 1;
+    }
+
+    // Shorter than asked at the end of the file
+    if (HAS_OPTION(&p, OPT_LENGTH)) {
+        if (v[OPT_LENGTH] < 0)
+            return oack_refused(s, "length", filename);
+
+        s->range_len = v[OPT_LENGTH];
+    }
+
+    // DATA come to a group, we ACK them only as the master client (the value is NUL terminated in the OACK)
+    if (HAS_OPTION(&p, OPT_MULTICAST) && mcast_option(s, (char*) p.values[OPT_MULTICAST].ptr) < 0)
+        return oack_refused(s, "multicast", filename);
+
+    return 0;
 }
 
 /* Init socket for the connection
  * Args:
  *  - conn: Connections info to set
- *  - host: Host to request
- *  - server_port: Port to request
+ *  - server: Address of the server, resolved once for every transfer (pointed to until the session copies it)
  *  */
-void init_client_conn(struct conn_info *conn, char *host, int server_port)
+void init_client_conn(struct conn_info *conn, struct sockaddr_storage *server)
 {
-    int src_port; // Source port
-    int enable = 1;
-
-    struct sockaddr_in *dst, src; // sockaddr for destination and source
+    struct sockaddr_storage src; // sockaddr for source
     int fd; // Socket's file descriptor
-    int addr_len; // Address' size
 
-    struct timeval tv;
-    tv.tv_sec = DEFAULT_TIMEOUT; // Timeout in seconds
-    tv.tv_usec = 0; // Timeout in microseconds
+    // Init socket, of the family of the server
+    if((fd = socket(server->ss_family, SOCK_DGRAM, 0)) < 0)
+        error("socket");
 
-    /*fd = malloc(sizeof(int));*/
-    /*addr_len = malloc(sizeof(int));*/
-    dst = malloc(sizeof(struct sockaddr_in));
+    // Let the kernel choose our TID (source port): never one already in use,
+    // even for transfers started at the same time
+    any_addr(&src, server->ss_family, 0);
 
-    addr_len=sizeof(*dst);
+    // Init struct conn_info
+    bzero(conn, sizeof(*conn));
+    conn->fd = fd;
+    conn->sock = (struct sockaddr*) server;
+    conn->addr_len = addr_size(server);
 
-    // Init socket
-    if((fd = socket( AF_INET, SOCK_DGRAM, 0)) < 0)
-        error("socket");
+    if (bind(fd, (struct sockaddr*) &src, addr_size(&src)))
+        error("bind");
+}
 
-    // Allow it to be reuseable immediatly after end of use
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
-            error("setsockopt(reuse addr) failed");
+/* Init the session of a client's transfer, once its request is sent
+ * Args:
+ *  - s: Session to initialize
+ *  - conn: Connections info of the transfer
+ *  - conf: Tunables of the client
+ *  - out: Batch the DATA are built and sent from (WRQ)
+ *  - rq: Request sent, kept to send it again until the server answers
+ *  - rq_len: Size of the request
+ *  */
+void init_client_session(struct session *s, struct conn_info conn, const struct client_conf *conf, struct dgram_batch *out, char *rq, int rq_len)
+{
+    // Until an OACK tells otherwise, RFC1350 applies
+    bzero(s, sizeof(*s));
+    s->conn = conn;
+
+    // The server's address, then its TID, is kept in the session
+    memcpy(&s->peer, conn.sock, conn.addr_len);
+    s->conn.sock = (struct sockaddr*) &s->peer;
+
+    s->type = conf->type;
+    s->sending = conf->type == WRQ;
+    s->batch = out;
+    s->buffer_size = DEFAULT_BLK_SIZE;
+    s->windowsize = DEFAULT_WINDOWSIZE;
+    s->rollover = conf->rollover;
+    s->final_size = -1;
+    s->retry = conf->retry;
+
+    s->buffer = malloc(rq_len * sizeof(char));
+    memcpy(s->buffer, rq, rq_len);
+    s->sent_len = rq_len;
+
+    if (conf->utimeout != 0)
+        set_timeout(s, (long long) conf->utimeout * 1000);
+    else
+        set_timeout(s, (long long) (conf->timeout != 0 ? conf->timeout : DEFAULT_TIMEOUT) * USEC);
+
+    reset_timer(s);
+
+    // The request was just sent, its answer gives the first round-trip time
+    rtt_arm(s, 0);
+}
 
-    //set timer for recv_socket
-    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-        error("setsockopt(rcv timeout) failed");
+/* Handle a datagram received by a client
+ * Args:
+ *  - s: Transfer the datagram belongs to
+ *  - buffer: Buffer with the datagram
+ *  - n: Size of the datagram
+ *  - from: Address of the sender
+ *  - filename: File we work on
+ * Return:
+ *  - 0: Transfer goes on
+ *  - 1: Transfer done
+ *  - -1: Transfer failed (ERROR received or sent)
+ *  */
+int client_dgram(struct session *s, char *buffer, int n, struct sockaddr_storage *from, char *filename)
+{
+    struct conn_info other; // Someone else than our peer
+    int progress = 0; // Did the datagram move the transfer forward
+    int ret = 0;
 
-    // init Dest
-    bzero(dst, sizeof(*dst));
-    dst->sin_family = AF_INET;
-    dst->sin_port = htons(server_port);
-    dst->sin_addr.s_addr = inet_addr(host);
+    if (!s->connected) {
+        // Answers come from the TID of the server, send to it from now on
+        memcpy(s->conn.sock, from, s->conn.addr_len);
+        s->connected = 1;
 
-    // Generate a random source port between PORT_MIN and PORT_MAX
-    srand(time(NULL));
-    src_port = (rand() % (PORT_MAX - PORT_MIN)) + PORT_MIN;
+        // Nothing to send again until we send an ACK or DATA
+        s->sent_len = 0;
 
-    // init src
-    bzero(&src, sizeof(src));
-    src.sin_family = AF_INET;
-    src.sin_port = htons(src_port);
-    src.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (s->rtt_sent != 0)
+            rtt_sample(s);
+    }
+    else if (!addr_equal(from, &s->peer) && !(s->mcast != NULL && addr_port(from) == addr_port(&s->peer))) {
+        // Datagram from someone else than our peer, e.g. a second session opened by a request sent again (RFC1350)
+        // Multicast DATA may leave from another address of the server, the one of the group's interface
+        other = s->conn;
+        other.sock = (struct sockaddr*) from;
+
+        // ERROR are never answered, two peers would bounce them forever
+        if (n < 2 || buffer[1] != 5)
+            send_error(other, 5, "Unknown transfer ID");
+        return 0;
+    }
 
-    // Init struct conn_info
-    bzero(conn, sizeof(*conn));
-    conn->fd = fd;
-    conn->sock = (struct sockaddr*) dst;
-    conn->addr_len = addr_len;
-    conn->free = dst;
+    if (n < 4 || buffer[0] != 0) {
+        send_error(s->conn, 4, "Illegal TFTP operation");
+        return -1;
+    }
 
-    if (bind(fd, (struct sockaddr*) &src, addr_len))
-        error("bind");
+    // The local file is left untouched if the request is refused
+    if (buffer[1] == 5) {
+        fprintf(stderr, "Error %d for '%s': %.*s\n", (unsigned char) buffer[2] * 256 + (unsigned char) buffer[3],
+                filename, (int) strnlen(buffer + 4, n - 4), buffer + 4);
+        return -1;
+    }
+
+    if (s->fd == NULL) {
+        // Remove file before trying to write to it if download
+        if (s->type == RRQ)
+            unlink(filename);
+
+        if ((s->fd = fopen(filename, s->type == RRQ ? "wb" : "rb")) == NULL) {
+            fprintf(stderr, "Cannot open '%s': %s\n", filename, strerror(errno));
+            send_error(s->conn, 2, "Access violation");
+            return -1;
+        }
+    }
+
+    switch (buffer[1]) {
+        case 3:
+            // DATA
+            if (s->type == WRQ) {
+                send_error(s->conn, 4, "Illegal TFTP operation");
+                return -1;
+            }
+
+            switch (s->mcast != NULL ? mcast_data(s, buffer, n) : handle_data(s, buffer, n, NULL)) {
+                case 1:
+                    ret = 1;
+                    break;
+                case 0:
+                    progress = 1;
+                    break;
+                case -2:
+                    fprintf(stderr, s->end == END_SEND_FAILED ? "Cannot reach the server for '%s'\n" : "Cannot write '%s'\n", filename);
+                    return -1;
+            }
+
+            // Our range is complete, the rest of the file is someone else's
+            if (ret == 0 && s->ranged && s->range_len > 0 && s->total_size >= s->range_len) {
+                send_error(s->conn, 0, RANGE_DONE_MSG);
+                ret = 1;
+            }
+            break;
+        case 4:
+            // ACK
+            if (s->type == RRQ) {
+                send_error(s->conn, 4, "Illegal TFTP operation");
+                return -1;
+            }
+
+            switch (handle_ack(s, buffer, n)) {
+                case 1:
+                    ret = 1;
+                    break;
+                case 0:
+                    progress = 1;
+                    break;
+                case -2:
+                    send_error(s->conn, 4, "Illegal TFTP operation");
+                    return -1;
+                case -3:
+                    fprintf(stderr, "Cannot reach the server for '%s'\n", filename);
+                    return -1;
+            }
+            break;
+        case 6:
+            // OACK (Option ACK)
+            if (handle_oack_c(s, buffer, n, filename) < 0)
+                return -1;
+
+            // Multicast: listen to the group, the master client asks from its first missing block
+            if (s->mcast != NULL) {
+                if (s->mcast->fd < 0) {
+                    if (mcast_listen(s->mcast) < 0) {
+                        send_error(s->conn, 8, "Cannot join the multicast group");
+                        return -1;
+                    }
+
+                    size_rcvbuf(s, s->mcast->fd);
+                }
+
+                if (s->mcast->master) {
+                    if (send_ack(s->conn, s->last_block) < 0)
+                        return send_failed(s);
+
+                    s->last_ack = s->last_block;
+                    rtt_arm(s, s->last_block + 1);
+                }
+            }
+            else if (s->type == RRQ) {
+                size_rcvbuf(s, s->conn.fd);
+
+                if (send_ack(s->conn, 0) < 0)
+                    return send_failed(s);
+
+                rtt_arm(s, 1);
+            }
+            else if (send_window(s) < 0) {
+                return -1;
+            }
+
+            progress = 1;
+            break;
+        default:
+            // Anything else is an error (RRQ/WRQ or non specified)
+            send_error(s->conn, 4, "Illegal TFTP operation");
+            return -1;
+    }
+
+    // Duplicates do not push the deadline back
+    if (progress)
+        reset_timer(s);
+
+    // Without DATA, the server may be waiting for the master client to give up first
+    if (progress && s->mcast != NULL && !s->mcast->master)
+        s->giveup += s->retry * s->timeout;
+
+    return ret;
+}
+
+/* Retransmit the last datagram of a client's transfer whose server stayed silent for a RTO
+ * Args:
+ *  - s: Transfer which timed out
+ *  - filename: File we work on
+ * Return:
+ *  - 0: Datagram sent again, the next RTO is twice as long
+ *  - 1: No progress for too long, or the server cannot be reached: the transfer failed
+ *  */
+int client_timeout(struct session *s, char *filename)
+{
+    if (now_us() >= s->giveup) {
+        TRACE(TRACE_GIVEUP, s, s->last_block, 0);
+        fprintf(stderr, "Timeout for '%s'\n", filename);
+
+        // The server removes us from the group at once, instead of handing it to us later
+        if (s->mcast != NULL)
+            send_error(s->conn, 0, "Timeout");
+
+        return 1;
+    }
+
+    TRACE(TRACE_TIMEOUT, s, s->last_block, s->rto);
+
+    // The request itself until the server answers, nothing from the clients of a group but the master
+    if ((s->mcast == NULL || s->mcast->master || !s->connected) && retransmit(s) < 0) {
+        fprintf(stderr, "Cannot reach the server for '%s'\n", filename);
+        return 1;
+    }
+
+    backoff_timer(s);
+
+    return 0;
+}
+
+/* Close the file of a client's transfer, and check what we got
+ * Args:
+ *  - s: Transfer which is over
+ *  - filename: File we work on
+ *  - status: How it ended (1: done, -1: failed)
+ * Return:
+ *  - 1: File transferred
+ *  - -1: Transfer failed, or the file received has not the size announced
+ *  */
+int end_client_session(struct session *s, char *filename, int status)
+{
+    long long expected = s->final_size; // Size we should have received
+
+    // Everything was read, the sender now knows the size of the file
+    if (status == 1 && s->sending)
+        s->total_size = ftello(s->fd);
+
+    if (s->fd != NULL)
+        fclose(s->fd);
+
+    if (s->mcast != NULL)
+        mcast_leave(s);
+
+    free(s->buffer);
+
+    // A segment only gets its range
+    if (s->ranged && s->range_len > 0)
+        expected = s->range_len;
+
+    if (status == 1 && s->type == RRQ && expected != -1 && expected != s->total_size) {
+        fprintf(stderr, "Final size of '%s' is wrong. Got %lldB instead of %lldB\n", filename, s->total_size, expected);
+        return -1;
+    }
+
+    return status;
 }
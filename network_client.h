@@ -6,9 +6,14 @@
 
 #include <sys/stat.h>
 
-int send_rq(struct conn_info conn, enum request_code type, char* buffer, int buffer_size, char* filename, char* mode, size_t pref_buffer_size, size_t timeout, int no_ext);
-void handle_oack_c(struct conn_info conn, char **buffer, int *buffer_size, int n, int *final_size, char* filename);
+int send_rq(struct conn_info conn, enum request_code type, char* buffer, int buffer_size, char* filename, char* mode, size_t pref_buffer_size, size_t timeout, long long utimeout, size_t windowsize, int rollover, long long offset, long long length, int multicast, int no_ext);
+int oack_refused(struct session *s, char *option, char *filename);
+int handle_oack_c(struct session *s, char *buffer, int n, char* filename);
 
-void init_client_conn(struct conn_info *conn, char *host, int server_port);
+void init_client_conn(struct conn_info *conn, struct sockaddr_storage *server);
+void init_client_session(struct session *s, struct conn_info conn, const struct client_conf *conf, struct dgram_batch *out, char *rq, int rq_len);
+int client_dgram(struct session *s, char *buffer, int n, struct sockaddr_storage *from, char *filename);
+int client_timeout(struct session *s, char *filename);
+int end_client_session(struct session *s, char *filename, int status);
 
 #endif /* end of include guard: NETWORK_CLIENT_H */
@@ -2,372 +2,510 @@
 
 /* Create server's socket
  * Args:
+ *  - family: AF_INET or AF_INET6 (IPv6 only, IPv4 clients come to the AF_INET one)
  *  - server_port: Port to bind
+ *  - reuse_port: Allow other sockets to bind the same port (one per worker)
  * Return:
  *  - socket's file descriptor
+ *  - -1: No IPv6 on this host
  *  */
-int init_server_conn(int server_port)
+int init_server_conn(int family, int server_port, int reuse_port)
 {
     int enable = 1;
 
-    struct sockaddr_in serv; // sockaddr for source
+    struct sockaddr_storage serv; // sockaddr for source
     int fd; // Socket's file descriptor
-    int addr_len; // Address' size
-
-    struct timeval tv;
-    tv.tv_sec = DEFAULT_TIMEOUT; // Timeout in seconds
-    tv.tv_usec = 0; // Timeout in microseconds
-
-    addr_len=sizeof(serv);
 
     // Init socket
-    if((fd = socket( AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((fd = socket(family, SOCK_DGRAM, 0)) < 0) {
+        if (family == AF_INET6 && errno == EAFNOSUPPORT)
+            return -1;
+
         error("socket");
+    }
+
+    // Both families on the same port, each with its own socket
+    if (family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(int)) < 0)
+            error("setsockopt(v6 only) failed");
 
     // Allow it to be reuseable immediatly after end of use
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
             error("setsockopt(reuse addr) failed");
 
-    //set timer for recv_socket
-    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-        error("setsockopt(rcv timeout) failed");
+    // The kernel balances requests between the workers' sockets
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+            error("setsockopt(reuse port) failed");
+
+    any_addr(&serv, family, server_port);
 
-    // init serv
-    bzero(&serv, sizeof(serv));
-    serv.sin_family = AF_INET;
-    serv.sin_port = htons(server_port);
-    serv.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr*) &serv, addr_size(&serv))) {
+        // IPv6 disabled on every interface
+        if (family == AF_INET6 && errno == EADDRNOTAVAIL) {
+            close(fd);
+            return -1;
+        }
 
-    if (bind(fd, (struct sockaddr*) &serv, addr_len))
         error("bind");
+    }
 
     return fd;
 }
 
+
+/* Create the TID socket of a session, dedicated to one peer
+ * Args:
+ *  - s: Session to initialize
+ *  - peer: Address of the client which sent the request
+ * Return:
+ *  - 0: Socket ready
+ *  - -1: Cannot create the socket
+ *  */
+int init_session_conn(struct session *s, struct sockaddr_storage *peer)
+{
+    struct sockaddr_storage src; // sockaddr for source
+    int fd; // Socket's file descriptor
+
+    // Same family as the client
+    if ((fd = socket(peer->ss_family, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+    // Let the kernel choose our TID (source port)
+    any_addr(&src, peer->ss_family, 0);
+
+    if (bind(fd, (struct sockaddr*) &src, addr_size(&src)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    memcpy(&s->peer, peer, addr_size(peer));
+
+    // Init struct conn_info
+    bzero(&s->conn, sizeof(s->conn));
+    s->conn.fd = fd;
+    s->conn.sock = (struct sockaddr*) &s->peer;
+    s->conn.addr_len = addr_size(peer);
+
+    return 0;
+}
+
 /* Send a OACK (Option ACKnowledgement) TFTP datagram
  * Args:
  *  - conn: Connections info to be able to send the OACK
- *  - opts: Options' name
- *  - optval: Options' values
+ *  - buffer: Buffer in which the OACK is built (DEFAULT_BLK_SIZE bytes hold every option with its longest value)
+ *  - optval: Options' values, in the order of server_options (-1 to skip the option)
+ *  - mcast: Value of the multicast option, "addr,port,mc" (NULL if not granted)
+ * Return:
+ *  Size of the datagram sent, -1 if the kernel refused it
  *  */
-int send_oack(struct conn_info conn, char **opts, int *optval)
+int send_oack(struct conn_info conn, char *buffer, long long *optval, const char *mcast)
 {
-    int i, k, buffer_size;
-    char *buffer = NULL;
-
-    buffer_size = optval[0];
-    buffer = calloc(buffer_size, sizeof(char));
+    int i, k;
 
+    buffer[0] = 0;
     buffer[1] = 6;
     i = 2;
 
-    for (k = 0; opts[k] != NULL; k++) {
+    for (k = 0; k < NB_OPTIONS; k++) {
         if (optval[k] == -1)
             continue;
 
-        i += 1 + sprintf(buffer+i, "%s", opts[k]);
-        i += 1 + sprintf(buffer+i, "%d", optval[k]);
-
-        fprintf(stderr, "Opt: %s=%d\n", opts[k], optval[k]);
+        if (k == OPT_MULTICAST && mcast != NULL) {
+            i = put_string(buffer, i, server_options[k], option_lens[k]);
+            i = put_string(buffer, i, mcast, strlen(mcast));
+        }
+        else {
+            i = put_option(buffer, i, k, optval[k]);
+        }
     }
 
-    if (sendto(conn.fd, buffer, i, 0, conn.sock, conn.addr_len) < 0)
-        error("send_oack");
-
-    free(buffer);
+    if (send_dgram(conn, buffer, i) < 0)
+        return -1;
 
-    return 0;
+    return i;
 }
 
 /* Handle RRQ/WRQ (Read/Write ReQuest) TFTP datagram
  * Args:
- *  - conn: Connections info to be able to send back the reply (OACK/ACK/DATA)
+ *  - s: Session opened for this request, its first reply (OACK/ACK/DATA) is sent here
  *  - buffer: Buffer with the data received
  *  - n: Number of bytes received
- *  - buffer_size: Maximum size of the buffer
- *  - fd_dst: file descriptor to the file
- *  - type: Set if we are in RRQ or WRQ
- *  - last_block: Set the number of current data
+ *  - conf: Tunables of the server (limits of the options)
+ *  - st: Storage the file is read from or written to, with the rewrite table of the names
+ * Return:
+ *  - 0: Request accepted (not answered yet if multicast is granted)
+ *  - -1: Request refused (ERROR already sent), or its first answer could not be sent
  *  */
-int handle_rq(struct conn_info conn, char **buffer, int n, int *buffer_size, FILE **fd_dst, enum request_code *type, int *last_block)
+int handle_rq(struct session *s, char *buffer, int n, const struct server_conf *conf, struct storage *st)
 {
-    int i, j, k, end, got_opt;
-    got_opt = 0;
-    end = 0;
-    i = 0;
+    int k, got_opt, rewritten;
+    const char *filename;
+    char path[PATH_MAX];
+    struct tftp_packet p;
+
+    long long size;
+
+    long long *optval = s->options; // Kept for the access log
+
+    for (k = 0; k < NB_OPTIONS; k++)
+        optval[k] = -1;
+
+    s->type = buffer[1];
+    s->sending = s->type == RRQ;
+
+    // Every field points into the receive buffer, left untouched until we return
+    k = parse_request(buffer, n, &p);
+    filename = p.filename.ptr;
+
+    if (filename != NULL)
+        snprintf(s->filename, FILENAME_SIZE, "%s", filename);
+
+    switch (k) {
+        case CODEC_NO_FILENAME:
+            session_error(s, 4, "Missing filename");
+            return -1;
+        case CODEC_NO_MODE:
+            session_error(s, 4, "Missing mode");
+            return -1;
+        case CODEC_BAD_MODE:
+            session_error(s, 4, "Unrecognized mode");
+            return -1;
+    }
 
-    struct timeval tv;
+    // Mapped to another file, or generated for this client
+    rewritten = st->rewrite != NULL ? rewrite_request(st, s, filename, path, sizeof(path)) : 0;
 
-    char *opts[4] = { "blksize", "tsize", "timeout", 0 };
-    int optval[4] = {-1, -1, -1, 0};
-    int opt_len;
+    if (rewritten < 0) {
+        session_error(s, 2, "Access violation");
+        return -1;
+    }
 
-    *type = (*buffer)[1];
-    i += 2;
+    if (rewritten == 1) {
+        filename = path;
+        snprintf(s->filename, FILENAME_SIZE, "%.*s", FILENAME_SIZE - 1, filename);
+    }
 
-    if (n - i < 2)
-        error("Missing filename");
+    // Opened first: tsize, the range and multicast need its size
+    switch (rewritten == 2 ? 0 : store_open(st, s, filename)) {
+        case 1:
+            session_error(s, 1, "File not found");
+            return -1;
+        case 2:
+            session_error(s, 2, "Access violation");
+            return -1;
+    }
 
-    int filename_len = strlen(*buffer+i) + 1;
+    for (k = 0; k < NB_OPTIONS; k++) {
+        if (!HAS_OPTION(&p, k))
+            continue;
 
-    char *filename = malloc(sizeof(char) * filename_len);
-    strncpy(filename, *buffer+i, filename_len);
-    filename[filename_len] = 0;
+        STAT_ADD(s->conn.stats, options[k], 1);
 
-    i += filename_len;
+        optval[k] = p.numbers[k];
 
-    if (n - i < 2)
-        error("Missing mode");
+        // Handle options
+        switch (k) {
+            case OPT_BLKSIZE:
+                if (optval[k] < MIN_BLK_SIZE)
+                    optval[k] = MIN_BLK_SIZE;
+                else if (optval[k] > MAX_BLK_SIZE)
+                    optval[k] = MAX_BLK_SIZE;
 
-    if (strncmp(*buffer+i, "octet", 6) != 0 && strncmp(*buffer+i, "netascii", 9) != 0)
-        error("Unrecognized mode");
+                s->buffer_size = optval[k] + 4;
+                break;
 
-    // Prepare file
-    char fmode[3] = ".b";
-    switch (*type) {
-        case RRQ:
-            fmode[0] = 'r';
+            case OPT_TSIZE:
+                // Give the final size
+                if (s->type == RRQ)
+                    optval[k] = store_size(s);
+                // For WRQ, echo back the size we got, dropped if it is not one (nothing reserved for it)
+                else if (!is_size(&p.values[k]))
+                    optval[k] = -1;
+                break;
 
-            break;
-        case WRQ:
-            fmode[0] = 'a';
-            unlink (filename);
+            case OPT_TIMEOUT:
+                // timeout (seconds), utimeout wins if both are asked
+                if (optval[k] < 1)
+                    optval[k] = 1;
+                else if (optval[k] > MAX_TIMEOUT)
+                    optval[k] = MAX_TIMEOUT;
 
-            break;
-        case NO: break; //Cannot happen
-    }
+                if (!HAS_OPTION(&p, OPT_UTIMEOUT))
+                    set_timeout(s, optval[k] * USEC);
+                break;
 
-    if ((*fd_dst = fopen (filename, fmode)) == NULL)
-        error("Cannot open result file");
+            case OPT_WINDOWSIZE:
+                if (optval[k] < 1)
+                    optval[k] = 1;
+                else if (optval[k] > conf->max_windowsize)
+                    optval[k] = conf->max_windowsize;
 
-    i += strlen(*buffer+i) + 1;
+                s->windowsize = optval[k];
+                break;
 
-    while (i < n && (*buffer)[i] != 0) {
-        for (k = 0; k < (int)(sizeof(opts)*sizeof(char*)) && opts[k] != NULL; k++) {
-            opt_len = strlen(opts[k]) + 1;
-            if (i + opt_len < n && strncmp(*buffer+i, opts[k], opt_len) == 0) {
-                i += opt_len;
+            case OPT_ROLLOVER:
+                // rollover (0 or 1, what we do otherwise if anything else)
+                if (optval[k] != 0 && optval[k] != 1)
+                    optval[k] = conf->rollover;
 
-                for (j=0; i + j < n && (*buffer)[i+j] != 0 ; j++);
-                // Nothing in for
+                s->rollover = optval[k];
+                break;
 
-                if ( i + j >= n) {
-                    end = 1;
-                    break;
-                }
+            case OPT_UTIMEOUT:
+                // utimeout (microseconds)
+                if (optval[k] < MIN_RTO)
+                    optval[k] = MIN_RTO;
+                else if (optval[k] > MAX_TIMEOUT * USEC)
+                    optval[k] = MAX_TIMEOUT * USEC;
 
-                optval[k] = atoi(*buffer+i);
+                set_timeout(s, optval[k]);
+                break;
 
-                i += j + 1;
+            case OPT_OFFSET:
+                // offset (first byte sent, non-standard: segmented downloads)
+                if (s->type != RRQ || optval[k] < 0)
+                    optval[k] = -1;
+                else
+                    s->range_start = optval[k];
+                break;
 
-                // Handle options
-                switch (k) {
-                    case 0:
-                        // blksize
-                        *buffer_size = optval[k];
-                        *buffer = realloc (*buffer, *buffer_size * sizeof(char));
-                        break;
+            case OPT_LENGTH:
+                // length (bytes sent from offset, 0 up to the end of the file)
+                if (s->type != RRQ || optval[k] < 0)
+                    optval[k] = -1;
+                else
+                    s->range_len = optval[k];
+                break;
 
-                    case 1:
-                        // tsize
-                        if (*type == RRQ) {
-                            // Give the final size
-                            fseek(*fd_dst, 0, SEEK_END);
-                            optval[k] = ftell(*fd_dst);
-                            fseek(*fd_dst, 0, SEEK_SET);
+            case OPT_MULTICAST:
+                // multicast (RFC2090): asked empty, the group is chosen by the server
+                optval[k] = 0;
+                break;
+        }
+    }
 
-                            /*optval[k] = -1;*/
-                        }
-                        // For WRQ, just echo back the size we got
+    // Only a part of the file is sent, as if it was the whole file
+    if (s->range_start > 0 || s->range_len > 0) {
+        size = store_size(s);
 
-                        break;
+        if (s->range_start > size) {
+            session_error(s, 8, "Invalid range");
+            return -1;
+        }
 
-                    case 2:
-                        // timeout
-                        tv.tv_sec = optval[k];
-                        tv.tv_usec = 0;
+        if (s->range_len > size - s->range_start)
+            s->range_len = optval[OPT_LENGTH] = size - s->range_start;
 
-                        // set timer for recv socket
-                        if (setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-                            error("setsockopt(custom rcv timeout) failed");
+        if (s->map == NULL)
+            fseeko(s->fd, s->range_start, SEEK_SET);
+    }
 
-                        break;
-                }
+    // Multicast: whole files to IPv4 clients, block# never wrapped
+    if (optval[OPT_MULTICAST] != -1) {
+        size = store_size(s);
 
-                got_opt = 1;
-                end = 2;
-                break;
-            }
+        if (conf->multicast.sin_port == 0 || s->type != RRQ || s->peer.ss_family != AF_INET
+                || s->range_start > 0 || s->range_len > 0 || size / (s->buffer_size - 4) + 1 > MCAST_MAX_BLOCKS)
+            optval[OPT_MULTICAST] = -1;
+    }
 
-        }
-        if (end == 2)
-            continue;
-        else if (end != 0)
-            break;
+    // Same DATA for every client asking this file with this block size
+    if (s->cached != NULL && s->range_start == 0 && s->range_len == 0)
+        s->dgrams = cache_blocks(st->cache, s->cached, s->buffer_size - 4, s->rollover);
+
+    // Files read from the disk: the next windows are asked ahead
+    if (s->type == RRQ && s->fd != NULL)
+        s->readahead = (long long) conf->readahead * s->windowsize * (s->buffer_size - 4);
+
+    if (s->type == WRQ)
+        size_rcvbuf(s, s->conn.fd);
+
+    // The whole upload is allocated at once when its size is announced
+    if (s->type == WRQ && optval[OPT_TSIZE] > 0 && store_reserve(s, optval[OPT_TSIZE]) < 0) {
+        session_error(s, 3, "Disk full");
+        return -1;
+    }
 
-        i++;
+    // The group is chosen by the worker, see mcast_request()
+    if (optval[OPT_MULTICAST] != -1) {
+        reset_timer(s);
+        return 0;
     }
 
+    // Unknown options were skipped by the parser, and those dropped are not acknowledged:
+    // with none left, the request is answered as without options (RFC2347)
+    for (k = 0, got_opt = 0; k < NB_OPTIONS; k++)
+        got_opt |= optval[k] != -1;
+
+    // A peer the kernel cannot send to (e.g. port 0) only ends its own session
     if (got_opt) {
-        send_oack(conn, opts, optval);
+        if ((s->sent_len = send_oack(s->conn, s->buffer, optval, NULL)) < 0)
+            return send_failed(s);
     }
     else {
-        switch (*type) {
+        switch (s->type) {
             case RRQ:
-                send_data(conn, buffer, *buffer_size, last_block, *fd_dst);
-
+                if (send_window(s) < 0)
+                    return -1;
                 break;
             case WRQ:
-                send_ack(conn, 0);
+                if (send_ack(s->conn, 0) < 0)
+                    return send_failed(s);
                 break;
             case NO: break; //Cannot happen
         }
     }
 
-    fprintf(stderr, "===> Request file '%s' for %s\n", filename, *type == RRQ ? "RRQ" : "WRQ");
-
-    free(filename);
+    // Time the answer: ACK of the OACK or of the first window (RRQ), first DATA (WRQ), once sent
+    if (s->paced == 0)
+        rtt_arm(s, s->type == RRQ ? 0 : 1);
+    reset_timer(s);
 
     return 0;
 }
 
-/* Main function of server. Accept a connection, and answer it
+/* Handle a datagram received on the TID socket of a session
  * Args:
- *  - fd: Socket's file descriptor
- * */
-int rcv_data(int fd)
+ *  - s: Session the datagram belongs to
+ *  - buffer: Buffer with the data received
+ *  - n: Number of bytes received
+ *  - st: Storage of the server, an upload is committed to it once complete
+ * Return:
+ *  - 0: Transfer goes on
+ *  - 1: Transfer is over (either finished or aborted)
+ *  */
+int handle_session(struct session *s, char *buffer, int n, struct storage *st)
 {
-    const int oretry = 3;
-
-    struct conn_info conn;
-    enum request_code type = NO;
-    char *buffer;
-    char *filename = NULL;
-
-    int buffer_size = DEFAULT_BLK_SIZE;
-    int end = 0; // Flag wether or not we can continue the loop
-    int last_block = 0; // Block# of the last OK DATA
-    int total_size = 0; // Incremental size of the file we got so far
-    int final_size = -1; // Total size of the file we're supposed to get
-    int n; // Size of the last datagram we got
-    int wait_last_ack = 0 ; // Do we just wait for the last ACK (no more DATA to send)
-    int first_dgram = 1 ;
-    int retry = oretry ;
-    FILE *fd_dst = NULL;
-
-    buffer = malloc(sizeof(char) * buffer_size);
-
-    struct sockaddr_in *dst;
-    dst = malloc(sizeof(struct sockaddr_in));
-    bzero(dst, sizeof(*dst));
+    int end = 0; // Flag wether or not the transfer is over
+    int progress = 0; // Did the transfer move forward
 
-    // Init struct conn_info
-    bzero(&conn, sizeof(conn));
-    conn.fd = fd;
-    conn.sock = (struct sockaddr*) dst;
-    conn.addr_len = sizeof(*dst);
-    conn.free = dst;
-
-    bzero(buffer, buffer_size);
-    while ((n = recvfrom(fd, buffer, buffer_size, 0, conn.sock, (socklen_t *) &(conn.addr_len)))) {
-        // On receive fail
-        if (n < 0) {
-            // If conn.sock wasn't initialize, ignore it
-            if (((struct sockaddr_in*) conn.sock)->sin_port == 0)
-                continue;
-
-            retry--;
-
-            // If we did all retries, break the main loop
-            if (retry <= 0) {
-                fprintf(stderr, "Receive %dB from %s:%d\n",n,
-                        inet_ntoa(((struct sockaddr_in*) conn.sock)->sin_addr),
-                        ntohs(((struct sockaddr_in*) conn.sock)->sin_port));
-                fprintf(stderr, "FAIL\n");
-                break;
-            }
-
-            continue;
-        }
+    // Only the writer threads end an upload being put in place: its last ACK follows
+    if (s->committing)
+        return 0;
 
+    if (n < 4 || buffer[0] != 0) {
+        session_error(s, 4, "Illegal TFTP operation");
+        return 1;
+    }
 
-        if (first_dgram) {
-            fprintf(stderr, "Receive %dB from %s:%d\n",n,
-                    inet_ntoa(((struct sockaddr_in*) conn.sock)->sin_addr),
-                    ntohs(((struct sockaddr_in*) conn.sock)->sin_port));
-            first_dgram = 0;
-        }
-
-        // Reset retry for next failed receive
-        retry = oretry;
+    switch (buffer[1]) {
+        case 3:
+            // DATA
+            if (s->type == RRQ) {
+                session_error(s, 4, "Illegal TFTP operation");
+                end = 1;
+                break;
+            }
 
-        if (buffer[0] == 0) {
-            switch (buffer[1]) {
+            switch (handle_data(s, buffer, n, st)) {
                 case 1:
+                    s->end = END_DONE;
+                    end = 1;
+                    break;
+                case 0:
                 case 2:
-                    handle_rq(conn, &buffer, n, &buffer_size, &fd_dst, &type, &last_block);
+                    // We now only send ACKs
+                    s->sent_len = 0;
+                    progress = 1;
                     break;
-                case 3:
-                    // DATA
-                    if (type == RRQ) {
-                        send_error(conn, 4, "Illegal TFTP operation");
-                        end = 1;
-                        break;
-                    }
-
-                    if (handle_data(conn, buffer, n, &last_block, &total_size, fd_dst) == 0 &&
-                            n < buffer_size - 4) {
-                        end = 1;
-                        break;
-                    }
+                case -2:
+                    end = 1;
                     break;
-                case 4:
-                    // ACK
-                    if (type == WRQ) {
-                        send_error(conn, 4, "Illegal TFTP operation");
-                        end = 1;
-                        break;
-                    }
-
-                    if (handle_ack(buffer, n, last_block) == 0) {
-                        if (wait_last_ack != 1) {
-                            wait_last_ack = send_data(conn, &buffer, buffer_size, &last_block, fd_dst);
-                        }
-                        else {
-                            end = 1;
-                        }
-                    }
+            }
+            break;
+        case 4:
+            // ACK
+            if (s->type == WRQ) {
+                session_error(s, 4, "Illegal TFTP operation");
+                end = 1;
+                break;
+            }
 
+            switch (handle_ack(s, buffer, n)) {
+                case 1:
+                    s->end = END_DONE;
+                    end = 1;
+                    break;
+                case 0:
+                    progress = 1;
                     break;
-                case 5:
-                    // ERROR
+                case -2:
+                    session_error(s, 4, "Illegal TFTP operation");
                     end = 1;
                     break;
-                default:
-                    // Anything else is an error (OACK or non specified)
-                    send_error(conn, 4, "Illegal TFTP operation");
+                case -3:
                     end = 1;
                     break;
             }
-        }
-        else {
-            send_error(conn, 4, "Illegal TFTP operation");
+            break;
+        case 5:
+            // ERROR
+            s->end = END_ERROR_RECEIVED;
+            s->end_code = (unsigned char) buffer[2] * 256 + (unsigned char) buffer[3];
             end = 1;
-        }
 
-        bzero(buffer, buffer_size);
-
-        if (end == 1)
+            // A segment stops once it has its range (message with or without its final NUL)
+            if (s->type == RRQ && s->options[OPT_OFFSET] >= 0 && s->end_code == 0
+                    && n - 4 >= (int) strlen(RANGE_DONE_MSG) && n - 4 <= (int) sizeof(RANGE_DONE_MSG)
+                    && memcmp(buffer+4, RANGE_DONE_MSG, strlen(RANGE_DONE_MSG)) == 0)
+                s->end = END_RANGE_DONE;
+            break;
+        default:
+            // Anything else is an error (RRQ/WRQ/OACK or non specified)
+            session_error(s, 4, "Illegal TFTP operation");
+            end = 1;
             break;
     }
 
-    if (fd_dst != NULL)
-        fclose(fd_dst);
+    if (progress)
+        reset_timer(s);
 
-    if (type == WRQ && final_size != -1 && final_size != total_size) {
-        fprintf(stderr, "Final size of '%s' is wrong. Got %dB instead of %dB\n", filename, total_size, final_size);
-        return -1;
+    return end;
+}
+
+/* Retransmit the last datagram of a session whose peer stayed silent for a RTO
+ * Args:
+ *  - s: Session which timed out
+ * Return:
+ *  - 0: Datagram sent again, the next RTO is twice as long
+ *  - 1: No progress for too long, or the peer cannot be reached: the transfer is aborted
+ *  */
+int session_timeout(struct session *s)
+{
+    if (s->group != NULL)
+        return mcast_timeout(s);
+
+    // The peer waits for the last ACK, however long the disk takes to put the upload in place
+    if (s->committing) {
+        s->deadline = now_us() + s->rto;
+        return 0;
     }
 
+    // Not a timeout: the window held back by the rate limits is paid back
+    if (s->paced != 0) {
+        s->paced = 0;
+
+        if (send_window(s) < 0)
+            return 1;
+
+        s->deadline = s->paced != 0 ? s->paced : now_us() + s->rto;
+        return 0;
+    }
+
+    if (now_us() >= s->giveup) {
+        STAT_ADD(s->conn.stats, aborted, 1);
+        TRACE(TRACE_GIVEUP, s, s->last_block, 0);
+        s->end = END_TIMEOUT;
+        return 1;
+    }
+
+    TRACE(TRACE_TIMEOUT, s, s->last_block, s->rto);
+
+    if (retransmit(s) < 0)
+        return 1;
+
+    backoff_timer(s);
+
+    STAT_ADD(s->conn.stats, timeouts, 1);
+
     return 0;
 }
@@ -4,9 +4,11 @@
 
 #include "network.h"
 
-int init_server_conn(int server_port);
-int send_oack(struct conn_info conn, char **opts, int *optval);
-int handle_rq(struct conn_info conn, char **buffer, int n, int *buffer_size, FILE **fd_dst, enum request_code *type, int *last_block);
-int rcv_data(int fd);
+int init_server_conn(int family, int server_port, int reuse_port);
+int init_session_conn(struct session *s, struct sockaddr_storage *peer);
+int send_oack(struct conn_info conn, char *buffer, long long *optval, const char *mcast);
+int handle_rq(struct session *s, char *buffer, int n, const struct server_conf *conf, struct storage *st);
+int handle_session(struct session *s, char *buffer, int n, struct storage *st);
+int session_timeout(struct session *s);
 
 #endif /* end of include guard: NETWORK_SERVER_H */
@@ -0,0 +1,131 @@
+#include "network_timer.h"
+
+/* Get the current date, from a clock which never goes backward
+ * Return:
+ *  Microseconds since an arbitrary point
+ *  */
+long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * USEC + ts.tv_nsec / 1000;
+}
+
+/* Get how long an event loop may sleep before a deadline
+ * Args:
+ *  - deadline: Date (us) to wake up at
+ * Return:
+ *  Milliseconds to give to poll()/epoll_wait(), rounded up (0 if already passed)
+ *  */
+int timer_wait(long long deadline)
+{
+    long long wait;
+
+    wait = deadline - now_us();
+
+    if (wait <= 0)
+        return 0;
+
+    if (wait > MAX_RTO)
+        wait = MAX_RTO;
+
+    return (wait + 999) / 1000;
+}
+
+/* Use a negotiated timeout (timeout or utimeout option)
+ * It is the RTO until the round-trip time is measured, and sets the patience of the transfer.
+ * Args:
+ *  - s: Transfer to update
+ *  - timeout: Timeout, in microseconds
+ *  */
+void set_timeout(struct session *s, long long timeout)
+{
+    s->timeout = timeout;
+
+    if (s->srtt == 0)
+        s->rto = timeout;
+}
+
+/* Restart the timers after some progress: wait one RTO for the peer,
+ * and give up after retry timeouts of the negotiated length without any progress
+ * Args:
+ *  - s: Transfer which moved forward
+ *  */
+void reset_timer(struct session *s)
+{
+    long long now = now_us();
+
+    // A window held back by the rate limits goes first, the peer is waited for from then
+    if (s->paced > now)
+        now = s->paced;
+
+    s->deadline = s->paced != 0 ? s->paced : now + s->rto;
+    s->giveup = now + s->retry * s->timeout;
+}
+
+/* Wait twice as long for the peer after a retransmission (exponential backoff)
+ * Args:
+ *  - s: Transfer which timed out
+ *  */
+void backoff_timer(struct session *s)
+{
+    s->rto *= 2;
+
+    if (s->rto > MAX_RTO)
+        s->rto = MAX_RTO;
+
+    // The next answer may be to the first copy or to the retransmission (Karn)
+    s->rtt_sent = 0;
+
+    s->deadline = s->paced != 0 ? s->paced : now_us() + s->rto;
+}
+
+/* Start to measure the round-trip time, unless a measure is already running
+ * Args:
+ *  - s: Transfer which just sent a datagram
+ *  - block: Block# whose ACK (sender) or DATA (receiver) ends the measure
+ *  */
+void rtt_arm(struct session *s, long long block)
+{
+    if (s->rtt_sent != 0)
+        return;
+
+    s->rtt_sent = now_us();
+    s->rtt_block = block;
+}
+
+/* End the running measure and update the RTO from it (Jacobson/Karels, RFC6298)
+ * Args:
+ *  - s: Transfer which just got the answer to the datagram timed
+ *  */
+void rtt_sample(struct session *s)
+{
+    long long rtt, delta;
+
+    rtt = now_us() - s->rtt_sent;
+    s->rtt_sent = 0;
+
+    if (rtt < 1)
+        rtt = 1;
+
+    if (s->srtt == 0) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    }
+    else {
+        delta = s->srtt > rtt ? s->srtt - rtt : rtt - s->srtt;
+
+        s->rttvar = (3 * s->rttvar + delta) / 4;
+        s->srtt = (7 * s->srtt + rtt) / 8;
+    }
+
+    // A fresh measure also ends the backoff
+    s->rto = s->srtt + 4 * s->rttvar;
+
+    if (s->rto < MIN_RTO)
+        s->rto = MIN_RTO;
+    else if (s->rto > MAX_RTO)
+        s->rto = MAX_RTO;
+}
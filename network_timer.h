@@ -0,0 +1,22 @@
+#ifndef NETWORK_TIMER_H
+
+#define NETWORK_TIMER_H
+
+#include "network.h"
+
+#include <time.h>
+
+#define USEC 1000000LL // Microseconds per second
+#define MIN_RTO 10000 // Shortest retransmission timeout (us), also the smallest utimeout
+#define MAX_RTO (60 * USEC) // Longest retransmission timeout (us), reached by backoff
+#define MAX_TIMEOUT 255 // Largest timeout option, in seconds (RFC2349)
+
+long long now_us(void);
+int timer_wait(long long deadline);
+void set_timeout(struct session *s, long long timeout);
+void reset_timer(struct session *s);
+void backoff_timer(struct session *s);
+void rtt_arm(struct session *s, long long block);
+void rtt_sample(struct session *s);
+
+#endif /* end of include guard: NETWORK_TIMER_H */
@@ -0,0 +1,97 @@
+#include "pool.h"
+#include "network.h"
+
+/* Init an empty pool, slabs are allocated when needed
+ * Args:
+ *  - p: Pool to initialize
+ *  - name: Name printed with the counters
+ *  - size: Size of the objects
+ *  */
+void init_pool(struct pool *p, const char *name, size_t size)
+{
+    bzero(p, sizeof(*p));
+    p->name = name;
+
+    // Room for the link of the free list, objects stay aligned
+    if (size < sizeof(void*))
+        size = sizeof(void*);
+
+    p->size = (size + 15) & ~(size_t) 15;
+    p->per_slab = POOL_SLAB_SIZE / p->size > 0 ? POOL_SLAB_SIZE / p->size : 1;
+
+    if ((errno = pthread_mutex_init(&p->lock, NULL)) != 0)
+        error("pthread_mutex_init");
+}
+
+/* Get an object, recycled or carved from a new slab (its content is undefined)
+ * Args:
+ *  - p: Pool to get it from
+ * Return:
+ *  The object, to give back with pool_put()
+ *  */
+void *pool_get(struct pool *p)
+{
+    char *slab;
+    void *obj;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+
+    if (p->free == NULL) {
+        // Slabs are never freed: the memory stays for the next peak
+        if ((slab = aligned_alloc(16, p->per_slab * p->size)) == NULL)
+            error("pool_get");
+
+        for (i = p->per_slab - 1; i >= 0; i--) {
+            *(void**) (slab + i * p->size) = p->free;
+            p->free = slab + i * p->size;
+        }
+
+        p->slabs++;
+        p->total += p->per_slab;
+    }
+
+    obj = p->free;
+    p->free = *(void**) obj;
+
+    p->gets++;
+    p->used++;
+    if (p->used > p->peak)
+        p->peak = p->used;
+
+    pthread_mutex_unlock(&p->lock);
+
+    return obj;
+}
+
+/* Give back an object got with pool_get()
+ * Args:
+ *  - p: Pool it comes from
+ *  - obj: Object no longer used
+ *  */
+void pool_put(struct pool *p, void *obj)
+{
+    pthread_mutex_lock(&p->lock);
+
+    *(void**) obj = p->free;
+    p->free = obj;
+    p->used--;
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Print the occupancy of a pool
+ * Args:
+ *  - out: Where to print
+ *  - label: Owner of the pool (worker, writer)
+ *  - p: Pool to print
+ *  */
+void print_pool(FILE *out, const char *label, struct pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+
+    fprintf(out, "%-10s pool=%s size=%zu used=%lu peak=%lu total=%lu slabs=%lu gets=%lu\n",
+            label, p->name, p->size, p->used, p->peak, p->total, p->slabs, p->gets);
+
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,32 @@
+#ifndef POOL_H
+
+#define POOL_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+// Self-contained: the server and the writer embed pools
+
+#define POOL_SLAB_SIZE (1024 * 1024) // Memory carved into objects at once (at least one object)
+#define MTU_DGRAM_SIZE 1472 // Largest datagram fitting an Ethernet MTU over IPv4
+
+/* Objects of one size, carved from slabs and recycled instead of being freed */
+struct pool {
+    pthread_mutex_t lock; // Protects everything below
+    const char *name; // Name printed with the counters
+    size_t size; // Size of the objects
+    int per_slab; // Objects carved from each slab
+    void *free; // Objects given back, linked through their first bytes
+    unsigned long slabs; // Slabs allocated
+    unsigned long total; // Objects carved so far
+    unsigned long used; // Objects handed out and not given back
+    unsigned long peak; // Most objects handed out at once
+    unsigned long gets; // Objects asked
+};
+
+void init_pool(struct pool *p, const char *name, size_t size);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+void print_pool(FILE *out, const char *label, struct pool *p);
+
+#endif /* end of include guard: POOL_H */
@@ -0,0 +1,536 @@
+#include "rewrite.h"
+
+/* Load a rewrite table: one rule per line, "PATTERN file NAME" or "PATTERN template PATH"
+ * Blank lines and lines starting with '#' are skipped, a wrong line stops the server.
+ * Args:
+ *  - rw: Rewrite table to initialize
+ *  - table: File to read the rules from
+ *  */
+void init_rewrite(struct rewrite *rw, const char *table)
+{
+    char line[REWRITE_LINE], pattern[REWRITE_LINE], action[REWRITE_LINE], target[REWRITE_LINE], extra;
+    struct rewrite_rule *r, **last;
+    char *source;
+    int nb_line = 0;
+    FILE *f;
+
+    bzero(rw, sizeof(*rw));
+    last = &rw->rules;
+
+    if ((f = fopen(table, "r")) == NULL)
+        error("Cannot open the rewrite table");
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        nb_line++;
+
+        if (sscanf(line, "%s", pattern) != 1 || pattern[0] == '#')
+            continue;
+
+        if (sscanf(line, "%s %s %s %c", pattern, action, target, &extra) != 3
+                || (strcmp(action, "file") != 0 && strcmp(action, "template") != 0)) {
+            fprintf(stderr, "%s:%d: expected PATTERN file NAME or PATTERN template PATH\n", table, nb_line);
+            errno = 0;
+            error("Invalid rewrite table");
+        }
+
+        r = calloc(1, sizeof(struct rewrite_rule));
+        r->pattern = strdup(pattern);
+        r->action = strcmp(action, "file") == 0 ? REWRITE_FILE : REWRITE_TEMPLATE;
+        r->index = nb_line;
+
+        // Templates are read once, never while a client waits
+        if (r->action == REWRITE_FILE) {
+            source = strdup(target);
+        }
+        else if ((source = read_template(target)) == NULL) {
+            fprintf(stderr, "%s:%d: cannot read template '%s'\n", table, nb_line, target);
+            errno = 0;
+            error("Invalid rewrite table");
+        }
+
+        compile_tmpl(&r->target, source);
+
+        *last = r;
+        last = &r->next;
+        rw->nb_rules++;
+    }
+
+    fclose(f);
+}
+
+/* Split a text into the parts copied as is and the variables replaced on each request
+ * Args:
+ *  - t: Template to initialize
+ *  - source: Text, kept by the template (unknown ${...} are left as text)
+ *  */
+void compile_tmpl(struct tmpl *t, char *source)
+{
+    const char *names[VAR_CAPTURE] = {"ip", "hexip", "name"};
+    char *p, *end, *text;
+    int k, var;
+
+    t->source = source;
+    t->nb_parts = 0;
+    t->used = 0;
+
+    // At most a text and a variable for each '$', and the text after the last one
+    for (k = 1, p = source; (p = strchr(p, '$')) != NULL; p++)
+        k += 2;
+
+    t->parts = malloc(k * sizeof(struct tmpl_part));
+
+    for (p = text = source; (p = strstr(p, "${")) != NULL; ) {
+        var = -1;
+
+        if ((end = strchr(p + 2, '}')) != NULL) {
+            for (k = 0; k < VAR_CAPTURE; k++) {
+                if ((size_t) (end - p - 2) == strlen(names[k]) && strncmp(p + 2, names[k], end - p - 2) == 0)
+                    var = k;
+            }
+
+            if (end - p == 3 && p[2] >= '1' && p[2] <= '9')
+                var = VAR_CAPTURE + p[2] - '1';
+        }
+
+        if (var < 0) {
+            p += 2;
+            continue;
+        }
+
+        if (p > text) {
+            t->parts[t->nb_parts].var = -1;
+            t->parts[t->nb_parts].text = text;
+            t->parts[t->nb_parts++].len = p - text;
+        }
+
+        t->parts[t->nb_parts].var = var;
+        t->parts[t->nb_parts].text = NULL;
+        t->parts[t->nb_parts++].len = 0;
+        t->used |= 1u << var;
+
+        p = text = end + 1;
+    }
+
+    if (*text != '\0') {
+        t->parts[t->nb_parts].var = -1;
+        t->parts[t->nb_parts].text = text;
+        t->parts[t->nb_parts++].len = strlen(text);
+    }
+}
+
+/* Read a whole template file
+ * Args:
+ *  - path: File to read
+ * Return:
+ *  Its text, NUL terminated (to free), or NULL if it cannot be read
+ *  */
+char *read_template(const char *path)
+{
+    struct store_blob *b;
+    char *text;
+
+    if ((b = read_image(path)) == NULL)
+        return NULL;
+
+    if ((text = malloc(b->size + 1)) != NULL) {
+        memcpy(text, b->data, b->size);
+        text[b->size] = '\0';
+    }
+
+    free(b->data);
+    free(b);
+
+    return text;
+}
+
+/* Values of the variables for a request, before its name is matched
+ * Args:
+ *  - v: Values to set (the captures are empty until a pattern matches)
+ *  - peer: Address of the client
+ *  - name: Name asked
+ *  */
+void set_vars(struct rewrite_vars *v, const struct sockaddr_storage *peer, const char *name)
+{
+    const char *hex = "0123456789ABCDEF";
+    const unsigned char *addr;
+    int k, len;
+
+    if (peer->ss_family == AF_INET6) {
+        addr = (const unsigned char*) &((const struct sockaddr_in6*) peer)->sin6_addr;
+        len = 16;
+    }
+    else {
+        addr = (const unsigned char*) &((const struct sockaddr_in*) peer)->sin_addr;
+        len = 4;
+    }
+
+    inet_ntop(peer->ss_family, addr, v->ip, sizeof(v->ip));
+
+    for (k = 0; k < len; k++) {
+        v->hexip[2 * k] = hex[addr[k] >> 4];
+        v->hexip[2 * k + 1] = hex[addr[k] & 0xf];
+    }
+
+    v->hexip[2 * len] = '\0';
+
+    v->values[VAR_IP] = v->ip;
+    v->lens[VAR_IP] = strlen(v->ip);
+    v->values[VAR_HEXIP] = v->hexip;
+    v->lens[VAR_HEXIP] = 2 * len;
+    v->values[VAR_NAME] = name;
+    v->lens[VAR_NAME] = strlen(name);
+
+    for (k = VAR_CAPTURE; k < NB_VARS; k++) {
+        v->values[k] = "";
+        v->lens[k] = 0;
+    }
+}
+
+/* Match a name against a pattern, keeping what its stars matched
+ * Each star takes the shortest part letting the rest match, only the last star passed
+ * is ever given more of the name: linear in the name for each star, whatever the name.
+ * Args:
+ *  - pattern: Pattern of a rule ('*' any part, '?' any character)
+ *  - name: Name asked
+ *  - v: Values of the request, ${k} set for the stars of a matching pattern
+ * Return:
+ *  1 if the name matches, 0 otherwise
+ *  */
+int match_pattern(const char *pattern, const char *name, struct rewrite_vars *v)
+{
+    const char *starts[REWRITE_CAPTURES], *ends[REWRITE_CAPTURES];
+    const char *star = NULL; // Pattern following the last star passed (NULL if none yet)
+    const char *resume = NULL; // Where the part following the last star is tried in the name
+    int k = 0; // Stars passed
+
+    while (*name != '\0' || *pattern == '*') {
+        if (*pattern == '*') {
+            // The previous star keeps what it has: the next one can take anything more
+            if (k > 0 && k <= REWRITE_CAPTURES)
+                ends[k - 1] = resume;
+            if (k < REWRITE_CAPTURES)
+                starts[k] = name;
+
+            k++;
+            star = ++pattern;
+            resume = name;
+        }
+        else if (*pattern != '\0' && (*pattern == '?' || *pattern == *name)) {
+            pattern++;
+            name++;
+        }
+        else if (star != NULL && *resume != '\0') {
+            // The last star takes one more character
+            pattern = star;
+            name = ++resume;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    if (*pattern != '\0')
+        return 0;
+
+    if (k > 0 && k <= REWRITE_CAPTURES)
+        ends[k - 1] = resume;
+
+    for (k = k < REWRITE_CAPTURES ? k : REWRITE_CAPTURES; k > 0; k--) {
+        v->values[VAR_CAPTURE + k - 1] = starts[k - 1];
+        v->lens[VAR_CAPTURE + k - 1] = ends[k - 1] - starts[k - 1];
+    }
+
+    return 1;
+}
+
+/* Replace the variables of a template by their values
+ * Args:
+ *  - t: Template
+ *  - v: Values of the request
+ *  - out: Where to write the result (NULL to only get its size)
+ * Return:
+ *  Size of the result
+ *  */
+size_t render(struct tmpl *t, struct rewrite_vars *v, char *out)
+{
+    struct tmpl_part *part;
+    size_t size = 0, len;
+    int k;
+
+    for (k = 0; k < t->nb_parts; k++) {
+        part = &t->parts[k];
+        len = part->var < 0 ? part->len : v->lens[part->var];
+
+        if (out != NULL)
+            memcpy(out + size, part->var < 0 ? part->text : v->values[part->var], len);
+
+        size += len;
+    }
+
+    return size;
+}
+
+/* Key of the content a rule generates for a request: the values its template does not use
+ * are left out, so that every client getting the same content shares it
+ * Args:
+ *  - r: Rule of the template
+ *  - v: Values of the request
+ *  - len: Set to the size of the key
+ * Return:
+ *  The key (to free)
+ *  */
+char *rendered_key(struct rewrite_rule *r, struct rewrite_vars *v, size_t *len)
+{
+    size_t size = sizeof(r->index);
+    char *key;
+    int var;
+
+    for (var = 0; var < NB_VARS; var++) {
+        if (r->target.used & (1u << var))
+            size += v->lens[var] + 1;
+    }
+
+    key = malloc(size);
+    memcpy(key, &r->index, sizeof(r->index));
+    *len = sizeof(r->index);
+
+    // Separated by a NUL, which no name nor address holds
+    for (var = 0; var < NB_VARS; var++) {
+        if (r->target.used & (1u << var)) {
+            memcpy(key + *len, v->values[var], v->lens[var]);
+            *len += v->lens[var];
+            key[(*len)++] = '\0';
+        }
+    }
+
+    return key;
+}
+
+/* Find a content already generated (with the lock of the storage held)
+ * Args:
+ *  - rw: Rewrite table
+ *  - key: Key of the content
+ *  - len: Size of the key
+ *  - hash: Hash of the key
+ * Return:
+ *  The content kept, or NULL if not generated yet (or evicted)
+ *  */
+struct rendered *rendered_lookup(struct rewrite *rw, const char *key, size_t len, uint64_t hash)
+{
+    struct rendered *e;
+
+    for (e = rw->buckets[hash % REWRITE_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == hash && e->key_len == len && memcmp(e->key, key, len) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Move a content to the head of the LRU list (with the lock of the storage held)
+ * Args:
+ *  - rw: Rewrite table
+ *  - e: Content just used
+ *  */
+void rendered_touch(struct rewrite *rw, struct rendered *e)
+{
+    if (rw->lru_head == e)
+        return;
+
+    // Unlink it if already in the list
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    if (rw->lru_tail == e)
+        rw->lru_tail = e->lru_prev;
+
+    e->lru_prev = NULL;
+    e->lru_next = rw->lru_head;
+
+    if (rw->lru_head != NULL)
+        rw->lru_head->lru_prev = e;
+    rw->lru_head = e;
+
+    if (rw->lru_tail == NULL)
+        rw->lru_tail = e;
+}
+
+/* Drop the least recently used contents until the others fit the budget (with the lock of the storage held)
+ * A content still sent is freed by its last session.
+ * Args:
+ *  - st: Storage holding the rewrite table
+ *  */
+void rendered_evict(struct storage *st)
+{
+    struct rewrite *rw = st->rewrite;
+    struct rendered *e, **p;
+
+    while (rw->size > REWRITE_MEMO_SIZE && (e = rw->lru_tail) != NULL) {
+        for (p = &rw->buckets[e->hash % REWRITE_BUCKETS]; *p != e; p = &(*p)->next);
+        *p = e->next;
+
+        rw->lru_tail = e->lru_prev;
+
+        if (e->lru_prev != NULL)
+            e->lru_prev->lru_next = NULL;
+        else
+            rw->lru_head = NULL;
+
+        rw->size -= e->blob->size;
+        rw->entries--;
+        rw->evictions++;
+
+        blob_put(st, e->blob);
+        free(e->key);
+        free(e);
+    }
+}
+
+/* Content a template gives for a request, generated once for the values it uses
+ * Args:
+ *  - st: Storage holding the rewrite table
+ *  - r: Rule of the template
+ *  - v: Values of the request
+ * Return:
+ *  The content, with a reference for the session, or NULL if out of memory
+ *  */
+struct store_blob *rewrite_render(struct storage *st, struct rewrite_rule *r, struct rewrite_vars *v)
+{
+    struct rewrite *rw = st->rewrite;
+    struct store_blob *b = NULL;
+    struct rendered *e;
+    size_t key_len;
+    uint64_t hash;
+    char *key;
+
+    key = rendered_key(r, v, &key_len);
+    hash = hash_content(key, key_len);
+
+    pthread_mutex_lock(&st->lock);
+
+    if ((e = rendered_lookup(rw, key, key_len, hash)) != NULL) {
+        rendered_touch(rw, e);
+        b = e->blob;
+        b->refs++;
+        rw->hits++;
+    }
+
+    pthread_mutex_unlock(&st->lock);
+
+    // Kept by the reference of the session, even if evicted now
+    if (b != NULL) {
+        free(key);
+        return b;
+    }
+
+    // Generated out of the lock, the other workers go on meanwhile
+    b = calloc(1, sizeof(struct store_blob));
+    b->size = render(&r->target, v, NULL);
+    b->alloc = b->size > 0 ? b->size : 1;
+    b->refs = 1;
+
+    if ((b->data = malloc(b->alloc)) == NULL) {
+        free(key);
+        free(b);
+        return NULL;
+    }
+
+    render(&r->target, v, b->data);
+
+    pthread_mutex_lock(&st->lock);
+    rw->renders++;
+
+    // Unless another worker generated it meanwhile: this copy is then only the session's
+    if (b->size <= REWRITE_MEMO_SIZE && rendered_lookup(rw, key, key_len, hash) == NULL) {
+        e = calloc(1, sizeof(struct rendered));
+        e->key = key;
+        e->key_len = key_len;
+        e->hash = hash;
+        e->blob = b;
+        b->refs++;
+
+        e->next = rw->buckets[hash % REWRITE_BUCKETS];
+        rw->buckets[hash % REWRITE_BUCKETS] = e;
+        rendered_touch(rw, e);
+
+        rw->size += b->size;
+        rw->entries++;
+        key = NULL;
+
+        rendered_evict(st);
+    }
+
+    pthread_mutex_unlock(&st->lock);
+
+    free(key);
+
+    return b;
+}
+
+/* Apply the rewrite table to the name asked by a request
+ * Args:
+ *  - st: Storage holding the rewrite table
+ *  - s: Session of the request, sent a generated content from memory
+ *  - name: Name asked
+ *  - path: Set to the file to open instead
+ *  - size: Size of path
+ * Return:
+ *  - 0: No rule matches, the name is opened as asked
+ *  - 1: Another file is opened, path set
+ *  - 2: Content generated for the client, the session sends it
+ *  - -1: Refused (name longer than REWRITE_NAME_MAX, template asked by a WRQ, path too long or out of memory)
+ *  */
+int rewrite_request(struct storage *st, struct session *s, const char *name, char *path, size_t size)
+{
+    struct rewrite_vars v;
+    struct rewrite_rule *r;
+
+    // Matched against every rule: bounded whatever the client sends
+    if (strlen(name) > REWRITE_NAME_MAX)
+        return -1;
+
+    set_vars(&v, &s->peer, name);
+
+    for (r = st->rewrite->rules; r != NULL && !match_pattern(r->pattern, name, &v); r = r->next);
+
+    if (r == NULL)
+        return 0;
+
+    switch (r->action) {
+        case REWRITE_FILE:
+            if (render(&r->target, &v, NULL) >= size)
+                return -1;
+
+            path[render(&r->target, &v, path)] = '\0';
+            __atomic_fetch_add(&st->rewrite->rewritten, 1, __ATOMIC_RELAXED);
+            return 1;
+
+        case REWRITE_TEMPLATE:
+            if (s->type != RRQ || (s->blob = rewrite_render(st, r, &v)) == NULL)
+                return -1;
+
+            s->map = s->blob->data;
+            s->map_size = s->blob->size;
+            return 2;
+    }
+
+    return 0;
+}
+
+/* Print the counters of the rewrite table
+ * Args:
+ *  - out: Where to print
+ *  - st: Storage holding the rewrite table
+ *  */
+void print_rewrite(FILE *out, struct storage *st)
+{
+    struct rewrite *rw = st->rewrite;
+
+    pthread_mutex_lock(&st->lock);
+
+    fprintf(out, "%-10s rules=%d rewritten=%lu renders=%lu hits=%lu entries=%lu size=%zu evictions=%lu\n", "rewrite",
+            rw->nb_rules, __atomic_load_n(&rw->rewritten, __ATOMIC_RELAXED), rw->renders, rw->hits, rw->entries, rw->size, rw->evictions);
+
+    pthread_mutex_unlock(&st->lock);
+}
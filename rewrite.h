@@ -0,0 +1,102 @@
+#ifndef REWRITE_H
+
+#define REWRITE_H
+
+#include <stdint.h>
+
+#include "network.h"
+
+#define REWRITE_BUCKETS 1024 // Size of the hash table of the generated files
+#define REWRITE_MEMO_SIZE (16 * 1024 * 1024) // Memory budget of the generated files kept for the next requests
+#define REWRITE_CAPTURES 9 // Parts of a name matched by the '*' of a pattern, ${1} to ${9}
+#define REWRITE_LINE 1024 // Longest line of a rewrite table
+#define REWRITE_NAME_MAX 255 // Longest name the table is applied to, longer ones are refused
+
+/* Values a template or a rewritten name can use */
+enum rewrite_var {
+    VAR_IP, // ${ip}: address of the client (192.0.2.1, 2001:db8::1)
+    VAR_HEXIP, // ${hexip}: same in uppercase hexadecimal, as PXELINUX asks it (C0000201)
+    VAR_NAME, // ${name}: name asked
+    VAR_CAPTURE, // ${1} to ${9}: what the stars of the pattern matched, in order
+    NB_VARS = VAR_CAPTURE + REWRITE_CAPTURES
+};
+
+/* What a rule does with the names it matches */
+enum rewrite_action {
+    REWRITE_FILE, // Send (or write) another file
+    REWRITE_TEMPLATE // Send a content generated for the client (RRQ only)
+};
+
+/* Piece of a template: text copied as is, or a variable replaced by its value */
+struct tmpl_part {
+    int var; // Variable (enum rewrite_var, VAR_CAPTURE + k - 1 for ${k}), -1 for text
+    const char *text; // Text, into the source of the template
+    size_t len; // Size of the text
+};
+
+/* Text with variables, split once when the table is loaded */
+struct tmpl {
+    char *source; // Whole text
+    struct tmpl_part *parts; // Pieces, in order
+    int nb_parts; // Number of pieces
+    unsigned int used; // Variables used (bit 1 << var): what the content generated depends on
+};
+
+/* Line of the rewrite table */
+struct rewrite_rule {
+    char *pattern; // Names matched: '*' any characters (captured), '?' one, the others as is
+    enum rewrite_action action; // What is done with them
+    struct tmpl target; // Name of the other file, or template of the content
+    int index; // Line in the table, part of the key of its generated files
+    struct rewrite_rule *next; // Rule tried if this one does not match
+};
+
+/* Values of the variables for one request */
+struct rewrite_vars {
+    const char *values[NB_VARS]; // Value of each variable (not NUL terminated)
+    size_t lens[NB_VARS]; // Its size
+    char ip[INET6_ADDRSTRLEN]; // ${ip}
+    char hexip[33]; // ${hexip}
+};
+
+/* Content generated from a template for some values of its variables */
+struct rendered {
+    char *key; // Rule, then the values of the variables its template uses
+    size_t key_len; // Size of the key
+    uint64_t hash; // Hash of the key
+    struct store_blob *blob; // Content, one reference held while kept
+    struct rendered *next; // Next content in the same bucket
+    struct rendered *lru_prev; // Most recently used neighbour
+    struct rendered *lru_next; // Least recently used neighbour
+};
+
+/* Names mapped to other files or generated per client, shared by all the workers */
+struct rewrite {
+    struct rewrite_rule *rules; // In the order of the table, the first one matching a name applies
+    int nb_rules; // Number of rules
+    struct rendered *buckets[REWRITE_BUCKETS]; // Contents generated, by hash of their key (lock of the storage)
+    struct rendered *lru_head; // Most recently used content
+    struct rendered *lru_tail; // Least recently used content, evicted first
+    size_t size; // Memory used by the contents kept
+    unsigned long entries; // Contents kept
+    unsigned long rewritten; // Requests sent to another file
+    unsigned long renders; // Contents generated
+    unsigned long hits; // Requests served with a content already generated
+    unsigned long evictions; // Contents dropped to stay in budget
+};
+
+void init_rewrite(struct rewrite *rw, const char *table);
+void compile_tmpl(struct tmpl *t, char *source);
+char *read_template(const char *path);
+void set_vars(struct rewrite_vars *v, const struct sockaddr_storage *peer, const char *name);
+int match_pattern(const char *pattern, const char *name, struct rewrite_vars *v);
+size_t render(struct tmpl *t, struct rewrite_vars *v, char *out);
+char *rendered_key(struct rewrite_rule *r, struct rewrite_vars *v, size_t *len);
+struct rendered *rendered_lookup(struct rewrite *rw, const char *key, size_t len, uint64_t hash);
+void rendered_touch(struct rewrite *rw, struct rendered *e);
+void rendered_evict(struct storage *st);
+struct store_blob *rewrite_render(struct storage *st, struct rewrite_rule *r, struct rewrite_vars *v);
+int rewrite_request(struct storage *st, struct session *s, const char *name, char *path, size_t size);
+void print_rewrite(FILE *out, struct storage *st);
+
+#endif /* end of include guard: REWRITE_H */
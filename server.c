@@ -0,0 +1,676 @@
+#include "server.h"
+
+#include <sys/resource.h>
+
+/* Init the event loop of the server
+ * Args:
+ *  - srv: Server to initialize
+ *  - fd: IPv4 listening socket's file descriptor
+ *  - fd6: IPv6 listening socket's file descriptor (-1 if none)
+ *  - conf: Tunables of the server
+ *  */
+void init_server(struct server *srv, int fd, int fd6, const struct server_conf *conf)
+{
+    struct epoll_event ev;
+    struct rlimit rl;
+    int i;
+
+    bzero(srv, sizeof(*srv));
+    srv->fds[0] = fd;
+    srv->fds[1] = fd6;
+    srv->conf = conf;
+
+    srv->sessions = calloc(conf->max_sessions, sizeof(struct session*));
+
+    init_batch(&srv->in, conf->batch);
+    init_batch(&srv->out, conf->batch);
+
+    // A session, the buffer of its OACK and the name of its file in one object
+    init_pool(&srv->session_pool, "sessions", sizeof(struct session) + DEFAULT_BLK_SIZE + FILENAME_SIZE);
+
+    // Each session needs a socket and a file
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t) conf->max_sessions * 2 + 16) {
+        rl.rlim_cur = (rlim_t) conf->max_sessions * 2 + 16;
+
+        if (rl.rlim_cur > rl.rlim_max)
+            rl.rlim_cur = rl.rlim_max;
+
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if ((srv->epfd = epoll_create1(0)) < 0)
+        error("epoll_create1");
+
+    // Both families in the same loop, the listening sockets point to their descriptor instead of a session
+    for (i = 0; i < 2; i++) {
+        if (srv->fds[i] < 0)
+            continue;
+
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &srv->fds[i];
+
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->fds[i], &ev) < 0)
+            error("epoll_ctl(listening socket)");
+    }
+
+    if ((srv->done.efd = eventfd(0, EFD_NONBLOCK)) < 0)
+        error("eventfd");
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &srv->done;
+
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->done.efd, &ev) < 0)
+        error("epoll_ctl(eventfd)");
+}
+
+/* Open a session for a new request
+ * Args:
+ *  - srv: Server handling the request
+ *  - peer: Address of the client
+ * Return:
+ *  The new session, or NULL if the server cannot handle more transfers
+ *  */
+struct session *new_session(struct server *srv, struct sockaddr_storage *peer)
+{
+    struct session *s;
+    struct epoll_event ev;
+
+    if (srv->nb_sessions >= srv->conf->max_sessions)
+        return NULL;
+
+    s = pool_get(&srv->session_pool);
+    bzero(s, sizeof(struct session));
+    s->buffer = (char*) (s + 1);
+    s->filename = s->buffer + DEFAULT_BLK_SIZE;
+    s->filename[0] = '\0';
+
+    if (init_session_conn(s, peer) < 0) {
+        pool_put(&srv->session_pool, s);
+        return NULL;
+    }
+
+    s->retry = DEFAULT_RETRY;
+    set_timeout(s, DEFAULT_TIMEOUT * USEC);
+    s->buffer_size = DEFAULT_BLK_SIZE;
+    s->windowsize = DEFAULT_WINDOWSIZE;
+    s->rollover = srv->conf->rollover;
+    s->final_size = -1;
+    s->batch = &srv->out;
+    s->commits = &srv->done;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, s->conn.fd, &ev) < 0) {
+        close(s->conn.fd);
+        pool_put(&srv->session_pool, s);
+        return NULL;
+    }
+
+    s->conn.stats = &srv->stats;
+    STAT_ADD(&srv->stats, active, 1);
+
+    // No deadline yet, handle_rq() sets it
+    s->slot = srv->nb_sessions;
+    srv->sessions[srv->nb_sessions++] = s;
+    timer_update(srv, s);
+
+    return s;
+}
+
+/* Close a session and release all its resources
+ * Args:
+ *  - srv: Server owning the session
+ *  - s: Session to close
+ *  */
+void free_session(struct server *srv, struct session *s)
+{
+    struct session *last;
+
+    // Closing the socket also removes it from epoll
+    close(s->conn.fd);
+
+    // Before its file is released: the bytes of a RRQ are counted from its size
+    if (srv->log != NULL)
+        log_session(srv->log, s);
+
+    store_close(srv->store, s);
+
+    if (s->client != NULL)
+        admit_release(srv->admit, s->client);
+
+    STAT_ADD(&srv->stats, active, -1);
+
+    if (s->group != NULL)
+        mcast_close(srv, s);
+
+    // Refused requests are not transfers, nor the clients joining a multicast one
+    if (s->start > 0 && s->end != END_JOINED)
+        observe_duration(&srv->stats, now_us() - s->start);
+
+    // Keep the heap packed, the last session takes the slot
+    last = srv->sessions[--srv->nb_sessions];
+
+    if (last != s) {
+        srv->sessions[s->slot] = last;
+        last->slot = s->slot;
+        timer_update(srv, last);
+    }
+
+    pool_put(&srv->session_pool, s);
+}
+
+/* Swap two sessions of the heap of deadlines
+ * Args:
+ *  - srv: Server owning the sessions
+ *  - i: Slot of the first session
+ *  - j: Slot of the second session
+ *  */
+void heap_swap(struct server *srv, int i, int j)
+{
+    struct session *tmp;
+
+    tmp = srv->sessions[i];
+    srv->sessions[i] = srv->sessions[j];
+    srv->sessions[j] = tmp;
+
+    srv->sessions[i]->slot = i;
+    srv->sessions[j]->slot = j;
+}
+
+/* Move a session whose deadline changed to its place in the heap,
+ * so that sessions[0] is always the next one to time out
+ * Args:
+ *  - srv: Server owning the session
+ *  - s: Session to move
+ *  */
+void timer_update(struct server *srv, struct session *s)
+{
+    int i, child;
+
+    // Earlier than its parent: go up
+    for (i = s->slot; i > 0 && srv->sessions[(i - 1) / 2]->deadline > s->deadline; i = (i - 1) / 2)
+        heap_swap(srv, i, (i - 1) / 2);
+
+    // Later than one of its children: go down
+    while ((child = 2 * i + 1) < srv->nb_sessions) {
+        if (child + 1 < srv->nb_sessions && srv->sessions[child + 1]->deadline < srv->sessions[child]->deadline)
+            child++;
+
+        if (srv->sessions[child]->deadline >= s->deadline)
+            break;
+
+        heap_swap(srv, i, child);
+        i = child;
+    }
+}
+
+/* Refuse a request from the well-known port, without opening anything for it
+ * Args:
+ *  - srv: Server receiving the request
+ *  - fd: Listening socket it came on
+ *  - peer: Address of the client
+ *  - code: ERROR code sent
+ *  - msg: ERROR message sent
+ *  */
+void refuse_rq(struct server *srv, int fd, struct sockaddr_storage *peer, int code, char *msg)
+{
+    struct conn_info conn;
+
+    bzero(&conn, sizeof(conn));
+    conn.fd = fd;
+    conn.sock = (struct sockaddr*) peer;
+    conn.addr_len = addr_size(peer);
+    conn.stats = &srv->stats;
+
+    send_error(conn, code, msg);
+    STAT_ADD(&srv->stats, refused, 1);
+
+    if (srv->log != NULL)
+        log_refused(srv->log, peer, code, msg);
+}
+
+/* Handle a request received on the listening socket: admit it, queue it or refuse it
+ * Args:
+ *  - srv: Server receiving the request
+ *  - fd: Listening socket it came on
+ *  - buffer: Buffer with the request
+ *  - n: Number of bytes received
+ *  - peer: Address of the client
+ *  */
+void accept_rq(struct server *srv, int fd, char *buffer, int n, struct sockaddr_storage *peer)
+{
+    struct admit_client *client = NULL;
+
+    if (n < 2 || buffer[0] != 0 || (buffer[1] != RRQ && buffer[1] != WRQ)) {
+        refuse_rq(srv, fd, peer, 4, "Illegal TFTP operation");
+        return;
+    }
+
+    // Decided from the address only: a refusal opens no socket and no file
+    if (srv->admit != NULL) {
+        switch (admit_request(srv->admit, peer, srv->nb_sessions >= srv->conf->max_sessions, buffer, n, &client)) {
+            case ADMIT_OK:
+                break;
+            case ADMIT_QUEUED:
+                return;
+            case ADMIT_BUSY:
+                refuse_rq(srv, fd, peer, 0, "Server busy");
+                return;
+            case ADMIT_CLIENT_BUSY:
+                refuse_rq(srv, fd, peer, 0, "Too many transfers from this address");
+                return;
+        }
+    }
+
+    open_rq(srv, fd, buffer, n, peer, client);
+}
+
+/* Open the session of a request admitted
+ * Args:
+ *  - srv: Server handling the request
+ *  - fd: Listening socket it came on (refusals are sent from the well-known port)
+ *  - buffer: Buffer with the request
+ *  - n: Number of bytes received
+ *  - peer: Address of the client
+ *  - client: Address counted by the admission control, released with the session (NULL if none)
+ *  */
+void open_rq(struct server *srv, int fd, char *buffer, int n, struct sockaddr_storage *peer, struct admit_client *client)
+{
+    struct session *s;
+
+    if ((s = new_session(srv, peer)) == NULL) {
+        if (client != NULL)
+            admit_release(srv->admit, client);
+
+        refuse_rq(srv, fd, peer, 0, "Server busy");
+        return;
+    }
+
+    if (client != NULL) {
+        s->client = client;
+        init_bucket(&s->pace, srv->conf->session_rate);
+    }
+
+    // Logged as refused when freed
+    if (handle_rq(s, buffer, n, srv->conf, srv->store) < 0) {
+        free_session(srv, s);
+        STAT_ADD(&srv->stats, refused, 1);
+        return;
+    }
+
+    s->start = now_us();
+
+    // Multicast asked: the client joins a group, or its session sends to a new one
+    if (s->options[OPT_MULTICAST] != -1 && mcast_request(srv, s)) {
+        STAT_ADD(&srv->stats, rrq, 1);
+        free_session(srv, s);
+        return;
+    }
+
+    // Its answer could not be sent to the client
+    if (s->end == END_SEND_FAILED) {
+        free_session(srv, s);
+        return;
+    }
+
+    timer_update(srv, s);
+
+    if (s->type == RRQ)
+        STAT_ADD(&srv->stats, rrq, 1);
+    else
+        STAT_ADD(&srv->stats, wrq, 1);
+}
+
+/* Start the requests waiting for a transfer to end, as long as this worker has room for them
+ * Args:
+ *  - srv: Server with sessions free
+ *  */
+void drain_queue(struct server *srv)
+{
+    struct admit_rq *q;
+
+    while (srv->nb_sessions < srv->conf->max_sessions && __atomic_load_n(&srv->admit->nb_queued, __ATOMIC_RELAXED) > 0
+            && (q = admit_next(srv->admit)) != NULL) {
+        // Any worker can answer from the well-known port of the request's family
+        open_rq(srv, srv->fds[q->peer.ss_family == AF_INET6], q->dgram, q->len, &q->peer, q->client);
+        free(q);
+    }
+}
+
+/* Send the last ACK (or an ERROR) of the uploads the writer threads put in place, and end their sessions
+ * Args:
+ *  - srv: Server woken up by the writer threads
+ *  */
+void handle_commits(struct server *srv)
+{
+    struct writer *wr = srv->store->writer;
+    struct write_file *f, *next;
+    uint64_t count;
+
+    if (read(srv->done.efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        error("read(eventfd)");
+
+    pthread_mutex_lock(&wr->lock);
+    f = srv->done.head;
+    srv->done.head = NULL;
+    pthread_mutex_unlock(&wr->lock);
+
+    // The session holds the file until it is freed
+    for (; f != NULL; f = next) {
+        next = f->next_done;
+        end_commit(f->session, f->error);
+        free_session(srv, f->session);
+    }
+}
+
+/* Main function of a worker. Accept requests, and drive all its transfers concurrently
+ * Args:
+ *  - arg: Server (worker) to run
+ * */
+void *serve(void *arg)
+{
+    struct server *srv = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct sockaddr_storage *src;
+    struct conn_info conn;
+    struct session *s;
+    long long now;
+    int i, k, nb, nfds, fd;
+
+    while (1) {
+        // Sleep until a datagram comes, or until the earliest deadline
+        nfds = epoll_wait(srv->epfd, events, MAX_EVENTS, srv->nb_sessions > 0 ? timer_wait(srv->sessions[0]->deadline) : -1);
+
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+
+            error("epoll_wait");
+        }
+
+        for (i = 0; i < nfds; i++) {
+            s = events[i].data.ptr;
+            fd = -1;
+
+            if (s == (void*) &srv->done) {
+                handle_commits(srv);
+                continue;
+            }
+
+            // A listening socket, not a session
+            if (s == (void*) &srv->fds[0] || s == (void*) &srv->fds[1]) {
+                fd = *(int*) events[i].data.ptr;
+                s = NULL;
+            }
+
+            // Take every datagram already queued on the socket at once
+            nb = recv_batch(s == NULL ? fd : s->conn.fd, &srv->in, MSG_DONTWAIT, &srv->stats);
+
+            for (k = 0; k < nb; k++) {
+                src = &srv->in.addrs[k];
+
+                if (s == NULL) {
+                    accept_rq(srv, fd, BATCH_DGRAM(&srv->in, k), BATCH_LEN(&srv->in, k), src);
+                    continue;
+                }
+
+                // Every client of a multicast group talks to its TID
+                if (s->group != NULL) {
+                    if (mcast_dgram(s, BATCH_DGRAM(&srv->in, k), BATCH_LEN(&srv->in, k), src)) {
+                        free_session(srv, s);
+                        s = NULL;
+                        break;
+                    }
+
+                    continue;
+                }
+
+                // Datagram from someone else than our peer (RFC1350)
+                if (!addr_equal(src, &s->peer)) {
+                    bzero(&conn, sizeof(conn));
+                    conn.fd = s->conn.fd;
+                    conn.sock = (struct sockaddr*) src;
+                    conn.addr_len = addr_size(src);
+                    conn.stats = &srv->stats;
+
+                    send_error(conn, 5, "Unknown transfer ID");
+
+                    if (srv->log != NULL)
+                        log_refused(srv->log, src, 5, "Unknown transfer ID");
+                    continue;
+                }
+
+                if (handle_session(s, BATCH_DGRAM(&srv->in, k), BATCH_LEN(&srv->in, k), srv->store)) {
+                    free_session(srv, s);
+                    s = NULL;
+                    break;
+                }
+            }
+
+            // Progress pushed its deadline back
+            if (s != NULL)
+                timer_update(srv, s);
+        }
+
+        // Only the sessions at the top of the heap may have timed out
+        now = now_us();
+
+        while (srv->nb_sessions > 0 && srv->sessions[0]->deadline <= now) {
+            s = srv->sessions[0];
+
+            if (session_timeout(s))
+                free_session(srv, s);
+            else
+                timer_update(srv, s);
+        }
+
+        // Transfers ended: the requests waiting take their place
+        if (srv->admit != NULL) {
+            drain_queue(srv);
+            admit_sweep(srv->admit);
+        }
+    }
+}
+
+/* Print one line of counters
+ * Args:
+ *  - out: Where to print
+ *  - label: Name of the line
+ *  - st: Counters to print
+ *  */
+void print_counters(FILE *out, const char *label, struct server_stats *st)
+{
+    double mb;
+
+    mb = (STAT_GET(st, bytes_in) + STAT_GET(st, bytes_out)) / 1048576.0;
+
+    fprintf(out, "%-10s active=%lu rrq=%lu wrq=%lu refused=%lu timeouts=%lu aborted=%lu"
+            " retransmits=%lu send_errors=%lu mcast_joins=%lu paced=%lu pkts_in=%lu bytes_in=%lu pkts_out=%lu bytes_out=%lu syscalls=%lu syscalls_per_mb=%.1f\n", label,
+            STAT_GET(st, active), STAT_GET(st, rrq), STAT_GET(st, wrq),
+            STAT_GET(st, refused), STAT_GET(st, timeouts), STAT_GET(st, aborted), STAT_GET(st, retransmits), STAT_GET(st, send_errors), STAT_GET(st, mcast_joins), STAT_GET(st, paced),
+            STAT_GET(st, pkts_in), STAT_GET(st, bytes_in),
+            STAT_GET(st, pkts_out), STAT_GET(st, bytes_out),
+            STAT_GET(st, syscalls), mb > 0 ? STAT_GET(st, syscalls) / mb : 0);
+}
+
+/* Print the counters of each worker, and their sum
+ * Args:
+ *  - workers: Array of workers
+ *  - nb_workers: Number of workers
+ *  - out: Where to print
+ *  */
+void print_stats(struct server *workers, int nb_workers, FILE *out)
+{
+    struct server_stats total;
+    struct server_stats *st;
+    char label[16];
+    int i;
+
+    bzero(&total, sizeof(total));
+
+    for (i = 0; i < nb_workers; i++) {
+        st = &workers[i].stats;
+
+        snprintf(label, sizeof(label), "worker %d", workers[i].id);
+        print_counters(out, label, st);
+        print_pool(out, label, &workers[i].session_pool);
+
+        total.active += STAT_GET(st, active);
+        total.rrq += STAT_GET(st, rrq);
+        total.wrq += STAT_GET(st, wrq);
+        total.refused += STAT_GET(st, refused);
+        total.timeouts += STAT_GET(st, timeouts);
+        total.aborted += STAT_GET(st, aborted);
+        total.retransmits += STAT_GET(st, retransmits);
+        total.send_errors += STAT_GET(st, send_errors);
+        total.mcast_joins += STAT_GET(st, mcast_joins);
+        total.paced += STAT_GET(st, paced);
+        total.pkts_in += STAT_GET(st, pkts_in);
+        total.bytes_in += STAT_GET(st, bytes_in);
+        total.pkts_out += STAT_GET(st, pkts_out);
+        total.bytes_out += STAT_GET(st, bytes_out);
+        total.syscalls += STAT_GET(st, syscalls);
+    }
+
+    print_counters(out, "total", &total);
+}
+
+/* Start the workers, each with its own listening socket
+ * Args:
+ *  - server_port: Port to bind (0 for any free port, the same for every worker)
+ *  - conf: Tunables of the server
+ *  - cache: File cache shared by the workers, initialized here
+ *  - wr: Writer threads shared by the workers, started here (if conf->writers > 0)
+ *  - store: Storage shared by the workers, initialized here (images loaded for the memory stores, rewrite table read)
+ *  - log: Access log shared by the workers, started here (if conf->access_log is set)
+ *  - adm: Admission control shared by the workers, initialized here (if any limit is set)
+ * Return:
+ *  The workers, running
+ *  */
+struct server *start_workers(int server_port, const struct server_conf *conf, struct file_cache *cache, struct writer *wr, struct storage *store, struct access_log *log, struct admission *adm)
+{
+    struct server *workers;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int i, fd;
+
+    workers = aligned_alloc(64, conf->workers * sizeof(struct server));
+
+    init_cache(cache, conf->cache_size, conf->dgram_cache_size);
+
+    if (conf->writers > 0)
+        init_writer(wr, conf->writers, conf->max_inflight, conf->fsync);
+
+    init_storage(store, conf->storage, conf->cache_size > 0 ? cache : NULL, conf->writers > 0 ? wr : NULL, conf->fsync, conf->max_upload);
+
+    if (conf->rewrite != NULL) {
+        store->rewrite = malloc(sizeof(struct rewrite));
+        init_rewrite(store->rewrite, conf->rewrite);
+    }
+
+    if (conf->access_log != NULL)
+        init_access_log(log, conf);
+
+    if (admit_enabled(conf))
+        init_admission(adm, conf);
+
+    for (i = 0; i < conf->workers; i++) {
+        fd = init_server_conn(AF_INET, server_port, conf->workers > 1);
+
+        // The other workers, and IPv6, join the port the kernel chose for the first one
+        addr_len = sizeof(addr);
+        if (server_port == 0 && getsockname(fd, (struct sockaddr*) &addr, &addr_len) == 0)
+            server_port = addr_port(&addr);
+
+        init_server(&workers[i], fd, init_server_conn(AF_INET6, server_port, conf->workers > 1), conf);
+        workers[i].id = i;
+        workers[i].store = store;
+        workers[i].log = conf->access_log != NULL ? log : NULL;
+        workers[i].admit = admit_enabled(conf) ? adm : NULL;
+    }
+
+    for (i = 0; i < conf->workers; i++) {
+        if ((errno = pthread_create(&workers[i].thread, NULL, serve, &workers[i])) != 0)
+            error("pthread_create");
+    }
+
+    return workers;
+}
+
+/* Start the workers, then wait for signals:
+ * SIGUSR1 prints the counters (workers, file cache, storage, admission and writer), SIGUSR2 dumps the trace,
+ * SIGINT/SIGTERM print the counters, wait for the uploads to be written and stop the server
+ * Args:
+ *  - server_port: Port to bind
+ *  - conf: Tunables of the server
+ *  */
+void run_server(int server_port, const struct server_conf *conf)
+{
+    struct server *workers;
+    struct file_cache cache;
+    struct metrics metrics;
+    struct access_log log;
+    struct admission adm;
+    struct storage store;
+    struct writer wr;
+    sigset_t set;
+    int sig;
+
+    // Workers inherit the mask, only this thread gets the signals
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        error("pthread_sigmask");
+
+    workers = start_workers(server_port, conf, &cache, &wr, &store, &log, &adm);
+
+    if (conf->metrics != NULL)
+        start_metrics(&metrics, conf->metrics, workers, conf->workers, &cache, conf->writers > 0 ? &wr : NULL);
+
+    while (1) {
+        if (sigwait(&set, &sig) != 0)
+            continue;
+
+        if (sig == SIGUSR2) {
+            trace_save();
+            continue;
+        }
+
+        print_stats(workers, conf->workers, stderr);
+        print_cache(stderr, &cache);
+        print_storage(stderr, &store);
+
+        if (store.rewrite != NULL)
+            print_rewrite(stderr, &store);
+
+        if (admit_enabled(conf))
+            print_admission(stderr, &adm);
+
+        if (conf->writers > 0)
+            print_writer(stderr, &wr);
+
+        if (conf->access_log != NULL)
+            print_access_log(stderr, &log);
+
+        if (sig != SIGUSR1)
+            break;
+    }
+
+    // Uploads already acknowledged must reach the file
+    if (conf->writers > 0)
+        drain_writer(&wr);
+
+    // Sessions still running are not logged
+    if (conf->access_log != NULL)
+        drain_access_log(&log);
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,52 @@
+#ifndef SERVER_H
+
+#define SERVER_H
+
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "network.h"
+
+#define DEFAULT_MAX_SESSIONS 1024 // Concurrent transfers allowed by default
+#define DEFAULT_WORKERS 1 // Threads running an event loop
+#define MAX_EVENTS 64 // Events handled per epoll_wait()
+#define DEFAULT_READAHEAD 4 // Windows of a file read ahead of the one sent by default
+
+/* Event loop driving every transfer of the server (one per worker) */
+struct server {
+    struct server_stats stats; // Counters of this worker
+    int id; // Worker's number
+    pthread_t thread; // Thread running the event loop
+    int fds[2]; // Listening sockets on the well-known port: IPv4, then IPv6 (-1 if the host has none)
+    int epfd; // epoll instance watching the listening and TID sockets
+    const struct server_conf *conf; // Tunables
+    struct storage *store; // Where all the workers read the files and write the uploads
+    struct access_log *log; // Access log shared by the workers (NULL if disabled)
+    struct admission *admit; // Limits on the transfers shared by the workers (NULL if none)
+    struct session **sessions; // Running sessions, a heap on their deadline (earliest first)
+    int nb_sessions; // Number of running sessions
+    struct dgram_batch in; // Datagrams received, shared by all sessions
+    struct dgram_batch out; // DATA to send, shared by all sessions
+    struct pool session_pool; // Sessions (with their OACK buffer), recycled
+    struct mcast_group *groups; // Multicast transfers running
+    struct write_done done; // Uploads put in place by the writer threads, whose last ACK is to send
+};
+
+void init_server(struct server *srv, int fd, int fd6, const struct server_conf *conf);
+struct session *new_session(struct server *srv, struct sockaddr_storage *peer);
+void free_session(struct server *srv, struct session *s);
+void heap_swap(struct server *srv, int i, int j);
+void timer_update(struct server *srv, struct session *s);
+void refuse_rq(struct server *srv, int fd, struct sockaddr_storage *peer, int code, char *msg);
+void accept_rq(struct server *srv, int fd, char *buffer, int n, struct sockaddr_storage *peer);
+void open_rq(struct server *srv, int fd, char *buffer, int n, struct sockaddr_storage *peer, struct admit_client *client);
+void drain_queue(struct server *srv);
+void handle_commits(struct server *srv);
+void *serve(void *arg);
+void print_counters(FILE *out, const char *label, struct server_stats *st);
+void print_stats(struct server *workers, int nb_workers, FILE *out);
+struct server *start_workers(int server_port, const struct server_conf *conf, struct file_cache *cache, struct writer *wr, struct storage *store, struct access_log *log, struct admission *adm);
+void run_server(int server_port, const struct server_conf *conf);
+
+#endif /* end of include guard: SERVER_H */
@@ -0,0 +1,650 @@
+#include "storage.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+
+unsigned long store_next_temp = 0;
+
+/* Init the storage of the server, and load the images of the current directory for the memory stores
+ * Args:
+ *  - st: Storage to initialize
+ *  - kind: Backend
+ *  - cache: File cache (filesystem, NULL if disabled)
+ *  - wr: Writer threads (filesystem, NULL if disabled)
+ *  - policy: When the uploads written by the workers are flushed (filesystem)
+ *  - max_upload: Largest upload kept in memory, in bytes (image stores)
+ *  */
+void init_storage(struct storage *st, enum storage_kind kind, struct file_cache *cache, struct writer *wr, enum fsync_policy policy, size_t max_upload)
+{
+    bzero(st, sizeof(*st));
+    st->kind = kind;
+    st->cache = cache;
+    st->writer = wr;
+    st->fsync = policy;
+    st->max_upload = max_upload;
+
+    if ((errno = pthread_mutex_init(&st->lock, NULL)) != 0)
+        error("pthread_mutex_init");
+
+    // Every path is resolved now, never while a transfer waits
+    if (kind != STORE_FS)
+        store_load(st, ".");
+}
+
+/* Hash some bytes (64 bits FNV-1a): digest of a content, or bucket of a path
+ * Args:
+ *  - data: Bytes to hash
+ *  - size: Number of bytes
+ * Return:
+ *  Hash of the bytes
+ *  */
+uint64_t hash_content(const char *data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        h = (h ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+/* Find a path in an image store (with the lock held)
+ * Args:
+ *  - st: Store to search
+ *  - path: Name asked
+ * Return:
+ *  Its entry, or NULL if not in the store
+ *  */
+struct store_entry *store_lookup(struct storage *st, const char *path)
+{
+    struct store_entry *e;
+
+    for (e = st->paths[hash_content(path, strlen(path)) % STORE_BUCKETS]; e != NULL; e = e->next) {
+        if (strcmp(e->path, path) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Give back a content (with the lock held), freed by its last path or session
+ * Args:
+ *  - st: Store of the content
+ *  - b: Content no longer used by a path or a session
+ *  */
+void blob_put(struct storage *st, struct store_blob *b)
+{
+    struct store_blob **p;
+
+    if (--b->refs > 0)
+        return;
+
+    if (b->stored) {
+        if (st->kind == STORE_CAS) {
+            for (p = &st->blobs[b->digest % STORE_BUCKETS]; *p != b; p = &(*p)->next);
+            *p = b->next;
+        }
+
+        st->images--;
+        st->size -= b->size;
+    }
+
+    free(b->data);
+    free(b);
+}
+
+/* Give a path its content (with the lock held), replacing the one it had
+ * In the content-addressed store, a content already held by another path is shared instead.
+ * Args:
+ *  - st: Image store
+ *  - path: Name asked by the clients
+ *  - b: Content, the path takes one reference on it
+ * Return:
+ *  The content the path now holds: b, or the identical one found (b is then unused)
+ *  */
+struct store_blob *store_add(struct storage *st, const char *path, struct store_blob *b)
+{
+    struct store_blob *found = NULL;
+    struct store_entry *e;
+    unsigned int bucket;
+
+    if (st->kind == STORE_CAS) {
+        b->digest = hash_content(b->data, b->size);
+
+        for (found = st->blobs[b->digest % STORE_BUCKETS]; found != NULL; found = found->next) {
+            if (found->digest == b->digest && found->size == b->size && memcmp(found->data, b->data, b->size) == 0)
+                break;
+        }
+    }
+
+    if (found != NULL) {
+        b = found;
+    }
+    else if (!b->stored) {
+        b->stored = 1;
+        st->images++;
+        st->size += b->size;
+
+        if (st->kind == STORE_CAS) {
+            b->next = st->blobs[b->digest % STORE_BUCKETS];
+            st->blobs[b->digest % STORE_BUCKETS] = b;
+        }
+    }
+
+    b->refs++;
+
+    if ((e = store_lookup(st, path)) != NULL) {
+        st->paths_size -= e->blob->size;
+        blob_put(st, e->blob);
+    }
+    else {
+        e = calloc(1, sizeof(struct store_entry));
+        e->path = strdup(path);
+
+        bucket = hash_content(path, strlen(path)) % STORE_BUCKETS;
+        e->next = st->paths[bucket];
+        st->paths[bucket] = e;
+        st->files++;
+    }
+
+    e->blob = b;
+    st->paths_size += b->size;
+
+    return b;
+}
+
+/* Read a whole file of the disk as a content of an image store
+ * Args:
+ *  - path: File to read
+ * Return:
+ *  The content (no reference taken yet), or NULL if it cannot be read
+ *  */
+struct store_blob *read_image(const char *path)
+{
+    struct store_blob *b;
+    struct stat st;
+    size_t done;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    b = calloc(1, sizeof(struct store_blob));
+    b->size = st.st_size;
+    b->alloc = st.st_size > 0 ? st.st_size : 1;
+
+    if ((b->data = malloc(b->alloc)) == NULL) {
+        close(fd);
+        free(b);
+        return NULL;
+    }
+
+    // A file shrinking while we read it is left out
+    for (done = 0; done < b->size; done += n) {
+        if ((n = pread(fd, b->data + done, b->size - done, done)) <= 0) {
+            close(fd);
+            free(b->data);
+            free(b);
+            return NULL;
+        }
+    }
+
+    close(fd);
+
+    return b;
+}
+
+/* Add every file of a directory and its subdirectories to an image store
+ * The paths are the ones the clients ask: relative to the current directory, without "./".
+ * Args:
+ *  - st: Image store
+ *  - dir: Directory to load ("." for the current one)
+ *  */
+void store_load(struct storage *st, const char *dir)
+{
+    char path[PATH_MAX];
+    struct store_blob *b;
+    struct dirent *d;
+    struct stat sb;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return;
+
+    while ((d = readdir(dp)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+
+        if (strcmp(dir, ".") == 0)
+            snprintf(path, sizeof(path), "%s", d->d_name);
+        else
+            snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+
+        if (stat(path, &sb) < 0)
+            continue;
+
+        if (S_ISDIR(sb.st_mode)) {
+            store_load(st, path);
+            continue;
+        }
+
+        if ((b = read_image(path)) == NULL)
+            continue;
+
+        pthread_mutex_lock(&st->lock);
+
+        // Identical to a content already stored
+        if (store_add(st, path, b) != b) {
+            free(b->data);
+            free(b);
+        }
+
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    closedir(dp);
+}
+
+/* Create the temporary file an upload is written to, next to the file it replaces
+ * Args:
+ *  - path: File uploaded
+ *  - tmp_path: Set to the name of the temporary file (to free)
+ * Return:
+ *  Its descriptor, or -1 if it cannot be created
+ *  */
+int open_temp(const char *path, char **tmp_path)
+{
+    size_t size = strlen(path) + 48;
+    int k, fd = -1;
+
+    *tmp_path = malloc(size);
+
+    // Never an existing file: two uploads of the same path each have their own
+    for (k = 0; k < TEMP_TRIES && fd < 0; k++) {
+        snprintf(*tmp_path, size, "%s.%d.%lu.part", path, getpid(), __atomic_fetch_add(&store_next_temp, 1, __ATOMIC_RELAXED));
+
+        if ((fd = open(*tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0 && errno != EEXIST)
+            break;
+    }
+
+    if (fd < 0) {
+        free(*tmp_path);
+        *tmp_path = NULL;
+    }
+
+    return fd;
+}
+
+/* Put a complete upload in place of the file it replaces, at once for its readers
+ * Args:
+ *  - fd: Temporary file, every block written
+ *  - tmp_path: Name of the temporary file
+ *  - path: File replaced
+ *  - size: Size of the upload (blocks preallocated beyond it are released)
+ *  - sync: Flush the file and the directory, so that it survives a crash
+ * Return:
+ *  0, or the errno of what failed (the temporary file is left to remove)
+ *  */
+int commit_file(int fd, const char *tmp_path, const char *path, long long size, int sync)
+{
+    char *dir;
+    int dfd;
+
+    if (ftruncate(fd, size) < 0 || (sync && fsync(fd) < 0) || rename(tmp_path, path) < 0)
+        return errno;
+
+    if (!sync)
+        return 0;
+
+    // The rename itself is only durable once the directory is
+    dir = strdup(path);
+
+    if ((dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+
+    free(dir);
+
+    return 0;
+}
+
+/* Open the file asked by a request: its DATA are sent from memory when possible
+ * Args:
+ *  - st: Storage of the server
+ *  - s: Session of the request (RRQ reads the file, WRQ creates it)
+ *  - path: File asked
+ * Return:
+ *  - 0: File opened
+ *  - 1: File not found (RRQ)
+ *  - 2: Access violation (WRQ)
+ *  */
+int store_open(struct storage *st, struct session *s, const char *path)
+{
+    struct store_entry *e;
+    char *tmp_path;
+    int fd;
+
+    // Given to its path (s->filename) once complete
+    if (s->type == WRQ && strlen(path) >= FILENAME_SIZE)
+        return 2;
+
+    if (st->kind != STORE_FS) {
+        if (s->type == WRQ) {
+            // Kept in memory until complete
+            s->blob = calloc(1, sizeof(struct store_blob));
+            s->blob->refs = 1;
+            s->blob->limit = st->max_upload;
+            return 0;
+        }
+
+        pthread_mutex_lock(&st->lock);
+
+        if ((e = store_lookup(st, path)) != NULL) {
+            s->blob = e->blob;
+            s->blob->refs++;
+        }
+
+        pthread_mutex_unlock(&st->lock);
+
+        if (s->blob == NULL)
+            return 1;
+
+        s->map = s->blob->data;
+        s->map_size = s->blob->size;
+        return 0;
+    }
+
+    // Hot files are served from the cache, without opening them
+    if (s->type == RRQ && st->cache != NULL && (s->cached = cache_get(st->cache, path)) != NULL) {
+        s->map = s->cached->data;
+        s->map_size = s->cached->size;
+        return 0;
+    }
+
+    if (s->type == RRQ) {
+        if ((s->fd = fopen(path, "rb")) == NULL)
+            return 1;
+
+        // Otherwise DATA are sent straight from the page cache
+        map_file(s);
+        return 0;
+    }
+
+    // Readers keep getting the previous file until the upload is complete
+    if ((fd = open_temp(path, &tmp_path)) < 0)
+        return 2;
+
+    // DATA are acknowledged once queued to the writer threads
+    if (st->writer != NULL) {
+        s->wfile = writer_open(st->writer, fd, path, tmp_path);
+        return 0;
+    }
+
+    if ((s->fd = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return 2;
+    }
+
+    s->tmp_path = tmp_path;
+
+    return 0;
+}
+
+/* Reserve the space of an upload whose size is announced (tsize), so that it is not
+ * fragmented by growing block by block
+ * Args:
+ *  - s: Session of a WRQ
+ *  - size: Size announced by the client
+ * Return:
+ *  - 0: Space reserved (or not supported by the file system, it grows as it comes)
+ *  - -1: Not enough space for the upload (or larger than an upload kept in memory may be)
+ *  */
+int store_reserve(struct session *s, long long size)
+{
+    char *data;
+    int fd;
+
+    if (size <= 0)
+        return 0;
+
+    // Uploads kept in memory get their whole buffer at once, within the limit
+    if (s->blob != NULL) {
+        if ((size_t) size > s->blob->limit)
+            return -1;
+
+        if ((size_t) size > s->blob->alloc && (data = realloc(s->blob->data, size)) != NULL) {
+            s->blob->data = data;
+            s->blob->alloc = size;
+        }
+
+        return 0;
+    }
+
+    fd = s->wfile != NULL ? s->wfile->fd : fileno(s->fd);
+
+    // The size of the file still tells what was written, the rest is released by the commit
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 && errno == ENOSPC)
+        return -1;
+
+    return 0;
+}
+
+/* Size of the file read by a session
+ * Args:
+ *  - s: Session of a RRQ, with its file opened
+ * Return:
+ *  Size of the whole file (the position in it is kept)
+ *  */
+long long store_size(struct session *s)
+{
+    long long pos, size;
+
+    if (s->map != NULL)
+        return s->map_size;
+
+    // Empty or unmappable file
+    pos = ftello(s->fd);
+    fseeko(s->fd, 0, SEEK_END);
+    size = ftello(s->fd);
+    fseeko(s->fd, pos, SEEK_SET);
+
+    return size;
+}
+
+/* Identity of the file read by a session: two sessions sending the same identity send the same DATA
+ * Args:
+ *  - s: Session of a RRQ, with its file opened
+ *  - st: Filled with the device, inode, size and modification date of the file
+ *        (only the size for a content kept in memory, the content itself tells it apart)
+ * Return:
+ *  - 0: Identity known
+ *  - -1: Cannot stat the file
+ *  */
+int store_stat(struct session *s, struct stat *st)
+{
+    bzero(st, sizeof(*st));
+
+    if (s->cached != NULL) {
+        st->st_dev = s->cached->dev;
+        st->st_ino = s->cached->ino;
+        st->st_size = s->cached->size;
+        st->st_mtim = s->cached->mtime;
+        return 0;
+    }
+
+    if (s->fd != NULL)
+        return fstat(fileno(s->fd), st);
+
+    st->st_size = s->map_size;
+
+    return 0;
+}
+
+/* Write a block received by a WRQ at its place
+ * Args:
+ *  - s: Session of the upload
+ *  - data: Payload of the DATA
+ *  - len: Size of the payload
+ *  - offset: Where it goes in the file (blocks come in order)
+ * Return:
+ *  - 0: Block written (or queued), it can be acknowledged
+ *  - -1: Cannot write it
+ *  */
+int store_write(struct session *s, const char *data, int len, off_t offset)
+{
+    size_t alloc;
+    char *grown;
+
+    if (s->wfile != NULL)
+        return writer_write(s->wfile, data, len, offset);
+
+    if (s->blob == NULL)
+        return (int) fwrite(data, sizeof(char), len, s->fd) == len ? 0 : -1;
+
+    // Whatever the tsize announced
+    if ((size_t) offset + len > s->blob->limit)
+        return -1;
+
+    // Doubled: copied a few times whatever the size of the upload
+    if ((size_t) offset + len > s->blob->alloc) {
+        alloc = s->blob->alloc > 0 ? s->blob->alloc * 2 : STORE_MIN_ALLOC;
+
+        while (alloc < (size_t) offset + len)
+            alloc *= 2;
+
+        if (alloc > s->blob->limit)
+            alloc = s->blob->limit;
+
+        if ((grown = realloc(s->blob->data, alloc)) == NULL)
+            return -1;
+
+        s->blob->data = grown;
+        s->blob->alloc = alloc;
+    }
+
+    memcpy(s->blob->data + offset, data, len);
+
+    if ((size_t) offset + len > s->blob->size)
+        s->blob->size = offset + len;
+
+    return 0;
+}
+
+/* Make a complete upload the content of its path, before its last ACK
+ * Args:
+ *  - st: Storage of the server
+ *  - s: Session of a WRQ whose last block was received
+ * Return:
+ *  - 0: The path has the new content (flushed depending on the policy)
+ *  - 1: Put in place by the writer threads once its blocks are written, then handed back to s->commits
+ *  - -1: Cannot write it (reason printed), the temporary file is removed with the session
+ *  */
+int store_commit(struct storage *st, struct session *s)
+{
+    int err;
+
+    // Once the writer threads wrote its last block, without waiting for them
+    if (s->wfile != NULL) {
+        writer_commit(s->wfile, s->total_size, s->commits, s);
+        return 1;
+    }
+
+    if (s->tmp_path != NULL)
+        err = fflush(s->fd) != 0 ? errno : commit_file(fileno(s->fd), s->tmp_path, s->filename, s->total_size, st->fsync != FSYNC_NONE);
+    else
+        err = 0;
+
+    if (err != 0) {
+        fprintf(stderr, "Cannot write '%s': %s\n", s->filename, strerror(err));
+        return -1;
+    }
+
+    if (s->tmp_path != NULL) {
+        free(s->tmp_path);
+        s->tmp_path = NULL;
+    }
+
+    if (s->blob == NULL)
+        return 0;
+
+    // An empty upload still has a content
+    if (s->blob->data == NULL && (s->blob->data = malloc(1)) != NULL)
+        s->blob->alloc = 1;
+
+    if (s->blob->data == NULL)
+        return -1;
+
+    // Freed with the session if identical to a content already stored
+    pthread_mutex_lock(&st->lock);
+    store_add(st, s->filename, s->blob);
+    st->uploads++;
+    pthread_mutex_unlock(&st->lock);
+
+    return 0;
+}
+
+/* Release the file of a session which is over
+ * Args:
+ *  - st: Storage of the server
+ *  - s: Session to release the file of
+ *  */
+void store_close(struct storage *st, struct session *s)
+{
+    if (s->cached != NULL) {
+        cache_release(st->cache, s->cached);
+    }
+    else if (s->blob != NULL) {
+        pthread_mutex_lock(&st->lock);
+        blob_put(st, s->blob);
+        pthread_mutex_unlock(&st->lock);
+    }
+    else if (s->map != NULL) {
+        munmap(s->map, s->map_size);
+    }
+
+    if (s->fd != NULL)
+        fclose(s->fd);
+
+    // Upload not complete: the file it would have replaced is left untouched
+    if (s->tmp_path != NULL) {
+        unlink(s->tmp_path);
+        free(s->tmp_path);
+    }
+
+    if (s->wfile != NULL)
+        writer_close(s->wfile);
+
+    s->cached = NULL;
+    s->blob = NULL;
+    s->map = NULL;
+    s->fd = NULL;
+    s->tmp_path = NULL;
+    s->wfile = NULL;
+}
+
+/* Print the counters of the storage
+ * Args:
+ *  - out: Where to print
+ *  - st: Storage to print
+ *  */
+void print_storage(FILE *out, struct storage *st)
+{
+    const char *kinds[] = {"fs", "memory", "cas"};
+
+    pthread_mutex_lock(&st->lock);
+
+    fprintf(out, "%-10s kind=%s files=%lu images=%lu size=%zu dedup_size=%zu uploads=%lu\n", "storage",
+            kinds[st->kind], st->files, st->images, st->size, st->paths_size - st->size, st->uploads);
+
+    pthread_mutex_unlock(&st->lock);
+}
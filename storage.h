@@ -0,0 +1,73 @@
+#ifndef STORAGE_H
+
+#define STORAGE_H
+
+#include <pthread.h>
+#include <dirent.h>
+#include <stdint.h>
+
+#include "network.h"
+
+#define STORE_BUCKETS 4096 // Size of the hash tables of the image stores (paths and contents)
+#define STORE_MIN_ALLOC (64 * 1024) // First buffer of an upload kept in memory, doubled as it grows
+#define DEFAULT_MAX_UPLOAD 256 // Largest upload kept in memory by the image stores by default (MB)
+#define TEMP_TRIES 16 // Names tried for the temporary file of an upload
+
+/* Content of an image, shared by the paths holding it and the sessions sending it */
+struct store_blob {
+    char *data; // Content (never NULL, even if empty)
+    size_t size; // Size of the content
+    size_t alloc; // Bytes allocated for data (uploads growing)
+    size_t limit; // Largest size an upload being received may grow to
+    uint64_t digest; // Hash of the content (content-addressed store)
+    int refs; // Paths and sessions using it (protected by the lock of the store)
+    int stored; // Reached by a path once: counted in the store until freed
+    struct store_blob *next; // Next content in the same bucket (content-addressed store)
+};
+
+/* Path of an image store */
+struct store_entry {
+    char *path; // Name asked by the clients
+    struct store_blob *blob; // Its content
+    struct store_entry *next; // Next path in the same bucket
+};
+
+/* Where the server reads the files asked and writes the uploads, shared by all the workers */
+struct storage {
+    enum storage_kind kind; // Backend
+    struct file_cache *cache; // Files read from the disk kept in memory (filesystem, NULL if disabled)
+    struct writer *writer; // Threads writing the uploads to the disk (filesystem, NULL if disabled)
+    enum fsync_policy fsync; // When the uploads written by the workers are flushed (filesystem)
+    size_t max_upload; // Largest upload kept in memory (image stores)
+    struct rewrite *rewrite; // Names mapped or generated before being opened (NULL if no table)
+    pthread_mutex_t lock; // Protects everything below (image stores), the contents and the generated files
+    struct store_entry *paths[STORE_BUCKETS]; // Images, by hash of their path
+    struct store_blob *blobs[STORE_BUCKETS]; // Contents, by digest (content-addressed store)
+    unsigned long files; // Paths in the store
+    unsigned long images; // Distinct contents in the store
+    size_t size; // Memory used by the distinct contents
+    size_t paths_size; // Sum of the sizes of every path (size if nothing is shared)
+    unsigned long uploads; // Uploads added to the store
+};
+
+extern unsigned long store_next_temp; // Temporary files created, the next one takes the next name
+
+void init_storage(struct storage *st, enum storage_kind kind, struct file_cache *cache, struct writer *wr, enum fsync_policy policy, size_t max_upload);
+uint64_t hash_content(const char *data, size_t size);
+struct store_entry *store_lookup(struct storage *st, const char *path);
+void blob_put(struct storage *st, struct store_blob *b);
+struct store_blob *store_add(struct storage *st, const char *path, struct store_blob *b);
+struct store_blob *read_image(const char *path);
+void store_load(struct storage *st, const char *dir);
+int open_temp(const char *path, char **tmp_path);
+int commit_file(int fd, const char *tmp_path, const char *path, long long size, int sync);
+int store_open(struct storage *st, struct session *s, const char *path);
+int store_reserve(struct session *s, long long size);
+long long store_size(struct session *s);
+int store_stat(struct session *s, struct stat *st);
+int store_write(struct session *s, const char *data, int len, off_t offset);
+int store_commit(struct storage *st, struct session *s);
+void store_close(struct storage *st, struct session *s);
+void print_storage(FILE *out, struct storage *st);
+
+#endif /* end of include guard: STORAGE_H */
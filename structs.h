@@ -2,11 +2,62 @@
 
 #define CONN_INFO_H
 
+#include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define NB_OPTIONS 9 // Options understood by the server (see server_options)
+#define NB_ERROR_CODES 9 // ERROR codes defined (0 to 8, RFC1350 and RFC2347)
+#define NB_DURATION_BUCKETS 10 // Buckets of the histogram of the transfer durations (see duration_bounds)
+#define FILENAME_SIZE 256 // Bytes of the file name asked kept by a session, for the access log
+
+/* Counters of a server's worker, only written by the worker itself */
+struct server_stats {
+    unsigned long active; // Sessions currently running
+    unsigned long rrq; // RRQ accepted
+    unsigned long wrq; // WRQ accepted
+    unsigned long refused; // Requests refused (busy, malformed, file not found...)
+    unsigned long timeouts; // Retransmissions after a timeout
+    unsigned long aborted; // Sessions given up after all retries
+    unsigned long pkts_in; // Datagrams received
+    unsigned long bytes_in; // Bytes received
+    unsigned long pkts_out; // Datagrams sent
+    unsigned long bytes_out; // Bytes sent
+    unsigned long syscalls; // Send/receive syscalls on the sockets
+    unsigned long retransmits; // Windows or datagrams sent again (timeout or gap)
+    unsigned long send_errors; // Datagrams the kernel refused to send (their session is ended)
+    unsigned long mcast_joins; // Clients which joined a running multicast transfer
+    unsigned long paced; // Windows held back by the rate limits
+    unsigned long options[NB_OPTIONS]; // Requests asking each option
+    unsigned long errors[NB_ERROR_CODES]; // ERROR sent, by code
+    unsigned long durations[NB_DURATION_BUCKETS]; // Transfers by duration (not cumulative)
+    unsigned long duration_sum; // Duration of all the transfers (us)
+} __attribute__((aligned(64))); // Avoid false sharing between workers
+
 struct conn_info {
     int fd; // File descriptor of the connection's socket
-    struct sockaddr *sock; // Connection's socket
+    struct sockaddr *sock; // Address of the peer (IPv4 or IPv6), stored in its session
     int addr_len; // Size of the address
-    void *free; // Use for easy free
+    struct server_stats *stats; // Counters to update (NULL for clients)
+};
+
+/* Datagrams sent or received with a single syscall (sendmmsg/recvmmsg) */
+struct dgram_batch {
+    struct mmsghdr *msgs; // One message per datagram (or per GSO group when sending)
+    int *lens; // Size of each datagram to send
+    int *first_iov; // First vector of each datagram to send (nb + 1 entries)
+    struct iovec *iovs; // Vectors of the datagrams: into data, or into a mapped file
+    struct sockaddr_storage *addrs; // Source of each datagram received
+    char *cmsgs; // UDP_SEGMENT control message of each GSO group
+    char *data; // Datagrams, back to back when sending, one slot each when receiving
+    int max; // Maximum number of datagrams per syscall
+    int nb; // Number of datagrams in the batch
+    int nb_iovs; // Number of vectors used by the datagrams to send
+    int used; // Bytes of data used by the datagrams to send (headers only for mapped payloads)
+    int gso; // Can the kernel split a group of datagrams (UDP GSO)
+    int rx_ready; // Are msgs and iovs set up to receive (undone by sending)
 };
 
 enum request_code {
@@ -20,4 +71,172 @@ enum tftp_role {
     SERVER
 };
 
+/* How a session ended */
+enum session_end {
+    END_RUNNING, // Not over yet
+    END_DONE, // Every DATA was sent and acknowledged
+    END_TIMEOUT, // No progress for too long
+    END_ERROR_SENT, // We sent an ERROR (end_code, end_msg)
+    END_ERROR_RECEIVED, // The peer sent an ERROR (end_code)
+    END_JOINED, // The client joined the multicast transfer of another session
+    END_SEND_FAILED, // A datagram could not be sent to the peer
+    END_RANGE_DONE // The client stopped once its byte range received (segmented download)
+};
+
+/* When the uploads received by the server are flushed to the disk */
+enum fsync_policy {
+    FSYNC_NONE, // Left to the kernel
+    FSYNC_CLOSE, // Once the last block is written
+    FSYNC_PERIODIC // Every FSYNC_PERIOD while written, and once the last block is
+};
+
+/* Where the server reads the files asked and writes the uploads */
+enum storage_kind {
+    STORE_FS, // Files of the current directory, opened by each request
+    STORE_MEMORY, // Images of the current directory loaded at start, uploads kept in memory
+    STORE_CAS // Same, each distinct content stored once whatever the paths holding it
+};
+
+/* Bytes a transfer (or a subnet) may send, refilled at its rate */
+struct token_bucket {
+    long long rate; // Bytes per second (0: not limited)
+    long long tokens; // Bytes that can be sent now (negative: sent ahead, paid back first)
+    long long last; // Date (us) of the last refill
+};
+
+// Defined in cache.h
+struct cached_file;
+struct file_cache;
+
+// Defined in writer.h
+struct write_file;
+struct writer;
+
+/* Uploads put in place by the writer threads, handed back to the worker of their sessions */
+struct write_done {
+    int efd; // eventfd waking the worker up
+    struct write_file *head; // Files put in place (or which failed) not handled yet (protected by the lock of the writer)
+};
+
+// Defined in storage.h
+struct store_blob;
+struct storage;
+
+// Defined in rewrite.h
+struct rewrite;
+
+// Defined in admission.h
+struct admit_client;
+struct admission;
+
+// Defined in multicast.h
+struct mcast_group;
+struct mcast_rx;
+
+// Defined in server.h
+struct server;
+
+/* One transfer, either on the client or on the server (with its own TID socket) */
+struct session {
+    struct conn_info conn; // TID socket and peer of this transfer
+    struct sockaddr_storage peer; // Storage pointed to by conn.sock, no allocation per connection
+    enum request_code type; // Request that opened the session (RRQ/WRQ)
+    int sending; // Do we send the DATA (1) or receive them (0)
+    int connected; // Did the server answer, from the TID we now talk to (client only)
+    FILE *fd; // File we read from or write to
+    struct write_file *wfile; // Upload written by the writer threads (NULL: written to fd)
+    struct write_done *commits; // Where the writer threads hand the upload back once in place (server only)
+    int committing; // Last DATA received, its ACK waits for the writer threads to put the upload in place
+    char *tmp_path; // Temporary file of an upload written to fd, renamed to filename once complete (NULL if none)
+    char *map; // File mapped or cached in memory, DATA payloads point into it (NULL to read fd)
+    size_t map_size; // Size of the mapping
+    struct cached_file *cached; // Entry of the file cache holding map (NULL if mapped)
+    struct store_blob *blob; // Image of a memory store holding map, or upload kept in memory (NULL: on the disk)
+    char *dgrams; // DATA of the cached file pre-built for our block size (NULL to build them)
+    char *buffer; // Last OACK (or request) sent, kept for retransmission: DATA are built in the batch
+    struct dgram_batch *batch; // Where the DATA are built and sent from
+    int buffer_size; // Negotiated block size + 4 bytes of headers
+    int sent_len; // Size of the datagram in buffer (0 if we last sent an ACK)
+    int windowsize; // Number of DATA sent before waiting for an ACK (RFC7440)
+    int rollover; // Block# following 65535 on the wire: 0 or 1
+    long long last_block; // Block# of the last DATA sent/received (not wrapped)
+    long long last_ack; // Block# of the last ACK received (sender) or sent (receiver)
+    long long gap_block; // Block# of the last out of order DATA (0 since an in-order one)
+    int wait_last_ack; // Do we just wait for the last ACK (no more DATA to send)
+    long long readahead; // Bytes of the file asked to the disk ahead of the window sent (0: left to the kernel)
+    long long prefetched; // Byte of the file up to which a read-ahead was asked
+    long long start; // Date (us) the request was accepted (server only, 0 if refused)
+    char *filename; // File asked, or the one the rewrite table sends instead, truncated to FILENAME_SIZE (server only)
+    long long options[NB_OPTIONS]; // Options acknowledged, in the order of server_options (-1 if not)
+    enum session_end end; // How the transfer ended
+    int end_code; // ERROR code sent or received
+    const char *end_msg; // Message of the ERROR sent
+    long long range_start; // Byte of the file carried first, by block# 1 (offset option)
+    long long range_len; // Bytes of the file in the transfer from range_start (length option, 0 up to the end)
+    int ranged; // Range granted by the server: the file is shared by several sessions, written with pwrite() (client only)
+    struct mcast_group *group; // Multicast group the DATA are sent to (server only, NULL if unicast)
+    struct mcast_rx *mcast; // Multicast group the DATA come from (client only, NULL if unicast)
+    long long total_size; // Incremental size of the file so far
+    long long final_size; // Total size announced by the peer (-1 if unknown)
+    int retry; // Timeouts in a row (of the negotiated length) before giving up
+    long long timeout; // Negotiated timeout (us), the RTO until the round-trip time is measured
+    long long rto; // Retransmission timeout (us): SRTT + 4 * RTTVAR, doubled on each timeout
+    long long srtt; // Smoothed round-trip time (us, 0 until measured)
+    long long rttvar; // Variation of the round-trip time (us)
+    long long rtt_sent; // Date (us) the datagram being timed was sent (0 if none)
+    long long rtt_block; // Block# whose ACK (sender) or DATA (receiver) ends the measure
+    long long deadline; // Date (us) at which we consider the last datagram lost
+    long long giveup; // Date (us) at which the transfer is aborted without progress
+    int slot; // Index in the server's session table (a heap on the deadlines)
+    struct admit_client *client; // Address counted by the admission control (server only, NULL if none)
+    struct token_bucket pace; // Bytes this transfer may send (rate 0: not limited)
+    long long paced; // Date (us) the window held back by the rate limits is sent (0 if none)
+};
+
+/* Tunables of the server engine */
+struct server_conf {
+    int max_sessions; // Maximum number of concurrent transfers (per worker)
+    int workers; // Number of threads, each with its own event loop
+    int max_windowsize; // Largest windowsize accepted (RFC7440)
+    int batch; // Maximum number of datagrams per send/receive syscall
+    int rollover; // Block# following 65535 when the client does not ask (0 or 1)
+    size_t cache_size; // Memory budget of the file cache, in bytes (0 to disable it)
+    size_t dgram_cache_size; // Memory budget of the pre-built DATA, in bytes (0 to disable them)
+    int writers; // Threads writing the uploads (0: written by the workers themselves)
+    size_t max_inflight; // Bytes of uploads received and not written yet above which the workers wait
+    enum fsync_policy fsync; // When the uploads are flushed to the disk
+    int readahead; // Windows of a file read ahead of the one sent, when not cached (0: left to the kernel)
+    char *metrics; // Where the metrics are served: port, host:port or path of a Unix socket (NULL: nowhere)
+    char *access_log; // File the transfers are logged to ("-": stderr, NULL: not logged)
+    int log_json; // Log JSON lines instead of text
+    int log_rate; // Lines per second for each kind of error, the others are counted (0: no limit)
+    enum storage_kind storage; // Where the files are read from and the uploads written to
+    size_t max_upload; // Largest upload kept in memory by the image stores, in bytes
+    char *rewrite; // Table mapping the names asked to other files or to templates (NULL: opened as asked)
+    int max_total; // Maximum number of concurrent transfers of all the workers (0: max_sessions per worker only)
+    int max_per_client; // Maximum number of concurrent transfers of a client address (0: no limit)
+    long long session_rate; // Bytes per second each transfer may send (0: no limit)
+    long long subnet_rate; // Bytes per second the transfers to a client subnet may send together (0: no limit)
+    int max_queued; // Requests waiting for a transfer to end instead of being refused (0: refused at once)
+    struct sockaddr_in multicast; // Group of the first multicast transfer, the next ones take the next ports (port 0: no multicast)
+};
+
+/* Tunables of the client */
+struct client_conf {
+    char *host; // Server's address
+    int server_port; // Server's port
+    enum request_code type; // Download (RRQ) or upload (WRQ)
+    int retry; // Timeouts in a row before giving up a file
+    size_t pref_buffer_size; // Block size going to be negociated
+    size_t timeout; // Timeout going to be negociated (seconds)
+    size_t utimeout; // Timeout going to be negociated (milliseconds, 0 for seconds only)
+    size_t windowsize; // Windowsize going to be negociated
+    int batch; // Maximum number of datagrams per send/receive syscall
+    int rollover; // Block# following 65535 asked (0 or 1)
+    int no_ext; // Flag to show if can use RFC2347 extensions (0 = can use extension, 1 = no extension)
+    int jobs; // Files transferred at once
+    int segments; // Byte ranges each download is split into, one session each (1: not split)
+    int multicast; // Ask to join a multicast transfer for the downloads (RFC2090)
+};
+
 #endif /* end of include guard: CONN_INFO_H */
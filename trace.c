@@ -0,0 +1,163 @@
+#include "trace.h"
+
+__thread struct trace_ring *trace_local = NULL; // Ring of the calling thread, created on its first event
+struct trace_ring *trace_rings = NULL; // Rings of every thread which recorded an event
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // Protects trace_rings
+
+/* Record an event in the ring of the calling thread (lock-free, the oldest event is overwritten)
+ * Args:
+ *  - type: What happened
+ *  - s: Transfer it happened to (NULL if none)
+ *  - block: Block number or file offset
+ *  - arg: Depends on the type
+ *  */
+void trace_event(enum trace_type type, struct session *s, long long block, int arg)
+{
+    struct trace_ring *r = trace_local != NULL ? trace_local : trace_ring();
+    struct trace_event *e;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    e = &r->events[r->head & (TRACE_RING_SIZE - 1)];
+    e->ts = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    e->block = block;
+    trace_peer(e, s);
+    e->type = type;
+    e->thread = r->id;
+    e->arg = arg;
+
+    // Published after the event, for trace_dump()
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy the address of a session's peer into an event
+ * Args:
+ *  - e: Event to fill
+ *  - s: Transfer (NULL if none)
+ *  */
+void trace_peer(struct trace_event *e, struct session *s)
+{
+    bzero(e->addr, sizeof(e->addr));
+    bzero(e->pad, sizeof(e->pad));
+    e->port = 0;
+    e->family = 0;
+
+    if (s == NULL)
+        return;
+
+    e->family = s->peer.ss_family;
+
+    if (s->peer.ss_family == AF_INET6) {
+        memcpy(e->addr, &((struct sockaddr_in6*) &s->peer)->sin6_addr, 16);
+        e->port = ((struct sockaddr_in6*) &s->peer)->sin6_port;
+    }
+    else {
+        memcpy(e->addr, &((struct sockaddr_in*) &s->peer)->sin_addr, 4);
+        e->port = ((struct sockaddr_in*) &s->peer)->sin_port;
+    }
+}
+
+/* Create the ring of the calling thread
+ * Return:
+ *  The ring, used by every later event of the thread
+ *  */
+struct trace_ring *trace_ring(void)
+{
+    struct trace_ring *r;
+
+    if ((r = calloc(1, sizeof(struct trace_ring))) == NULL)
+        error("trace_ring");
+
+    pthread_mutex_lock(&trace_lock);
+    r->id = trace_rings != NULL ? trace_rings->id + 1 : 0;
+    r->next = trace_rings;
+    trace_rings = r;
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_local = r;
+
+    return r;
+}
+
+/* Write the events of every thread to a trace file (read by tftp_trace)
+ * Threads keep recording: events overwritten while being copied are left out.
+ * Args:
+ *  - path: File to write
+ * Return:
+ *  - Number of events written
+ *  - -1: Cannot write the file
+ *  */
+int trace_dump(const char *path)
+{
+    struct trace_header hdr;
+    struct trace_event *copy;
+    struct trace_ring *r;
+    unsigned long head, first, skip, i;
+    FILE *out;
+
+    if ((out = fopen(path, "wb")) == NULL)
+        return -1;
+
+    copy = malloc(sizeof(struct trace_event) * TRACE_RING_SIZE);
+
+    bzero(&hdr, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.event_size = sizeof(struct trace_event);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    pthread_mutex_lock(&trace_lock);
+
+    for (r = trace_rings; r != NULL; r = r->next) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        for (i = first; i < head; i++)
+            copy[i - first] = r->events[i & (TRACE_RING_SIZE - 1)];
+
+        // The thread may have written over the oldest ones meanwhile (or be writing the next)
+        skip = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) + 1 - first;
+        skip = skip > TRACE_RING_SIZE ? skip - TRACE_RING_SIZE : 0;
+        if (skip > head - first)
+            skip = head - first;
+
+        fwrite(copy + skip, sizeof(struct trace_event), head - first - skip, out);
+
+        hdr.nb_threads++;
+        hdr.nb_events += head - first - skip;
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    // Counts are only known now
+    rewind(out);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    free(copy);
+
+    if (fclose(out) != 0)
+        return -1;
+
+    return hdr.nb_events;
+}
+
+/* Dump the events of every thread to TRACE_PATH (SIGUSR2 on the server, end of the client)
+ * and tell where, or that tracing is not compiled in
+ *  */
+void trace_save(void)
+{
+    char path[64];
+    int n;
+
+    if (!TRACE_ENABLED) {
+        fprintf(stderr, "Tracing is not compiled in (make TRACE=1)\n");
+        return;
+    }
+
+    snprintf(path, sizeof(path), TRACE_PATH, getpid());
+
+    if ((n = trace_dump(path)) < 0)
+        fprintf(stderr, "Cannot write the trace to %s: %s\n", path, strerror(errno));
+    else
+        fprintf(stderr, "Trace: %d events written to %s (decode with tftp_trace)\n", n, path);
+}
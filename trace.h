@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+
+#define TRACE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "network.h"
+
+#define TRACE_RING_SIZE 65536 // Events kept per thread, the oldest are overwritten (power of 2)
+#define TRACE_MAGIC "TFTPTRC2" // First bytes of a trace file
+#define TRACE_PATH "/tmp/tftp-%d.trace" // Where the traces are dumped (%d: pid)
+
+// Tracepoints are only compiled with make TRACE=1, they cost nothing otherwise
+#ifdef TFTP_TRACE
+#define TRACE_ENABLED 1
+#define TRACE(type, s, block, arg) trace_event(type, s, block, arg)
+#else
+#define TRACE_ENABLED 0
+#define TRACE(type, s, block, arg) do { } while (0)
+#endif
+
+/* What happened */
+enum trace_type {
+    TRACE_SEND = 1, // Window sent: first block, arg = number of DATA
+    TRACE_ACK, // ACK received: block acknowledged
+    TRACE_DATA, // DATA received: block, arg = payload size
+    TRACE_RESEND, // Sent again: first block, arg = what (0: window, 1: last datagram, 2: ACK)
+    TRACE_TIMEOUT, // Peer silent for a RTO: last block, arg = RTO (us)
+    TRACE_GIVEUP, // Transfer aborted after too long without progress: last block
+    TRACE_WRITE, // Upload blocks written: offset, arg = bytes
+    TRACE_WRITTEN, // Write done: offset, arg = errno (0 if written)
+    TRACE_STALL, // Worker waiting for the disk: offset, arg = bytes queued (KB)
+};
+
+/* One event, as written in the trace file */
+struct trace_event {
+    int64_t ts; // CLOCK_MONOTONIC date (ns)
+    int64_t block; // Block number or file offset (see enum trace_type)
+    uint8_t addr[16]; // Address of the peer (network order, 4 first bytes for IPv4)
+    int32_t arg; // Depends on the type
+    uint16_t port; // Port of the peer (network order)
+    uint8_t family; // AF_INET or AF_INET6 (0 if no peer)
+    uint8_t type; // enum trace_type
+    uint8_t thread; // Ring it comes from
+    uint8_t pad[7]; // Keeps events 48 bytes
+};
+
+/* Header of a trace file, followed by the events */
+struct trace_header {
+    char magic[8]; // TRACE_MAGIC
+    uint32_t event_size; // sizeof(struct trace_event)
+    uint32_t nb_threads; // Rings dumped
+    uint64_t nb_events; // Events following the header
+};
+
+/* Events of one thread, only written by it */
+struct trace_ring {
+    struct trace_event events[TRACE_RING_SIZE]; // Last events
+    unsigned long head; // Events recorded so far (the next one goes at head % TRACE_RING_SIZE)
+    int id; // Number of the thread
+    struct trace_ring *next; // Ring of another thread
+};
+
+extern __thread struct trace_ring *trace_local; // Ring of the calling thread (NULL until its first event)
+extern struct trace_ring *trace_rings; // Rings of every thread which recorded an event
+extern pthread_mutex_t trace_lock; // Protects trace_rings
+
+void trace_event(enum trace_type type, struct session *s, long long block, int arg);
+void trace_peer(struct trace_event *e, struct session *s);
+struct trace_ring *trace_ring(void);
+int trace_dump(const char *path);
+void trace_save(void);
+
+#endif /* end of include guard: TRACE_H */
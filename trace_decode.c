@@ -0,0 +1,193 @@
+#include "trace_decode.h"
+
+/* Load the events of a trace file written by trace_dump()
+ * Args:
+ *  - path: Trace file
+ *  - nb_events: Set to the number of events read
+ * Return:
+ *  The events (to free), in the order of the file
+ *  */
+struct trace_event *read_trace(const char *path, uint64_t *nb_events)
+{
+    struct trace_header hdr;
+    struct trace_event *events;
+    FILE *in;
+
+    if ((in = fopen(path, "rb")) == NULL)
+        error("fopen");
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        errno = 0;
+        error("Not a trace file");
+    }
+
+    // Written by another build of the server
+    if (hdr.event_size != sizeof(struct trace_event)) {
+        errno = 0;
+        error("Events of this trace have an unknown format");
+    }
+
+    if ((events = malloc(sizeof(struct trace_event) * (hdr.nb_events > 0 ? hdr.nb_events : 1))) == NULL)
+        error("malloc");
+
+    *nb_events = fread(events, sizeof(struct trace_event), hdr.nb_events, in);
+
+    if (*nb_events != hdr.nb_events)
+        fprintf(stderr, "Truncated trace: %lu events out of %lu\n", (unsigned long) *nb_events, (unsigned long) hdr.nb_events);
+
+    fclose(in);
+
+    return events;
+}
+
+/* Order events by date (qsort)
+ * Args:
+ *  - a: First event
+ *  - b: Second event
+ * Return:
+ *  Negative if a happened first, positive if b did, 0 if at once
+ *  */
+int compare_events(const void *a, const void *b)
+{
+    const struct trace_event *ea = a, *eb = b;
+
+    return (ea->ts > eb->ts) - (ea->ts < eb->ts);
+}
+
+/* Name of a type of event
+ * Args:
+ *  - type: enum trace_type
+ * Return:
+ *  Its name, "?" if unknown
+ *  */
+const char *trace_name(int type)
+{
+    switch (type) {
+        case TRACE_SEND: return "send";
+        case TRACE_ACK: return "ack";
+        case TRACE_DATA: return "data";
+        case TRACE_RESEND: return "resend";
+        case TRACE_TIMEOUT: return "timeout";
+        case TRACE_GIVEUP: return "giveup";
+        case TRACE_WRITE: return "write";
+        case TRACE_WRITTEN: return "written";
+        case TRACE_STALL: return "stall";
+        default: return "?";
+    }
+}
+
+/* Print the peer of an event: ip:port, [ipv6]:port
+ * Args:
+ *  - e: Event
+ *  - buf: Where to print it
+ *  - size: Size of buf
+ * Return:
+ *  buf, "-" if the event has no peer
+ *  */
+char *event_peer(struct trace_event *e, char *buf, size_t size)
+{
+    struct sockaddr_storage addr;
+
+    bzero(&addr, sizeof(addr));
+    addr.ss_family = e->family;
+
+    if (e->family == AF_INET6) {
+        memcpy(&((struct sockaddr_in6*) &addr)->sin6_addr, e->addr, 16);
+        ((struct sockaddr_in6*) &addr)->sin6_port = e->port;
+    }
+    else if (e->family == AF_INET) {
+        memcpy(&((struct sockaddr_in*) &addr)->sin_addr, e->addr, 4);
+        ((struct sockaddr_in*) &addr)->sin_port = e->port;
+    }
+    else {
+        snprintf(buf, size, "-");
+        return buf;
+    }
+
+    return format_addr(&addr, buf, size);
+}
+
+/* Print an event on one line
+ * Args:
+ *  - out: Where to print
+ *  - e: Event
+ *  - origin: Date of the first event (ns), times are printed from it
+ *  */
+void print_event(FILE *out, struct trace_event *e, int64_t origin)
+{
+    char peer[INET6_ADDRSTRLEN + 8];
+
+    event_peer(e, peer, sizeof(peer));
+
+    fprintf(out, "%12.6f t%-3d %-21s %-8s ", (e->ts - origin) / 1e9, e->thread, peer, trace_name(e->type));
+
+    switch (e->type) {
+        case TRACE_SEND:
+            fprintf(out, "block=%lld n=%d\n", (long long) e->block, e->arg);
+            break;
+        case TRACE_DATA:
+            fprintf(out, "block=%lld len=%d\n", (long long) e->block, e->arg);
+            break;
+        case TRACE_RESEND:
+            fprintf(out, "block=%lld what=%s\n", (long long) e->block, e->arg == 0 ? "window" : e->arg == 1 ? "datagram" : "ack");
+            break;
+        case TRACE_TIMEOUT:
+            fprintf(out, "block=%lld rto=%dus\n", (long long) e->block, e->arg);
+            break;
+        case TRACE_WRITE:
+            fprintf(out, "offset=%lld len=%d\n", (long long) e->block, e->arg);
+            break;
+        case TRACE_WRITTEN:
+            fprintf(out, "offset=%lld %s\n", (long long) e->block, e->arg == 0 ? "ok" : strerror(e->arg));
+            break;
+        case TRACE_STALL:
+            fprintf(out, "offset=%lld queued=%dKB\n", (long long) e->block, e->arg);
+            break;
+        default:
+            fprintf(out, "block=%lld\n", (long long) e->block);
+    }
+}
+
+/* Print the events of a trace file in order, and how many of each type
+ * Usage: tftp_trace FILE [PEER], PEER (ip:port or [ipv6]:port) keeping only the events of one transfer
+ *  */
+int main(int argc, char *argv[])
+{
+    unsigned long counts[TRACE_TYPES];
+    struct trace_event *events;
+    char peer[INET6_ADDRSTRLEN + 8];
+    uint64_t nb, i;
+    int k;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s FILE [IP:PORT]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    events = read_trace(argv[1], &nb);
+
+    // Rings are dumped one after the other, threads are interleaved again
+    qsort(events, nb, sizeof(struct trace_event), compare_events);
+
+    bzero(counts, sizeof(counts));
+
+    for (i = 0; i < nb; i++) {
+        event_peer(&events[i], peer, sizeof(peer));
+
+        if (argc > 2 && strcmp(peer, argv[2]) != 0)
+            continue;
+
+        print_event(stdout, &events[i], events[0].ts);
+
+        if (events[i].type < TRACE_TYPES)
+            counts[events[i].type]++;
+    }
+
+    printf("\n");
+    for (k = TRACE_SEND; k < TRACE_TYPES; k++)
+        printf("%-8s %lu\n", trace_name(k), counts[k]);
+
+    free(events);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+#ifndef TRACE_DECODE_H
+
+#define TRACE_DECODE_H
+
+#include "network.h"
+
+#define TRACE_TYPES (TRACE_STALL + 1) // Size of the arrays indexed by enum trace_type
+
+struct trace_event *read_trace(const char *path, uint64_t *nb_events);
+int compare_events(const void *a, const void *b);
+const char *trace_name(int type);
+char *event_peer(struct trace_event *e, char *buf, size_t size);
+void print_event(FILE *out, struct trace_event *e, int64_t origin);
+
+#endif /* end of include guard: TRACE_DECODE_H */
@@ -0,0 +1,454 @@
+#include "transfers.h"
+
+/* Send the request of a file (or of one of its segments) and open its transfer
+ * Args:
+ *  - t: Event loop running the transfer
+ *  - tr: Free slot for the transfer
+ *  - filename: File to transfer
+ *  - seg: File split in segments (NULL to transfer it at once)
+ *  - segment: Index of the segment asked (the first one asks from 0 up to the end)
+ * Return:
+ *  - 0: Request sent
+ *  - -1: The request could not be sent
+ *  */
+int start_transfer(struct transfers *t, struct transfer *tr, char *filename, struct segmented *seg, int segment)
+{
+    const struct client_conf *conf = t->conf;
+    struct conn_info conn;
+    struct epoll_event ev;
+    long long offset = -1, length = 0; // Range asked, the whole file by default
+    int n;
+
+    if (seg != NULL) {
+        offset = segment * seg->seg_len;
+
+        if (segment > 0)
+            length = seg->size - offset < seg->seg_len ? seg->size - offset : seg->seg_len;
+    }
+
+    if (seg != NULL && segment > 0)
+        fprintf(stderr, "Downloading: %s (segment %d/%d, %lldB from %lld)\n", filename, segment + 1, seg->nb_segments, length, offset);
+    else if (conf->type == RRQ)
+        fprintf(stderr, "Downloading: %s\n", filename);
+    else
+        fprintf(stderr, "Uploading: %s\n", filename);
+
+    init_client_conn(&conn, &t->server);
+
+    bzero(t->buffer, DEFAULT_BLK_SIZE);
+
+    // The default block size fills an IPv4 datagram, IPv6 headers are larger
+    if ((n = send_rq(conn, conf->type, t->buffer, DEFAULT_BLK_SIZE, filename, "octet",
+                conf->pref_buffer_size == PREF_BLK_SIZE && t->server.ss_family == AF_INET6 ? PREF_BLK_SIZE6 : conf->pref_buffer_size,
+                conf->timeout, (long long) conf->utimeout * 1000, conf->windowsize, conf->rollover,
+                offset, length, conf->multicast && offset < 0, conf->no_ext)) < 0) {
+        close(conn.fd);
+        return -1;
+    }
+
+    init_client_session(&tr->s, conn, conf, &t->out, t->buffer, n);
+    tr->filename = filename;
+    tr->seg = seg;
+    tr->segment = segment;
+    tr->start = now_us();
+    tr->running = 1;
+    tr->mcast_watched = 0;
+
+    // Segments write at their place in the file the first one opened
+    if (seg != NULL) {
+        tr->s.fd = seg->fd;
+        tr->s.range_start = offset;
+        tr->s.range_len = length;
+        seg->running++;
+    }
+
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = tr;
+
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn.fd, &ev) < 0)
+        error("epoll_ctl(transfer socket)");
+
+    t->nb_running++;
+
+    return 0;
+}
+
+/* Report the end of a transfer and free its slot
+ * Args:
+ *  - t: Event loop running the transfer
+ *  - tr: Transfer which is over
+ *  - status: How it ended (1: done, -1: failed)
+ *  */
+void finish_transfer(struct transfers *t, struct transfer *tr, int status)
+{
+    struct segmented *seg = tr->seg;
+
+    // The file is closed with the last segment (the first one may end before the split)
+    if (seg != NULL) {
+        if (seg->fd == NULL)
+            seg->fd = tr->s.fd;
+        tr->s.fd = NULL;
+    }
+
+    status = end_client_session(&tr->s, tr->filename, status);
+
+    if (seg != NULL && status == 1 && tr->s.final_size != seg->size) {
+        fprintf(stderr, "Size of '%s' changed during the download\n", tr->filename);
+        status = -1;
+    }
+
+    if (seg != NULL) {
+        if (status == 1) {
+            seg->bytes += tr->s.total_size;
+            t->bytes += tr->s.total_size;
+        }
+        else {
+            seg->failed = 1;
+        }
+
+        seg->running--;
+    }
+    else if (status == 1) {
+        t->done++;
+        t->bytes += transfer_bytes(tr);
+
+        fprintf(stderr, "OK: %s (%lldB in %.3fs)\n", tr->filename, transfer_bytes(tr), (now_us() - tr->start) / (double) USEC);
+    }
+    else {
+        t->failed++;
+
+        fprintf(stderr, "FAILED: %s\n", tr->filename);
+    }
+
+    // Closing the socket also removes it from epoll
+    close(tr->s.conn.fd);
+
+    tr->running = 0;
+    t->nb_running--;
+
+    if (seg != NULL && seg->running == 0 && (seg->failed || seg->next >= seg->nb_segments))
+        finish_segmented(t, seg);
+}
+
+/* Prepare the download of a file in segments, starting with the first one alone
+ * Args:
+ *  - t: Event loop running the transfers
+ *  - filename: File to download
+ * Return:
+ *  The file, whose first segment is to start now
+ *  */
+struct segmented *new_segmented(struct transfers *t, char *filename)
+{
+    struct segmented *seg;
+
+    seg = calloc(1, sizeof(struct segmented));
+    seg->filename = filename;
+    seg->size = -1;
+    seg->nb_segments = 1;
+    seg->next = 1;
+    seg->start = now_us();
+
+    seg->next_file = t->segmented;
+    t->segmented = seg;
+
+    return seg;
+}
+
+/* Split a file in segments, once its first segment is answered
+ * The first segment asked the whole file: it stops at the end of its own range.
+ * Args:
+ *  - t: Event loop running the transfers
+ *  - tr: First segment of the file, just answered by the server
+ *  */
+void plan_segments(struct transfers *t, struct transfer *tr)
+{
+    struct segmented *seg = tr->seg;
+    long long blksize, blocks;
+
+    seg->planned = 1;
+    seg->size = tr->s.final_size;
+
+    // Opened by the first segment on its first answer, the others write in it too
+    seg->fd = tr->s.fd;
+
+    // The server ignores ranges or does not tell the size: a single transfer then
+    if (!tr->s.ranged || seg->size <= 0)
+        return;
+
+    blksize = tr->s.buffer_size - 4;
+    blocks = (seg->size + blksize - 1) / blksize;
+
+    // Whole blocks in each segment, so that they all start on a block boundary
+    seg->seg_len = (blocks + t->conf->segments - 1) / t->conf->segments * blksize;
+    seg->nb_segments = (seg->size + seg->seg_len - 1) / seg->seg_len;
+
+    if (seg->nb_segments > 1)
+        tr->s.range_len = seg->seg_len;
+}
+
+/* Find a file with segments still to start
+ * Args:
+ *  - t: Event loop running the transfers
+ * Return:
+ *  The file, or NULL if there is none
+ *  */
+struct segmented *pending_segment(struct transfers *t)
+{
+    struct segmented *seg;
+
+    for (seg = t->segmented; seg != NULL; seg = seg->next_file) {
+        if (!seg->failed && seg->next < seg->nb_segments)
+            return seg;
+    }
+
+    return NULL;
+}
+
+/* Report the end of a file downloaded in segments, once none is running anymore
+ * Args:
+ *  - t: Event loop running the transfers
+ *  - seg: File whose segments are over
+ *  */
+void finish_segmented(struct transfers *t, struct segmented *seg)
+{
+    struct segmented **p;
+    struct stat st;
+
+    for (p = &t->segmented; *p != seg; p = &(*p)->next_file);
+    *p = seg->next_file;
+
+    // Every range was received: the file must have the size announced
+    if (!seg->failed && seg->fd != NULL && seg->size != -1
+            && (fflush(seg->fd) != 0 || fstat(fileno(seg->fd), &st) < 0 || st.st_size != seg->size)) {
+        fprintf(stderr, "Final size of '%s' is wrong. Expected %lldB\n", seg->filename, seg->size);
+        seg->failed = 1;
+    }
+
+    if (seg->fd != NULL && fclose(seg->fd) != 0)
+        seg->failed = 1;
+
+    if (!seg->failed) {
+        t->done++;
+
+        fprintf(stderr, "OK: %s (%lldB in %.3fs, %d segments)\n", seg->filename, seg->bytes,
+                (now_us() - seg->start) / (double) USEC, seg->nb_segments);
+    }
+    else {
+        t->failed++;
+
+        fprintf(stderr, "FAILED: %s\n", seg->filename);
+    }
+
+    free(seg);
+}
+
+/* Get how much of a file was transferred so far
+ * Args:
+ *  - tr: Transfer to look at
+ * Return:
+ *  Bytes received (download), or acknowledged by the server (upload)
+ *  */
+long long transfer_bytes(struct transfer *tr)
+{
+    long long bytes;
+
+    if (!tr->s.sending)
+        return tr->s.total_size;
+
+    // total_size is only known once the upload is over
+    bytes = tr->s.last_ack * (tr->s.buffer_size - 4);
+
+    if (tr->s.total_size > 0 || (tr->s.final_size != -1 && bytes > tr->s.final_size))
+        bytes = tr->s.total_size > 0 ? tr->s.total_size : tr->s.final_size;
+
+    return bytes;
+}
+
+/* Print how far the transfers are, all files together
+ * Args:
+ *  - t: Event loop running the transfers
+ *  - out: Where to print
+ *  */
+void print_progress(struct transfers *t, FILE *out)
+{
+    long long bytes = t->bytes;
+    double seconds;
+    int i;
+
+    for (i = 0; i < t->conf->jobs; i++) {
+        if (t->slots[i].running)
+            bytes += transfer_bytes(&t->slots[i]);
+    }
+
+    seconds = (now_us() - t->start) / (double) USEC;
+
+    fprintf(out, "Progress: %d/%d files done, %d failed, %d running, %.1fMB in %.1fs (%.1fMB/s)\n",
+            t->done, t->nb_files, t->failed, t->nb_running, bytes / 1048576.0, seconds,
+            seconds > 0 ? bytes / 1048576.0 / seconds : 0);
+}
+
+/* Transfer every file of the list, conf->jobs of them at once, from one event loop
+ * Args:
+ *  - conf: Tunables of the client
+ *  - filenames: Files to transfer, NULL terminated
+ * Return:
+ *  Number of files which could not be transferred
+ *  */
+int run_transfers(const struct client_conf *conf, char **filenames)
+{
+    struct transfers t;
+    struct transfer *tr;
+    struct segmented *seg;
+    struct epoll_event events[MAX_EVENTS], ev;
+    long long deadline, last_progress;
+    int i, j, k, fd, nb, nfds, status;
+
+    bzero(&t, sizeof(t));
+    t.conf = conf;
+    t.filenames = filenames;
+    for (t.nb_files = 0; filenames[t.nb_files] != NULL; t.nb_files++);
+    t.slots = calloc(conf->jobs, sizeof(struct transfer));
+    t.buffer = malloc(DEFAULT_BLK_SIZE * sizeof(char));
+    t.start = now_us();
+    last_progress = t.start;
+
+    init_batch(&t.in, conf->batch);
+    init_batch(&t.out, conf->batch);
+
+    // Every transfer goes to the same address, resolved once
+    if (resolve_addr(conf->host, conf->server_port, &t.server) < 0)
+        exit(EXIT_FAILURE);
+
+    if ((t.epfd = epoll_create1(0)) < 0)
+        error("epoll_create1");
+
+    while (1) {
+        // Fill the free slots, segments of the files started first, then the next files
+        for (i = 0; i < conf->jobs; i++) {
+            if (t.slots[i].running)
+                continue;
+
+            if ((seg = pending_segment(&t)) != NULL) {
+                if (start_transfer(&t, &t.slots[i], seg->filename, seg, seg->next++) < 0) {
+                    seg->failed = 1;
+
+                    if (seg->running == 0)
+                        finish_segmented(&t, seg);
+                }
+
+                continue;
+            }
+
+            if (filenames[t.next] == NULL)
+                break;
+
+            seg = NULL;
+            if (conf->segments > 1 && conf->type == RRQ && !conf->no_ext)
+                seg = new_segmented(&t, filenames[t.next]);
+
+            if (start_transfer(&t, &t.slots[i], filenames[t.next], seg, 0) < 0) {
+                if (seg != NULL) {
+                    seg->failed = 1;
+                    finish_segmented(&t, seg);
+                }
+                else {
+                    fprintf(stderr, "FAILED: %s\n", filenames[t.next]);
+                    t.failed++;
+                }
+            }
+
+            t.next++;
+        }
+
+        if (t.nb_running == 0)
+            break;
+
+        // A few transfers at most: a scan finds the earliest deadline
+        deadline = -1;
+
+        for (i = 0; i < conf->jobs; i++) {
+            if (t.slots[i].running && (deadline == -1 || t.slots[i].s.deadline < deadline))
+                deadline = t.slots[i].s.deadline;
+        }
+
+        if (conf->jobs > 1 && deadline > last_progress + USEC)
+            deadline = last_progress + USEC;
+
+        nfds = epoll_wait(t.epfd, events, MAX_EVENTS, timer_wait(deadline));
+
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+
+            error("epoll_wait");
+        }
+
+        for (i = 0; i < nfds; i++) {
+            tr = events[i].data.ptr;
+
+            // Finished by an earlier event of this round
+            if (!tr->running)
+                continue;
+
+            // Take every datagram already queued on the sockets at once: TID, then multicast group
+            for (j = 0; j < 2 && tr->running; j++) {
+                fd = j == 0 ? tr->s.conn.fd : tr->mcast_watched ? tr->s.mcast->fd : -1;
+
+                if (fd < 0)
+                    break;
+
+                nb = recv_batch(fd, &t.in, MSG_DONTWAIT, NULL);
+
+                for (k = 0; k < nb; k++) {
+                    status = client_dgram(&tr->s, BATCH_DGRAM(&t.in, k), BATCH_LEN(&t.in, k), &t.in.addrs[k], tr->filename);
+
+                    // The answer to the first segment tells how to split the file
+                    if (status == 0 && tr->seg != NULL && !tr->seg->planned && tr->s.connected)
+                        plan_segments(&t, tr);
+
+                    // The OACK gave a multicast group, the DATA come to its socket
+                    if (status == 0 && tr->s.mcast != NULL && tr->s.mcast->fd >= 0 && !tr->mcast_watched) {
+                        bzero(&ev, sizeof(ev));
+                        ev.events = EPOLLIN;
+                        ev.data.ptr = tr;
+
+                        if (epoll_ctl(t.epfd, EPOLL_CTL_ADD, tr->s.mcast->fd, &ev) < 0)
+                            error("epoll_ctl(multicast socket)");
+
+                        tr->mcast_watched = 1;
+                    }
+
+                    if (status != 0) {
+                        finish_transfer(&t, tr, status);
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (i = 0; i < conf->jobs; i++) {
+            tr = &t.slots[i];
+
+            if (tr->running && now_us() >= tr->s.deadline && client_timeout(&tr->s, tr->filename))
+                finish_transfer(&t, tr, -1);
+        }
+
+        // Aggregate progress, when several files go at once
+        if (conf->jobs > 1 && now_us() - last_progress >= USEC) {
+            print_progress(&t, stderr);
+            last_progress = now_us();
+        }
+    }
+
+    if (conf->jobs > 1)
+        print_progress(&t, stderr);
+
+    close(t.epfd);
+    free_batch(&t.in);
+    free_batch(&t.out);
+    free(t.buffer);
+    free(t.slots);
+
+    return t.failed;
+}
@@ -0,0 +1,71 @@
+#ifndef TRANSFERS_H
+
+#define TRANSFERS_H
+
+#include <sys/epoll.h>
+
+#include "network.h"
+
+#define DEFAULT_JOBS 1 // Files transferred at once by default
+#define MAX_JOBS 1024 // Most files transferred at once
+#define DEFAULT_SEGMENTS 1 // Byte ranges of a download by default (not split)
+#define MAX_SEGMENTS 64 // Most byte ranges of a download
+
+/* A file downloaded as several byte ranges at once, one session each */
+struct segmented {
+    char *filename; // File downloaded
+    FILE *fd; // Destination, shared by the segments (opened by the first one)
+    long long size; // Size of the file (tsize of the first segment)
+    long long seg_len; // Bytes of each segment, a multiple of blksize (the last one is shorter)
+    int nb_segments; // Number of segments, 1 until the first one is answered
+    int planned; // Is the first segment answered, and the others known
+    int next; // Index of the next segment to start
+    int running; // Segments in a slot
+    int failed; // Did a segment fail
+    long long bytes; // Bytes received by the segments over
+    long long start; // Date (us) the first segment was asked
+    struct segmented *next_file; // Next file split in segments not over yet
+};
+
+/* One file (or segment of a file) of the client, with its own socket and session */
+struct transfer {
+    struct session s; // State of the transfer
+    char *filename; // File downloaded or uploaded
+    struct segmented *seg; // File this transfer is a segment of (NULL if not split)
+    int segment; // Index of the segment
+    long long start; // Date (us) the request was sent
+    int running; // Is this slot in use
+    int mcast_watched; // Is the socket of its multicast group watched by epoll
+};
+
+/* Event loop driving all the transfers of the client */
+struct transfers {
+    const struct client_conf *conf; // Tunables
+    struct sockaddr_storage server; // Address of the server (IPv4 or IPv6)
+    char **filenames; // Files to transfer, NULL terminated
+    int nb_files; // Number of files to transfer
+    int next; // Index of the next file to start
+    struct transfer *slots; // Transfers running, conf->jobs of them at most
+    struct segmented *segmented; // Files split in segments not over yet
+    int nb_running; // Number of slots in use
+    int epfd; // epoll instance watching the sockets of the transfers
+    struct dgram_batch in; // Datagrams received, shared by all transfers
+    struct dgram_batch out; // DATA to send, shared by all transfers
+    char *buffer; // Where the requests are built
+    int done; // Files transferred
+    int failed; // Files which could not be transferred
+    long long bytes; // Size of the files transferred
+    long long start; // Date (us) the first transfer started
+};
+
+int start_transfer(struct transfers *t, struct transfer *tr, char *filename, struct segmented *seg, int segment);
+void finish_transfer(struct transfers *t, struct transfer *tr, int status);
+struct segmented *new_segmented(struct transfers *t, char *filename);
+void plan_segments(struct transfers *t, struct transfer *tr);
+struct segmented *pending_segment(struct transfers *t);
+void finish_segmented(struct transfers *t, struct segmented *seg);
+long long transfer_bytes(struct transfer *tr);
+void print_progress(struct transfers *t, FILE *out);
+int run_transfers(const struct client_conf *conf, char **filenames);
+
+#endif /* end of include guard: TRANSFERS_H */
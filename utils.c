@@ -16,6 +16,143 @@ void error(char *msg)
     exit(errno == 0 ? 1 : errno);
 }
 
+/* Resolve a host name or a numeric address (IPv4 or IPv6), once before the transfers
+ * Args:
+ *  - host: Name, dotted IPv4 or IPv6 address (brackets allowed)
+ *  - port: Port to put in the address
+ *  - addr: Set to the first address found
+ * Return:
+ *  - 0: Address found
+ *  - -1: Unknown host (reason printed)
+ *  */
+int resolve_addr(const char *host, int port, struct sockaddr_storage *addr)
+{
+    struct addrinfo hints, *res;
+    char name[NI_MAXHOST];
+    size_t len;
+    int err;
+
+    // [::1] as written in URLs
+    snprintf(name, sizeof(name), "%s", host);
+    len = strlen(name);
+
+    if (len > 2 && name[0] == '[' && name[len - 1] == ']') {
+        memmove(name, name + 1, len - 2);
+        name[len - 2] = '\0';
+    }
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if ((err = getaddrinfo(name, NULL, &hints, &res)) != 0) {
+        fprintf(stderr, "Cannot resolve '%s': %s\n", host, gai_strerror(err));
+        return -1;
+    }
+
+    bzero(addr, sizeof(*addr));
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+
+    if (addr->ss_family == AF_INET6)
+        ((struct sockaddr_in6*) addr)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in*) addr)->sin_port = htons(port);
+
+    return 0;
+}
+
+/* Build the wildcard address of a family, to bind a socket
+ * Args:
+ *  - addr: Address to set
+ *  - family: AF_INET or AF_INET6
+ *  - port: Port to bind (0 to let the kernel choose)
+ *  */
+void any_addr(struct sockaddr_storage *addr, int family, int port)
+{
+    bzero(addr, sizeof(*addr));
+    addr->ss_family = family;
+
+    if (family == AF_INET6) {
+        ((struct sockaddr_in6*) addr)->sin6_addr = in6addr_any;
+        ((struct sockaddr_in6*) addr)->sin6_port = htons(port);
+    }
+    else {
+        ((struct sockaddr_in*) addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+        ((struct sockaddr_in*) addr)->sin_port = htons(port);
+    }
+}
+
+/* Size of an address, as given to sendto() or bind()
+ * Args:
+ *  - addr: Address
+ * Return:
+ *  Size of the sockaddr of its family
+ *  */
+socklen_t addr_size(const struct sockaddr_storage *addr)
+{
+    return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+/* Port of an address
+ * Args:
+ *  - addr: Address
+ * Return:
+ *  Port, in host order
+ *  */
+int addr_port(const struct sockaddr_storage *addr)
+{
+    if (addr->ss_family == AF_INET6)
+        return ntohs(((const struct sockaddr_in6*) addr)->sin6_port);
+
+    return ntohs(((const struct sockaddr_in*) addr)->sin_port);
+}
+
+/* Tell whether two addresses are the same host and port (the TID of a peer)
+ * Args:
+ *  - a: First address
+ *  - b: Second address
+ * Return:
+ *  1 if they are the same, 0 otherwise
+ *  */
+int addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6*) a, *b6 = (const struct sockaddr_in6*) b;
+    const struct sockaddr_in *a4 = (const struct sockaddr_in*) a, *b4 = (const struct sockaddr_in*) b;
+
+    if (a->ss_family != b->ss_family)
+        return 0;
+
+    if (a->ss_family == AF_INET6)
+        return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+/* Print an address and its port: 192.0.2.1:69 or [2001:db8::1]:69
+ * Args:
+ *  - addr: Address
+ *  - buf: Where to print it (INET6_ADDRSTRLEN + 8 bytes are enough)
+ *  - size: Size of buf
+ * Return:
+ *  buf
+ *  */
+char *format_addr(const struct sockaddr_storage *addr, char *buf, size_t size)
+{
+    char ip[INET6_ADDRSTRLEN];
+
+    if (addr->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6*) addr)->sin6_addr, ip, sizeof(ip));
+        snprintf(buf, size, "[%s]:%d", ip, addr_port(addr));
+    }
+    else {
+        inet_ntop(AF_INET, &((const struct sockaddr_in*) addr)->sin_addr, ip, sizeof(ip));
+        snprintf(buf, size, "%s:%d", ip, addr_port(addr));
+    }
+
+    return buf;
+}
+
 /* Handle CLI arguments
  * Args:
  *  - argc: Number of CLI args
@@ -23,18 +160,29 @@ void error(char *msg)
  *  - server_port: Port to replace the default 69 defined in RFC1350
  *  - pref_buffer_size: Buffer size going to be negociated
  *  - timeout: Timeout going to be negociated
+ *  - utimeout: Timeout going to be negociated in milliseconds (0 if not set)
+ *  - windowsize: Windowsize going to be negociated (client) or accepted (server)
+ *  - batch: Maximum number of datagrams sent/received per syscall
+ *  - rollover: Block# following 65535 (0 or 1), asked (client) or used by default (server)
  *  - no_ext: Flag to show if can use RFC2347 extensions (0 = can use extension, 1 = no extension)
+ *  - jobs: Number of files transferred at once
+ *  - segments: Number of byte ranges each download is split into
+ *  - multicast: Ask to join multicast transfers (RFC2090)
  *  - type: Type of operation (RRQ/WRQ)
  *  - role: Are we a client or a server
  *  - host: Host to request
  *  - host_size: Max length of hostnames
  *  - filenames: Files we are requesting
+ *  - sconf: Tunables of the server
  *  */
-void opts(int argc, const char *argv[], int *server_port, size_t *pref_buffer_size, size_t *timeout, int *no_ext, enum request_code *type, int *retry, enum tftp_role *role, char *host, size_t host_size, char **filenames)
+void opts(int argc, const char *argv[], int *server_port, size_t *pref_buffer_size, size_t *timeout, size_t *utimeout, size_t *windowsize, int *batch, int *rollover, int *no_ext, int *jobs, int *segments, int *multicast, enum request_code *type, int *retry, enum tftp_role *role, char *host, size_t host_size, char **filenames, struct server_conf *sconf)
 {
     int i, choice, index; // Getopt stuff
+    struct sockaddr_storage group;
+    char name[HOST_LEN];
+    int port;
 
-    while ((choice = getopt(argc,(char * const*) argv, "H:p:b:t:r:eul")) != -1) {
+    while ((choice = getopt(argc,(char * const*) argv, "H:p:b:t:T:r:j:S:m:a:c:k:K:q:w:W:B:C:D:A:Q:F:P:M:L:E:R:G:s:U:x:Jegul")) != -1) {
 
         switch( choice )
         {
@@ -57,10 +205,217 @@ void opts(int argc, const char *argv[], int *server_port, size_t *pref_buffer_si
                 *timeout = atoi(optarg);
                 break;
 
+            case 'T':
+                *utimeout = atoi(optarg);
+
+                if (*utimeout < MIN_RTO / 1000 || *utimeout > MAX_TIMEOUT * 1000)
+                    error("Timeout in milliseconds must be between 10 and 255000");
+                break;
+
+            case 'W':
+                *windowsize = atoi(optarg);
+
+                if (*windowsize < 1 || *windowsize > MAX_WINDOWSIZE)
+                    error("Windowsize must be between 1 and 65535");
+
+                sconf->max_windowsize = *windowsize;
+                break;
+
+            case 'P':
+                sconf->readahead = atoi(optarg);
+
+                if (sconf->readahead < 0)
+                    error("Read-ahead depth cannot be negative");
+                break;
+
+            case 'B':
+                *batch = atoi(optarg);
+
+                if (*batch < 1 || *batch > MAX_BATCH)
+                    error("Batch size must be between 1 and 1024");
+
+                sconf->batch = *batch;
+                break;
+
             case 'r':
                 *retry = atoi(optarg);
                 break;
 
+            case 'j':
+                *jobs = atoi(optarg);
+
+                if (*jobs < 1 || *jobs > MAX_JOBS)
+                    error("Number of jobs must be between 1 and 1024");
+                break;
+
+            case 'S':
+                *segments = atoi(optarg);
+
+                if (*segments < 1 || *segments > MAX_SEGMENTS)
+                    error("Number of segments must be between 1 and 64");
+                break;
+
+            case 'm':
+                sconf->max_sessions = atoi(optarg);
+
+                if (sconf->max_sessions <= 0)
+                    error("Maximum number of sessions must be positive");
+                break;
+
+            case 'a':
+                sconf->max_total = atoi(optarg);
+
+                if (sconf->max_total < 0)
+                    error("Maximum number of transfers cannot be negative");
+                break;
+
+            case 'c':
+                sconf->max_per_client = atoi(optarg);
+
+                if (sconf->max_per_client < 0)
+                    error("Maximum number of transfers per client cannot be negative");
+                break;
+
+            case 'k':
+                if (atol(optarg) < 0)
+                    error("Rate of a transfer cannot be negative");
+
+                sconf->session_rate = atoll(optarg) * 1024;
+                break;
+
+            case 'K':
+                if (atol(optarg) < 0)
+                    error("Rate of a subnet cannot be negative");
+
+                sconf->subnet_rate = atoll(optarg) * 1024;
+                break;
+
+            case 'q':
+                sconf->max_queued = atoi(optarg);
+
+                if (sconf->max_queued < 0)
+                    error("Requests waiting cannot be negative");
+                break;
+
+            case 'w':
+                sconf->workers = atoi(optarg);
+
+                if (sconf->workers <= 0)
+                    error("Number of workers must be positive");
+                break;
+
+            case 'R':
+                *rollover = atoi(optarg);
+
+                if (*rollover != 0 && *rollover != 1)
+                    error("Rollover must be 0 or 1");
+
+                sconf->rollover = *rollover;
+                break;
+
+            case 'C':
+                if (atol(optarg) < 0)
+                    error("Cache size cannot be negative");
+
+                sconf->cache_size = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+
+            case 'D':
+                if (atol(optarg) < 0)
+                    error("Pre-built DATA cache size cannot be negative");
+
+                sconf->dgram_cache_size = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+
+            case 'A':
+                sconf->writers = atoi(optarg);
+
+                if (sconf->writers < 0 || sconf->writers > 64)
+                    error("Number of writer threads must be between 0 and 64");
+                break;
+
+            case 'Q':
+                if (atol(optarg) <= 0)
+                    error("Uploads queued must be positive");
+
+                sconf->max_inflight = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+
+            case 'F':
+                if (strcmp(optarg, "none") == 0)
+                    sconf->fsync = FSYNC_NONE;
+                else if (strcmp(optarg, "close") == 0)
+                    sconf->fsync = FSYNC_CLOSE;
+                else if (strcmp(optarg, "periodic") == 0)
+                    sconf->fsync = FSYNC_PERIODIC;
+                else
+                    error("fsync policy must be none, close or periodic");
+                break;
+
+            case 'M':
+                sconf->metrics = optarg;
+                break;
+
+            case 'L':
+                sconf->access_log = strcmp(optarg, "none") == 0 ? NULL : optarg;
+                break;
+
+            case 'J':
+                sconf->log_json = 1;
+                break;
+
+            case 'E':
+                sconf->log_rate = atoi(optarg);
+
+                if (sconf->log_rate < 0)
+                    error("Error lines per second cannot be negative");
+                break;
+
+            case 'G':
+                // ADDR or ADDR:PORT, the groups take the next ports
+                snprintf(name, sizeof(name), "%s", optarg);
+                port = DEFAULT_MCAST_PORT;
+
+                if (strchr(name, ':') != NULL) {
+                    port = atoi(strchr(name, ':') + 1);
+                    *strchr(name, ':') = '\0';
+                }
+
+                if (port <= 0 || port > 65535 - MCAST_PORTS || resolve_addr(name, port, &group) < 0 || group.ss_family != AF_INET
+                        || !IN_MULTICAST(ntohl(((struct sockaddr_in*) &group)->sin_addr.s_addr))) {
+                    errno = 0;
+                    error("Multicast group must be an IPv4 multicast address, with a port below 65280");
+                }
+
+                memcpy(&sconf->multicast, &group, sizeof(sconf->multicast));
+                break;
+
+            case 's':
+                if (strcmp(optarg, "fs") == 0)
+                    sconf->storage = STORE_FS;
+                else if (strcmp(optarg, "memory") == 0)
+                    sconf->storage = STORE_MEMORY;
+                else if (strcmp(optarg, "cas") == 0)
+                    sconf->storage = STORE_CAS;
+                else
+                    error("Storage must be fs, memory or cas");
+                break;
+
+            case 'U':
+                if (atol(optarg) <= 0)
+                    error("Largest upload in memory must be positive");
+
+                sconf->max_upload = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+
+            case 'x':
+                sconf->rewrite = optarg;
+                break;
+
+            case 'g':
+                *multicast = 1;
+                break;
+
             case 'e':
                 *no_ext = 1;
                 break;
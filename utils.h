@@ -9,10 +9,17 @@
 #include <errno.h>
 #include <getopt.h>
 #include <time.h>
+#include <netdb.h>
 
 #include "network.h"
 
 void error(char *msg);
-void opts(int argc, const char *argv[], int *server_port, size_t *pref_buffer_size, size_t *timeout, int *no_ext, enum request_code *type, int *retry, enum tftp_role *role, char *host, size_t host_size, char **filenames);
+int resolve_addr(const char *host, int port, struct sockaddr_storage *addr);
+void any_addr(struct sockaddr_storage *addr, int family, int port);
+socklen_t addr_size(const struct sockaddr_storage *addr);
+int addr_port(const struct sockaddr_storage *addr);
+int addr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+char *format_addr(const struct sockaddr_storage *addr, char *buf, size_t size);
+void opts(int argc, const char *argv[], int *server_port, size_t *pref_buffer_size, size_t *timeout, size_t *utimeout, size_t *windowsize, int *batch, int *rollover, int *no_ext, int *jobs, int *segments, int *multicast, enum request_code *type, int *retry, enum tftp_role *role, char *host, size_t host_size, char **filenames, struct server_conf *sconf);
 
 #endif /* end of include guard: UTILS_H */
@@ -0,0 +1,401 @@
+#include "writer.h"
+
+/* Init the writer threads
+ * Args:
+ *  - wr: Writer to initialize
+ *  - nb_threads: Number of threads writing the blocks
+ *  - max_inflight: Bytes queued above which the workers wait for the disk
+ *  - policy: When the uploads are flushed to the disk
+ *  */
+void init_writer(struct writer *wr, int nb_threads, size_t max_inflight, enum fsync_policy policy)
+{
+    int i;
+
+    bzero(wr, sizeof(*wr));
+    wr->max_inflight = max_inflight;
+    wr->fsync = policy;
+    wr->nb_threads = nb_threads;
+    wr->threads = calloc(nb_threads, sizeof(pthread_t));
+
+    // Blocks are copied to recycled buffers, no allocation per DATA
+    init_pool(&wr->mtu_pool, "write_mtu", sizeof(struct write_req) + MTU_DGRAM_SIZE);
+    init_pool(&wr->jumbo_pool, "write_jumbo", sizeof(struct write_req) + MAX_BLK_SIZE);
+
+    if ((errno = pthread_mutex_init(&wr->lock, NULL)) != 0)
+        error("pthread_mutex_init");
+
+    if ((errno = pthread_cond_init(&wr->work, NULL)) != 0 || (errno = pthread_cond_init(&wr->room, NULL)) != 0)
+        error("pthread_cond_init");
+
+    for (i = 0; i < nb_threads; i++) {
+        if ((errno = pthread_create(&wr->threads[i], NULL, writer_run, wr)) != 0)
+            error("pthread_create");
+    }
+}
+
+/* Hand the temporary file of an upload to the writer threads
+ * Args:
+ *  - wr: Threads writing it
+ *  - fd: Temporary file, see open_temp()
+ *  - path: File the upload replaces once complete
+ *  - tmp_path: Name of the temporary file (freed with the file)
+ * Return:
+ *  The file, to give back with writer_close()
+ *  */
+struct write_file *writer_open(struct writer *wr, int fd, const char *path, char *tmp_path)
+{
+    struct write_file *f;
+
+    f = calloc(1, sizeof(struct write_file));
+    f->fd = fd;
+    f->path = strdup(path);
+    f->tmp_path = tmp_path;
+    f->size = -1;
+    f->wr = wr;
+    f->refs = 1;
+    f->last_sync = now_us();
+
+    return f;
+}
+
+/* Queue a block to write, the worker only waits if too much is queued already
+ * Args:
+ *  - f: File of the upload
+ *  - data: Block received (copied)
+ *  - len: Size of the block
+ *  - offset: Where the block goes in the file
+ * Return:
+ *  - 0: Block queued, it can be acknowledged
+ *  - -1: An earlier block could not be written
+ *  */
+int writer_write(struct write_file *f, const char *data, int len, off_t offset)
+{
+    struct writer *wr = f->wr;
+    struct write_req *req;
+
+    req = pool_get(len <= MTU_DGRAM_SIZE ? &wr->mtu_pool : &wr->jumbo_pool);
+    req->pool = len <= MTU_DGRAM_SIZE ? &wr->mtu_pool : &wr->jumbo_pool;
+    req->f = f;
+    req->offset = offset;
+    req->len = len;
+    req->next = NULL;
+    memcpy(req->data, data, len);
+
+    pthread_mutex_lock(&wr->lock);
+
+    // The disk is behind: hold the worker as a synchronous write would have
+    if (wr->inflight > 0 && wr->inflight + len > wr->max_inflight) {
+        wr->stalls++;
+        TRACE(TRACE_STALL, NULL, offset, wr->inflight / 1024);
+
+        while (wr->inflight > 0 && wr->inflight + len > wr->max_inflight)
+            pthread_cond_wait(&wr->room, &wr->lock);
+    }
+
+    if (f->error != 0) {
+        pthread_mutex_unlock(&wr->lock);
+        pool_put(req->pool, req);
+        return -1;
+    }
+
+    if (wr->tail != NULL)
+        wr->tail->next = req;
+    else
+        wr->head = req;
+    wr->tail = req;
+
+    wr->inflight += len;
+    f->refs++;
+
+    // Writer threads only sleep when the queue is empty
+    if (wr->head == req)
+        pthread_cond_signal(&wr->work);
+    pthread_mutex_unlock(&wr->lock);
+
+    return 0;
+}
+
+/* Put an upload whose every block was received in place, once they are written
+ * An empty block is queued after its last one: the writer thread which leaves the
+ * session alone holding the file commits it and hands it back to its worker (see
+ * writer_done()), so that the worker does not wait on the disk for the last ACK.
+ * Args:
+ *  - f: File of the upload
+ *  - size: Size of the whole file
+ *  - done: Where the worker of the session takes it back
+ *  - s: Session acknowledging the last DATA once it is in place
+ *  */
+void writer_commit(struct write_file *f, long long size, struct write_done *done, struct session *s)
+{
+    struct writer *wr = f->wr;
+    struct write_req *req;
+
+    req = pool_get(&wr->mtu_pool);
+    req->pool = &wr->mtu_pool;
+    req->f = f;
+    req->offset = size;
+    req->len = 0;
+    req->next = NULL;
+
+    pthread_mutex_lock(&wr->lock);
+
+    f->commit_size = size;
+    f->done = done;
+    f->session = s;
+
+    if (wr->tail != NULL)
+        wr->tail->next = req;
+    else
+        wr->head = req;
+    wr->tail = req;
+
+    f->refs++;
+
+    if (wr->head == req)
+        pthread_cond_signal(&wr->work);
+    pthread_mutex_unlock(&wr->lock);
+}
+
+/* Give back a file got with writer_open(), once the session is over
+ * It is closed once its last block queued is written.
+ * Args:
+ *  - f: File of the upload
+ *  */
+void writer_close(struct write_file *f)
+{
+    int last;
+
+    pthread_mutex_lock(&f->wr->lock);
+    last = --f->refs == 0;
+    pthread_mutex_unlock(&f->wr->lock);
+
+    if (last)
+        close_write_file(f);
+}
+
+/* Close the file of an upload nobody uses anymore, removed if it was not committed
+ * Args:
+ *  - f: File to close
+ *  */
+void close_write_file(struct write_file *f)
+{
+    // Aborted or not written: the file it would have replaced is left untouched
+    if (f->size < 0)
+        unlink(f->tmp_path);
+
+    close(f->fd);
+    free(f->tmp_path);
+    free(f->path);
+    free(f);
+}
+
+/* Put an upload in place, its blocks all written, and hand it back to the worker of its
+ * session (run by the writer thread which wrote its last block)
+ * Args:
+ *  - f: File of the upload, see writer_commit()
+ *  */
+void writer_done(struct write_file *f)
+{
+    struct writer *wr = f->wr;
+    uint64_t one = 1;
+    int err, efd;
+
+    pthread_mutex_lock(&wr->lock);
+    err = f->error;
+    pthread_mutex_unlock(&wr->lock);
+
+    if (err == 0)
+        err = commit_file(f->fd, f->tmp_path, f->path, f->commit_size, wr->fsync != FSYNC_NONE);
+
+    pthread_mutex_lock(&wr->lock);
+
+    if (err == 0)
+        f->size = f->commit_size;
+    else if (f->error == 0)
+        f->error = err;
+
+    if (wr->fsync != FSYNC_NONE)
+        wr->syncs++;
+
+    // The worker may release the file as soon as it is linked
+    efd = f->done->efd;
+    f->next_done = f->done->head;
+    f->done->head = f;
+
+    pthread_mutex_unlock(&wr->lock);
+
+    if (write(efd, &one, sizeof(one)) < 0)
+        error("write(eventfd)");
+}
+
+/* Write contiguous blocks of a file at once
+ * Args:
+ *  - f: File of the blocks
+ *  - first: First block, the others follow it in the queue
+ *  - nb: Number of blocks
+ *  - len: Size of the blocks together
+ * Return:
+ *  0, or the errno of the write which failed
+ *  */
+int write_blocks(struct write_file *f, struct write_req *first, int nb, size_t len)
+{
+    struct iovec iov[WRITE_IOVS];
+    struct write_req *req;
+    size_t done, skip;
+    ssize_t n;
+    int k;
+
+    for (req = first, k = 0; k < nb; req = req->next, k++) {
+        iov[k].iov_base = req->data;
+        iov[k].iov_len = req->len;
+    }
+
+    if ((n = pwritev(f->fd, iov, nb, first->offset)) == (ssize_t) len)
+        return 0;
+
+    if (n < 0)
+        return errno;
+
+    // Short write: the rest block by block, until it fails for good
+    done = n;
+
+    for (req = first, k = 0; k < nb; req = req->next, k++) {
+        // Part of this block already written
+        skip = done < (size_t) req->len ? done : (size_t) req->len;
+        done -= skip;
+
+        for (; skip < (size_t) req->len; skip += n) {
+            if ((n = pwrite(f->fd, req->data + skip, req->len - skip, req->offset + skip)) <= 0)
+                return n < 0 ? errno : ENOSPC;
+        }
+    }
+
+    return 0;
+}
+
+/* Write the blocks queued, until the process stops (run by each writer thread)
+ * Args:
+ *  - arg: Writer (struct writer*)
+ * Return:
+ *  Never returns
+ *  */
+void *writer_run(void *arg)
+{
+    struct writer *wr = arg;
+    struct write_req *queue, *req, *next;
+    struct write_file *f;
+    size_t len;
+    int nb, err, sync, last, commit;
+
+    while (1) {
+        pthread_mutex_lock(&wr->lock);
+
+        while (wr->head == NULL)
+            pthread_cond_wait(&wr->work, &wr->lock);
+
+        // Everything queued so far, the lock is taken once for all of them
+        queue = wr->head;
+        wr->head = NULL;
+        wr->tail = NULL;
+
+        pthread_mutex_unlock(&wr->lock);
+
+        while (queue != NULL) {
+            f = queue->f;
+            len = queue->len;
+
+            // Blocks received in order are contiguous: one syscall for the run
+            for (nb = 1, req = queue; nb < WRITE_IOVS && req->next != NULL && req->next->f == f
+                    && req->next->offset == req->offset + req->len; nb++, req = req->next)
+                len += req->next->len;
+
+            next = req->next;
+
+            pthread_mutex_lock(&wr->lock);
+
+            // Several threads may write to the same file: one of them flushes it
+            sync = wr->fsync == FSYNC_PERIODIC && now_us() - f->last_sync >= FSYNC_PERIOD;
+            if (sync)
+                f->last_sync = now_us();
+
+            pthread_mutex_unlock(&wr->lock);
+
+            // The empty block queued by writer_commit() has nothing to write
+            TRACE(TRACE_WRITE, NULL, queue->offset, len);
+            err = len > 0 ? write_blocks(f, queue, nb, len) : 0;
+            TRACE(TRACE_WRITTEN, NULL, queue->offset, err);
+
+            if (sync && err == 0 && fsync(f->fd) < 0)
+                err = errno;
+
+            pthread_mutex_lock(&wr->lock);
+
+            if (err != 0) {
+                if (f->error == 0)
+                    f->error = err;
+                wr->errors += nb;
+            }
+
+            wr->writes += nb;
+            wr->syncs += sync;
+            f->refs -= nb;
+            last = f->refs == 0;
+
+            // Every block written, the session is the only one left holding it
+            commit = f->refs == 1 && f->done != NULL;
+
+            pthread_mutex_unlock(&wr->lock);
+
+            if (last)
+                close_write_file(f);
+
+            if (commit)
+                writer_done(f);
+
+            // Only counted as written once closed, for drain_writer()
+            pthread_mutex_lock(&wr->lock);
+            wr->inflight -= len;
+            pthread_cond_broadcast(&wr->room);
+            pthread_mutex_unlock(&wr->lock);
+
+            for (; queue != next; queue = req) {
+                req = queue->next;
+                pool_put(queue->pool, queue);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Wait until every block queued is written (before stopping the process)
+ * Args:
+ *  - wr: Writer to wait for
+ *  */
+void drain_writer(struct writer *wr)
+{
+    pthread_mutex_lock(&wr->lock);
+
+    while (wr->inflight > 0)
+        pthread_cond_wait(&wr->room, &wr->lock);
+
+    pthread_mutex_unlock(&wr->lock);
+}
+
+/* Print the counters of the writer threads
+ * Args:
+ *  - out: Where to print
+ *  - wr: Writer to print
+ *  */
+void print_writer(FILE *out, struct writer *wr)
+{
+    pthread_mutex_lock(&wr->lock);
+
+    fprintf(out, "%-10s threads=%d inflight=%zu max_inflight=%zu writes=%lu syncs=%lu stalls=%lu errors=%lu\n",
+            "writer", wr->nb_threads, wr->inflight, wr->max_inflight, wr->writes, wr->syncs, wr->stalls, wr->errors);
+
+    pthread_mutex_unlock(&wr->lock);
+
+    print_pool(out, "writer", &wr->mtu_pool);
+    print_pool(out, "writer", &wr->jumbo_pool);
+}
@@ -0,0 +1,75 @@
+#ifndef WRITER_H
+
+#define WRITER_H
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include "network.h"
+
+#define DEFAULT_WRITERS 2 // Threads writing the uploads by default (0: written by the workers)
+#define DEFAULT_MAX_INFLIGHT 64 // Memory of the blocks received and not written yet, by default (MB)
+#define FSYNC_PERIOD USEC // Time between two fsync() of an upload with the periodic policy (us)
+#define WRITE_IOVS 64 // Most contiguous blocks written by one pwritev()
+
+/* File of an upload, written by the writer threads */
+struct write_file {
+    int fd; // File written
+    char *path; // Name of the file, replaced once the upload is complete
+    char *tmp_path; // Temporary file written, renamed to path (removed if the upload fails)
+    long long size; // Size of the complete upload (-1 until put in place by writer_done())
+    struct writer *wr; // Threads writing it
+    int refs; // Session and blocks queued still using it (protected by the lock of wr)
+    int error; // errno of the first write which failed (0 if none)
+    long long last_sync; // Date (us) of the last fsync()
+    long long commit_size; // Size put in place once its blocks are written (see writer_commit())
+    struct write_done *done; // Where it is handed back once put in place (NULL until writer_commit())
+    struct session *session; // Session waiting to acknowledge its last DATA
+    struct write_file *next_done; // Next file handed back to the same worker
+};
+
+/* Block received, to write */
+struct write_req {
+    struct pool *pool; // Pool it comes from (size class)
+    struct write_file *f; // File to write it to
+    off_t offset; // Where in the file
+    int len; // Size of the block
+    struct write_req *next; // Next block in the queue
+    char data[]; // Copy of the block
+};
+
+/* Threads writing the uploads of every worker, so that ACKs do not wait on the disk */
+struct writer {
+    pthread_mutex_t lock; // Protects everything below (and the refs of the files)
+    pthread_cond_t work; // Blocks were queued
+    pthread_cond_t room; // Blocks were written
+    struct write_req *head; // Oldest block queued
+    struct write_req *tail; // Newest block queued
+    size_t inflight; // Bytes queued and not written yet
+    size_t max_inflight; // Bytes queued above which the workers wait
+    enum fsync_policy fsync; // When the uploads are flushed to the disk
+    struct pool mtu_pool; // Blocks fitting an Ethernet MTU
+    struct pool jumbo_pool; // Larger blocks, up to the largest blksize
+    int nb_threads; // Number of writer threads
+    pthread_t *threads; // Writer threads
+    unsigned long writes; // Blocks written
+    unsigned long syncs; // fsync() done
+    unsigned long stalls; // Times a worker waited for room in the queue
+    unsigned long errors; // Blocks which could not be written
+};
+
+void init_writer(struct writer *wr, int nb_threads, size_t max_inflight, enum fsync_policy policy);
+struct write_file *writer_open(struct writer *wr, int fd, const char *path, char *tmp_path);
+void writer_commit(struct write_file *f, long long size, struct write_done *done, struct session *s);
+int writer_write(struct write_file *f, const char *data, int len, off_t offset);
+void writer_close(struct write_file *f);
+void close_write_file(struct write_file *f);
+void writer_done(struct write_file *f);
+int write_blocks(struct write_file *f, struct write_req *first, int nb, size_t len);
+void *writer_run(void *arg);
+void drain_writer(struct writer *wr);
+void print_writer(FILE *out, struct writer *wr);
+
+#endif /* end of include guard: WRITER_H */